@@ -12,6 +12,10 @@
 #include <time.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define ifelse1(func, p1, e1)\
   if((func)(p1)) e1
@@ -66,7 +70,7 @@ bool push_unit(void* *base, size_t *count,
   push_unit((void**)(baseptr), countptr, sizeof((baseptr)[0][0]), (new_obj))
 
 #define push_objs(baseptr, countptr, objs_count, new_objs)	\
-  push_multiple((void**)baseptr, countptr, sizeof(baseptr[0][0]),objs_count, (new_objs))
+  push_multiple((void**)(baseptr), countptr, sizeof((baseptr)[0][0]), objs_count, (new_objs))
 
 typedef bool (*eq_pred_fn)(const void* key,const void* data);
 
@@ -165,6 +169,12 @@ struct LinkedNativeString {
   LinkedNativeString *prev;
   LinkedNativeString *next;
   size_t capacity;
+  //text_version of the last edit that touched this chunk
+  size_t stamp;
+  //Slot in the trigram index, 0 when not indexed
+  uint32_t index_slot;
+  //Leaf in the chunk index, only meaningful while the index agrees
+  size_t index_pos;
   StringViewNative str;
 };
 
@@ -174,13 +184,28 @@ struct TextLocation {
   int offset;
 };
 
+//Bumped by every edit, chunks remember the version they were last touched at
+size_t text_version = 1;
+
+//Bytes per chunk, node splits keep the capacity of the node they came from
+size_t chunk_capacity = 4096;
+
+void mark_chunk_dirty(LinkedNativeString* node){
+  if(node)
+    node->stamp = text_version;
+}
+
 
 //Custom default font and stuff
 RlFont default_font;
+//Changes whenever default_font is swapped for another atlas
+size_t font_serial = 0;
 float default_spacing_factor = 0.1f;
+//Text draw calls made in the current frame
+size_t text_draw_calls = 0;
 
 void draw_text(const char* text, int posx, int posy, int fontsize, RlColor color){
-
+  text_draw_calls++;
   rl_draw_text_ex(default_font, text, (RlVector2){.x = posx, .y = posy},
 		  fontsize, default_spacing_factor * fontsize, color);
 }
@@ -192,273 +217,6990 @@ int measure_text(const char* text, int fontsize){
 					 fontsize * default_spacing_factor).x);
 }
 
-//-1 means newline
-int get_char_width(char ch, int fontsize){
-  
-  int twospacelen = measure_text("  ", fontsize);
-  int onespacelen = measure_text(" ", fontsize);
+//Render backends
+//Everything is drawn through the raylib function pointers, so the table
+//they make up is the backend. rl_init_lib fills it with raylib. The
+//headless backend, for -bench, points the window, input, texture and draw
+//entries at functions that count what would be drawn instead, so the whole
+//frame runs with no window or GPU. Fonts are still rasterized on the CPU,
+//their textures are ids that name nothing. The mouse wheel scrolls down
+//through the first third of the frames, is left alone for the next, when
+//only the cursor blinks, and scrolls back up through the rest.
+typedef struct RenderStats RenderStats;
+struct RenderStats {
+  size_t frames;
+  double seconds;
+  //Totals over the frames
+  size_t calls;
+  size_t glyphs;
+  size_t rects;
+  //Vertex bytes the quads take
+  size_t bytes;
+  //Most any one frame took
+  size_t max_calls;
+  size_t max_glyphs;
+  size_t max_bytes;
+  double max_seconds;
+};
 
-  if(('\n' == ch ) ||
-     ('\r' == ch )){
-    return -1;
+enum {
+  //4 vertices of position, texcoord and color
+  RENDER_QUAD_BYTES = 4 * (5 * sizeof(float) + 4)
+};
+
+typedef struct HeadlessBackend HeadlessBackend;
+struct HeadlessBackend {
+  int width;
+  int height;
+  size_t frames_left;
+  size_t frame_count;
+  float scroll;
+  unsigned int texture_ids;
+  LARGE_INTEGER start;
+  LARGE_INTEGER frame_start;
+  LARGE_INTEGER frequency;
+  //The frame being drawn
+  RenderStats frame;
+  RenderStats total;
+};
+HeadlessBackend headless = {0};
+
+double headless_seconds_since(LARGE_INTEGER since){
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return (double)(now.QuadPart - since.QuadPart) / headless.frequency.QuadPart;
+}
+
+void headless_quads(size_t calls, size_t glyphs, size_t rects){
+  headless.frame.calls += calls;
+  headless.frame.glyphs += glyphs;
+  headless.frame.rects += rects;
+  headless.frame.bytes += (glyphs + rects) * RENDER_QUAD_BYTES;
+}
+
+bool headless_draws_glyph(int codepoint){
+  return (codepoint != ' ') && (codepoint != '\t') &&
+    (codepoint != '\n') && (codepoint != '\r');
+}
+
+void headless_init_window(int width, int height, const char* title){
+  (void)title;
+  headless.width = width;
+  headless.height = height;
+  QueryPerformanceFrequency(&headless.frequency);
+  QueryPerformanceCounter(&headless.start);
+  headless.frame_start = headless.start;
+}
+
+//Closing the window, beginning a frame and ending a mode
+void headless_none(void){
+}
+
+bool headless_window_should_close(void){
+  return headless.frames_left == 0;
+}
+
+void headless_end_drawing(void){
+  RenderStats* frame = &headless.frame;
+  RenderStats* total = &headless.total;
+  frame->seconds = headless_seconds_since(headless.frame_start);
+  QueryPerformanceCounter(&headless.frame_start);
+  total->frames++;
+  total->seconds += frame->seconds;
+  total->calls += frame->calls;
+  total->glyphs += frame->glyphs;
+  total->rects += frame->rects;
+  total->bytes += frame->bytes;
+  if(frame->calls > total->max_calls)
+    total->max_calls = frame->calls;
+  if(frame->glyphs > total->max_glyphs)
+    total->max_glyphs = frame->glyphs;
+  if(frame->bytes > total->max_bytes)
+    total->max_bytes = frame->bytes;
+  if(frame->seconds > total->max_seconds)
+    total->max_seconds = frame->seconds;
+  *frame = (RenderStats){0};
+  headless.frames_left--;
+}
+
+void headless_clear_background(RlColor color){
+  (void)color;
+  headless_quads(1, 0, 1);
+}
+
+void headless_draw_rectangle(int x, int y, int width, int height,
+			     RlColor color){
+  (void)x; (void)y; (void)width; (void)height; (void)color;
+  headless_quads(1, 0, 1);
+}
+
+void headless_draw_text_ex(RlFont font, const char* text, RlVector2 position,
+			   float size, float spacing, RlColor tint){
+  (void)font; (void)position; (void)size; (void)spacing; (void)tint;
+  size_t glyphs = 0;
+  while(*text){
+    int len;
+    if(headless_draws_glyph(rl_get_codepoint_next(text, &len)))
+      glyphs++;
+    text += len;
   }
-      
-  char letter[2] = {ch};
+  headless_quads(1, glyphs, 0);
+}
 
-  int len = measure_text(letter, fontsize) +
-    twospacelen - onespacelen*2;
-  return len;
+void headless_draw_text_codepoints(RlFont font, const int* codepoints,
+				   int count, RlVector2 position, float size,
+				   float spacing, RlColor tint){
+  (void)font; (void)position; (void)size; (void)spacing; (void)tint;
+  size_t glyphs = 0;
+  for(int i = 0; i < count; ++i)
+    glyphs += headless_draws_glyph(codepoints[i]);
+  headless_quads(1, glyphs, 0);
 }
 
+void headless_draw_text_codepoint(RlFont font, int codepoint,
+				  RlVector2 position, float size,
+				  RlColor tint){
+  (void)font; (void)position; (void)size; (void)tint;
+  headless_quads(1, headless_draws_glyph(codepoint), 0);
+}
 
-typedef struct KeyRecorder KeyRecorder;
-struct KeyRecorder{
-  struct KeyTime{
-    int key;
-    double last_time;
-  } *times ;
-  size_t count ;
+RlTexture2D headless_load_texture_from_image(RlImage image){
+  return (RlTexture2D){
+    .id = ++headless.texture_ids,
+    .width = image.width,
+    .height = image.height,
+    .mipmaps = 1,
+    .format = image.format
+  };
+}
+
+RlRenderTexture2D headless_load_render_texture(int width, int height){
+  RlImage image = {.width = width, .height = height,
+		   .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+  return (RlRenderTexture2D){
+    .id = ++headless.texture_ids,
+    .texture = headless_load_texture_from_image(image)
+  };
+}
+
+void headless_unload_render_texture(RlRenderTexture2D target){
+  (void)target;
+}
+
+void headless_begin_texture_mode(RlRenderTexture2D target){
+  (void)target;
+}
+
+void headless_blend_mode(int mode){
+  (void)mode;
+}
+
+void headless_draw_texture_rec(RlTexture2D texture, RlRectangle source,
+			       RlVector2 position, RlColor tint){
+  (void)texture; (void)source; (void)position; (void)tint;
+  headless_quads(1, 0, 1);
+}
+
+RlFont headless_load_font_ex(const char* file_name, int size, int* codepoints,
+			     int codepoint_count){
+  RlFont font = {.baseSize = size, .glyphCount = 95};
+  if(codepoints)
+    font.glyphCount = codepoint_count;
+  int file_size;
+  unsigned char* data = rl_load_file_data(file_name, &file_size);
+  if(nullptr == data)
+    return (RlFont){0};
+  font.glyphs = rl_load_font_data(data, file_size, size, codepoints,
+				  font.glyphCount, FONT_DEFAULT);
+  rl_unload_file_data(data);
+  if(nullptr == font.glyphs)
+    return (RlFont){0};
+  RlImage atlas = rl_gen_image_font_atlas(font.glyphs, &font.recs,
+					  font.glyphCount, size, 4, 0);
+  //Same padding raylib loads fonts with
+  font.glyphPadding = 4;
+  font.texture = headless_load_texture_from_image(atlas);
+  rl_unload_image(atlas);
+  return font;
+}
+
+void headless_unload_font(RlFont font){
+  rl_unload_font_data(font.glyphs, font.glyphCount);
+  rl_mem_free(font.recs);
+}
+
+int headless_get_screen_width(void){
+  return headless.width;
+}
+
+int headless_get_screen_height(void){
+  return headless.height;
+}
+
+bool headless_key(int key){
+  (void)key;
+  return false;
+}
+
+int headless_get_char_pressed(void){
+  return 0;
+}
+
+float headless_get_mouse_wheel_move(void){
+  size_t third = headless.frame_count / 3;
+  if(headless.frames_left > headless.frame_count - third)
+    return -headless.scroll;
+  if(headless.frames_left > third)
+    return 0;
+  return headless.scroll;
+}
+
+RlVector2 headless_get_mouse_position(void){
+  return (RlVector2){0};
+}
+
+double headless_get_time(void){
+  return headless_seconds_since(headless.start);
+}
+
+//After rl_init_lib, draws frame_count frames then closes
+void use_headless_backend(size_t frame_count){
+  headless.frames_left = headless.frame_count = frame_count;
+  headless.scroll = 3;
+  rl_init_window = headless_init_window;
+  rl_close_window = headless_none;
+  rl_window_should_close = headless_window_should_close;
+  rl_begin_drawing = headless_none;
+  rl_end_drawing = headless_end_drawing;
+  rl_clear_background = headless_clear_background;
+  rl_draw_rectangle = headless_draw_rectangle;
+  rl_draw_rectangle_lines = headless_draw_rectangle;
+  rl_draw_text_ex = headless_draw_text_ex;
+  rl_draw_text_codepoints = headless_draw_text_codepoints;
+  rl_draw_text_codepoint = headless_draw_text_codepoint;
+  rl_load_texture_from_image = headless_load_texture_from_image;
+  rl_load_font_ex = headless_load_font_ex;
+  rl_load_render_texture = headless_load_render_texture;
+  rl_unload_render_texture = headless_unload_render_texture;
+  rl_begin_texture_mode = headless_begin_texture_mode;
+  rl_end_texture_mode = headless_none;
+  rl_begin_blend_mode = headless_blend_mode;
+  rl_end_blend_mode = headless_none;
+  rl_draw_texture_rec = headless_draw_texture_rec;
+  rl_unload_font = headless_unload_font;
+  rl_get_screen_width = headless_get_screen_width;
+  rl_get_screen_height = headless_get_screen_height;
+  rl_is_key_down = headless_key;
+  rl_is_key_pressed = headless_key;
+  rl_is_key_released = headless_key;
+  rl_is_mouse_button_pressed = headless_key;
+  rl_get_char_pressed = headless_get_char_pressed;
+  rl_get_mouse_wheel_move = headless_get_mouse_wheel_move;
+  rl_get_mouse_position = headless_get_mouse_position;
+  rl_get_time = headless_get_time;
+}
+
+void print_render_stats(const RenderStats* stats){
+  if(stats->frames == 0)
+    return;
+  double frames = stats->frames;
+  printf("frames: %zu  ms/frame: %.3f (max %.3f)\n",
+	 stats->frames, 1000 * stats->seconds / frames,
+	 1000 * stats->max_seconds);
+  printf("per frame: draw calls %.1f (max %zu)  glyphs %.1f (max %zu)  "
+	 "rects %.1f  bytes %.0f (max %zu)\n",
+	 stats->calls / frames, stats->max_calls,
+	 stats->glyphs / frames, stats->max_glyphs,
+	 stats->rects / frames,
+	 stats->bytes / frames, stats->max_bytes);
+}
+
+//Idle frames
+//A frame that drew nothing new, left the main thread nothing to step
+//through and has no input behind it is followed by a wait instead of the
+//next frame. The wait ends on any message for the window, on frame_wake,
+//which the workers set as they publish, or at the next deadline, the
+//cursor blink or the autosave. raylib's own event waiting could only be
+//woken by the window, so the thread waits on both itself.
+#ifdef _MSC_VER
+#pragma comment(lib, "user32")
+#endif
+HANDLE frame_wake = nullptr;
+
+void wake_frame(void){
+  if(frame_wake)
+    SetEvent(frame_wake);
+}
+
+//Whether the input polled at the end of the frame gives the next one
+//anything to do
+bool input_waiting(void){
+  if(rl_get_key_pressed() || rl_is_window_resized() ||
+     (0.0f != rl_get_mouse_wheel_move()))
+    return true;
+  RlVector2 delta = rl_get_mouse_delta();
+  if((0.0f != delta.x) || (0.0f != delta.y))
+    return true;
+  //Held keys repeat by the clock
+  for(int key = KEY_SPACE; key <= KEY_KB_MENU; ++key)
+    if(rl_is_key_down(key))
+      return true;
+  for(int button = MOUSE_BUTTON_LEFT; button <= MOUSE_BUTTON_BACK; ++button)
+    if(rl_is_mouse_button_down(button))
+      return true;
+  return false;
+}
+
+//Waits until deadline, by rl_get_time, unless woken first
+void wait_for_frame(double deadline){
+  double left = deadline - rl_get_time();
+  if(left <= 0.0)
+    return;
+  MsgWaitForMultipleObjectsEx(frame_wake ? 1 : 0, &frame_wake,
+			      (DWORD)(left * 1000) + 1, QS_ALLINPUT,
+			      MWMO_INPUTAVAILABLE);
+  rl_poll_input_events();
+}
+
+//Frames drawn in the last whole minute, and so far in this one
+typedef struct FrameCount FrameCount;
+struct FrameCount {
+  double minute_start;
+  size_t this_minute;
+  size_t last_minute;
 };
-bool key_time_eq_fn(const void* key, const void* data){
-  const int* ikey = key;
-  const struct KeyTime* kdata = data;
-  return *ikey == kdata->key;
+
+void frame_count_tick(FrameCount* fc, double now){
+  if(now - fc->minute_start >= 60.0){
+    //None at all in the minute before this one when it waited longer
+    fc->last_minute = (now - fc->minute_start >= 120.0) ? 0 : fc->this_minute;
+    fc->this_minute = 0;
+    fc->minute_start = now;
+  }
+  fc->this_minute++;
 }
-int get_key_count(KeyRecorder* recorder, int keycode){   
-    int count_press = 0;
-    const double first_time = 0.5;
-    const double not_first_time = 0.01;
-    struct KeyTime* item = get_obj((recorder->times),
-				   (recorder->count),
-				   &keycode,
-				   key_time_eq_fn);
-    
-    if(rl_is_key_pressed(keycode)){
-      if(item == nullptr){
-	struct KeyTime dat = {.key = keycode};
-	if(!push_obj(&(recorder->times), &(recorder->count), &dat))
-	  return 0;
-	item = get_obj((recorder->times),
-				   (recorder->count),
-				   &keycode,
-				   key_time_eq_fn);
-      }
-      
-      item->last_time = rl_get_time() + first_time;
-      count_press = 1;
+
+//Fallback faces
+//A codepoint the first face has no glyph for is drawn with the first face
+//down the chain whose cmap maps it. Bold and italic text is drawn with a
+//face of its own when that has the glyph, with the chain otherwise. Which
+//faces have a codepoint gets looked up once and kept in pages of 256 made
+//as the text reaches them, a byte each: the chain's face in the low bits
+//and a bit per style face above.
+enum TextStyle {
+  STYLE_REGULAR,
+  STYLE_BOLD,
+  STYLE_ITALIC,
+  STYLE_COUNT
+};
+
+enum {
+  FACE_MAX = 8,
+  FACE_UNKNOWN = 0xFF,
+  FACE_CHAIN_BITS = 0x0F,
+  //Codepoint and style packed in one key, the advance cache's and face_of's
+  STYLE_SHIFT = 21,
+  CODEPOINT_MASK = (1 << STYLE_SHIFT) - 1
+};
+
+typedef struct FontFace FontFace;
+struct FontFace {
+  unsigned char* data;
+  int size;
+  //Subtable of the cmap looked in, format 4 or 12
+  const unsigned char* cmap;
+  size_t cmap_len;
+  int format;
+};
+
+typedef struct FaceChain FaceChain;
+struct FaceChain {
+  FontFace faces[FACE_MAX];
+  int count;
+  //Faces before this are the fallback chain
+  int chain_count;
+  //0 for none, so the chain draws it
+  int style_faces[STYLE_COUNT];
+  uint8_t* pages[0x110000 / 256];
+};
+
+FaceChain face_chain = {0};
+//Atlas each face after the first draws with this frame, glyphCount 0 when
+//it has none yet. The first face draws with default_font.
+RlFont face_fonts[FACE_MAX];
+
+RlFont font_of_face(int face){
+  return face ? face_fonts[face] : default_font;
+}
+
+uint32_t ttf_u16(const unsigned char* p){
+  return ((uint32_t)p[0] << 8) | p[1];
+}
+
+uint32_t ttf_u32(const unsigned char* p){
+  return (ttf_u16(p) << 16) | ttf_u16(p + 2);
+}
+
+//Finds the cmap subtable to look codepoints up in, false when the file has
+//none it can read
+bool face_open(FontFace* face){
+  const unsigned char* d = face->data;
+  size_t size = face->size;
+  if(size < 12)
+    return false;
+  size_t tables = ttf_u16(d + 4);
+  size_t cmap = 0;
+  for(size_t i = 0; (i < tables) && (12 + 16 * (i + 1) <= size); ++i){
+    const unsigned char* rec = d + 12 + 16 * i;
+    if(0 == memcmp(rec, "cmap", 4))
+      cmap = ttf_u32(rec + 8);
+  }
+  if(!cmap || (cmap + 4 > size))
+    return false;
+  size_t subtables = ttf_u16(d + cmap + 2);
+  //Full repertoire first, the BMP one otherwise
+  int best = 0;
+  for(size_t i = 0; (i < subtables) && (cmap + 4 + 8 * (i + 1) <= size); ++i){
+    const unsigned char* rec = d + cmap + 4 + 8 * i;
+    uint32_t platform = ttf_u16(rec);
+    uint32_t encoding = ttf_u16(rec + 2);
+    size_t at = cmap + ttf_u32(rec + 4);
+    if(((0 != platform) && ((3 != platform) || ((1 != encoding) && (10 != encoding)))) ||
+       (at + 8 > size))
+      continue;
+    int format = ttf_u16(d + at);
+    size_t len = (12 == format) ? ttf_u32(d + at + 4) : ttf_u16(d + at + 2);
+    if((len > size - at) || ((12 != format) && (4 != format)) ||
+       (format <= best))
+      continue;
+    best = format;
+    face->cmap = d + at;
+    face->cmap_len = len;
+  }
+  face->format = best;
+  return 0 != best;
+}
+
+//Glyph index the face's cmap gives codepoint, 0 when it has none
+uint32_t face_glyph(const FontFace* face, int codepoint){
+  const unsigned char* t = face->cmap;
+  size_t len = face->cmap_len;
+  if(12 == face->format){
+    if(len < 16)
+      return 0;
+    size_t groups = ttf_u32(t + 12);
+    if(groups > (len - 16) / 12)
+      groups = (len - 16) / 12;
+    size_t lo = 0;
+    size_t hi = groups;
+    while(lo < hi){
+      size_t mid = lo + (hi - lo) / 2;
+      const unsigned char* group = t + 16 + 12 * mid;
+      if(ttf_u32(group + 4) < (uint32_t)codepoint)
+	lo = mid + 1;
+      else
+	hi = mid;
     }
-    if(!count_press &&
-       rl_is_key_down(keycode) &&
-       ((rl_get_time() - item->last_time ) > not_first_time)){
-      if(!item)
-	return 0;
-      double diff = rl_get_time() - item->last_time;
-      while(diff > 0.0){
-	diff -= not_first_time;
-	count_press++;
+    if(lo == groups)
+      return 0;
+    const unsigned char* group = t + 16 + 12 * lo;
+    if(ttf_u32(group) > (uint32_t)codepoint)
+      return 0;
+    return ttf_u32(group + 8) + (codepoint - ttf_u32(group));
+  }
+  if((4 != face->format) || (codepoint > 0xFFFF) || (len < 14))
+    return 0;
+  size_t segs = ttf_u16(t + 6) / 2;
+  if(16 + 8 * segs > len)
+    return 0;
+  const unsigned char* ends = t + 14;
+  const unsigned char* starts = ends + 2 * segs + 2;
+  const unsigned char* deltas = starts + 2 * segs;
+  const unsigned char* ranges = deltas + 2 * segs;
+  size_t lo = 0;
+  size_t hi = segs;
+  while(lo < hi){
+    size_t mid = lo + (hi - lo) / 2;
+    if(ttf_u16(ends + 2 * mid) < (uint32_t)codepoint)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if((lo == segs) || (ttf_u16(starts + 2 * lo) > (uint32_t)codepoint))
+    return 0;
+  uint32_t delta = ttf_u16(deltas + 2 * lo);
+  uint32_t range = ttf_u16(ranges + 2 * lo);
+  if(0 == range)
+    return (codepoint + delta) & 0xFFFF;
+  //The offset counts from where it is stored
+  size_t at = (ranges + 2 * lo - t) + range +
+    2 * (codepoint - ttf_u16(starts + 2 * lo));
+  if(at + 2 > len)
+    return 0;
+  uint32_t glyph = ttf_u16(t + at);
+  return glyph ? ((glyph + delta) & 0xFFFF) : 0;
+}
+
+//Takes over data, a face whose cmap cannot be read is left out. Regular
+//faces make the chain in the order added, all of them before any styled.
+bool face_chain_add(FaceChain* chain, enum TextStyle style, unsigned char* data,
+		    int size){
+  FontFace face = {.data = data, .size = size};
+  if((chain->count == FACE_MAX) || (nullptr == data) || !face_open(&face) ||
+     ((STYLE_REGULAR == style) && (chain->count != chain->chain_count))){
+    rl_unload_file_data(data);
+    return false;
+  }
+  if(STYLE_REGULAR == style)
+    chain->chain_count++;
+  else
+    chain->style_faces[style] = chain->count;
+  chain->faces[chain->count++] = face;
+  return true;
+}
+
+void face_chain_free(FaceChain* chain){
+  for(int i = 0; i < chain->count; ++i)
+    rl_unload_file_data(chain->faces[i].data);
+  for(size_t i = 0; i < _countof(chain->pages); ++i)
+    free(chain->pages[i]);
+  *chain = (FaceChain){0};
+}
+
+//Face that draws the codepoint and style of key, the first one when none
+//has it. ASCII is taken to be in every face.
+int face_of(int key){
+  FaceChain* chain = &face_chain;
+  int codepoint = key & CODEPOINT_MASK;
+  int style = key >> STYLE_SHIFT;
+  int styled = (style < STYLE_COUNT) ? chain->style_faces[style] : 0;
+  if(codepoint < 0x80)
+    return styled;
+  if((chain->count < 2) || (codepoint >= 0x110000))
+    return 0;
+  uint8_t** page = chain->pages + (codepoint >> 8);
+  if(nullptr == *page){
+    *page = malloc(256);
+    if(nullptr == *page)
+      return 0;
+    memset(*page, FACE_UNKNOWN, 256);
+  }
+  uint8_t* faces = *page + (codepoint & 0xFF);
+  if(FACE_UNKNOWN == *faces){
+    *faces = 0;
+    for(int i = 0; i < chain->chain_count; ++i){
+      if(face_glyph(chain->faces + i, codepoint)){
+	*faces = i;
+	break;
       }
-      item->last_time = rl_get_time();
     }
-    return count_press;
+    for(int s = 1; s < STYLE_COUNT; ++s)
+      if(chain->style_faces[s] &&
+	 face_glyph(chain->faces + chain->style_faces[s], codepoint))
+	*faces |= (FACE_CHAIN_BITS + 1) << (s - 1);
+  }
+  if(styled && (*faces & ((FACE_CHAIN_BITS + 1) << (style - 1))))
+    return styled;
+  return *faces & FACE_CHAIN_BITS;
 }
 
+//Glyph advances
+//Width of each codepoint at the current font and size, the same numbers
+//measure_text gives, filled in from the glyph info the first time one is
+//asked for. The BMP goes in a flat table, anything above in a small open
+//addressed one. A different font or size starts it over.
+typedef struct GlyphAdvance GlyphAdvance;
+struct GlyphAdvance {
+  //ADVANCE_UNKNOWN until asked for
+  int16_t width;
+  //Face it is drawn with
+  uint8_t face;
+  //How far rl_draw_text_codepoints moves past it, unrounded
+  float pen;
+};
 
-void snap_cursor_left(TextLocation *loc){
+typedef struct AdvanceCache AdvanceCache;
+struct AdvanceCache {
+  size_t font_serial;
+  int font_size;
+  GlyphAdvance* bmp;
+  uint32_t* astral_keys;
+  GlyphAdvance* astral_widths;
+  size_t astral_cap;
+  size_t astral_count;
+  //What a spacing adds between two letters, after rounding
+  int spacing;
+};
 
-  while((loc->node->prev) && 
-	((0 == loc->node->str.len) ||
-	 (0 == loc->offset))){
-    loc->node = loc->node->prev;
-    loc->offset = loc->node->str.len;
+enum {
+  ADVANCE_UNKNOWN = INT16_MIN
+};
+
+AdvanceCache advance_cache = {0};
+
+//Codepoints met in the text that the current atlas has no glyph for, with
+//their styles as face_of takes them. The font atlases take them each frame.
+int* missing_glyphs = nullptr;
+size_t missing_glyph_count = 0;
+
+void advance_cache_free(AdvanceCache* cache){
+  free(cache->bmp);
+  free(cache->astral_keys);
+  free(cache->astral_widths);
+  *cache = (AdvanceCache){0};
+}
+
+//Unscaled advance as MeasureTextEx adds it up
+int glyph_units(RlFont font, int codepoint){
+  RlGlyphInfo info = rl_get_glyph_info(font, codepoint);
+  if(info.advanceX)
+    return info.advanceX;
+  return (int)rl_get_glyph_atlas_rec(font, codepoint).width + info.offsetX;
+}
+
+//Advance of the codepoint and style of key
+GlyphAdvance advance_of(int key, int fontsize){
+  int codepoint = key & CODEPOINT_MASK;
+  int face = face_of(key);
+  RlFont font = font_of_face(face);
+  bool has = false;
+  if(font.glyphCount)
+    has = (rl_get_glyph_info(font, codepoint).value == codepoint);
+  //Shown unstyled until an atlas with it comes, and as the first face's '?'
+  //until that has it. Control bytes stay '?'.
+  if(!has && ((codepoint >= 0x80) || face)){
+    push_obj(&missing_glyphs, &missing_glyph_count, &key);
+    if(key != codepoint)
+      return advance_of(codepoint, fontsize);
+    face = 0;
+    font = default_font;
   }
+  float scale = fontsize / (float)font.baseSize;
+  //Drawing falls back on the atlas width alone
+  RlGlyphInfo info = rl_get_glyph_info(font, codepoint);
+  float units = info.advanceX ? info.advanceX :
+    rl_get_glyph_atlas_rec(font, codepoint).width;
+  return (GlyphAdvance){
+    .width = (int)(0.5f + glyph_units(font, codepoint) * scale) +
+    advance_cache.spacing,
+    .face = face,
+    .pen = units * scale + fontsize * default_spacing_factor
+  };
 }
 
-void snap_cursor_right(TextLocation *loc){
-  while((loc->node->next) &&
-	((0 == loc->node->str.len) ||
-	 (loc->offset == loc->node->str.len))){
-    loc->node = loc->node->next;
-    loc->offset = 0;
+//Advance of a codepoint, or of a codepoint and style packed as for face_of.
+//False when out of memory.
+bool cached_advance(int codepoint, int fontsize, GlyphAdvance* advance){
+  AdvanceCache* cache = &advance_cache;
+  if((cache->font_serial != font_serial) ||
+     (cache->font_size != fontsize) || (nullptr == cache->bmp)){
+    advance_cache_free(cache);
+    cache->bmp = malloc(0x10000 * sizeof(cache->bmp[0]));
+    if(nullptr == cache->bmp)
+      return false;
+    for(size_t i = 0; i < 0x10000; ++i)
+      cache->bmp[i].width = ADVANCE_UNKNOWN;
+    cache->font_serial = font_serial;
+    cache->font_size = fontsize;
+    //measure_text("  ") - 2 * measure_text(" ") for a single space glyph
+    float scale = fontsize / (float)default_font.baseSize;
+    int space = glyph_units(default_font, ' ');
+    cache->spacing = (int)(0.5f + (float)(2 * space) * scale +
+			   fontsize * default_spacing_factor) -
+      2 * (int)(0.5f + space * scale);
+  }
+  if(codepoint < 0x10000){
+    if(ADVANCE_UNKNOWN == cache->bmp[codepoint].width)
+      cache->bmp[codepoint] = advance_of(codepoint, fontsize);
+    *advance = cache->bmp[codepoint];
+    return true;
   }
+  if(2 * (cache->astral_count + 1) > cache->astral_cap){
+    size_t cap = cache->astral_cap ? 2 * cache->astral_cap : 64;
+    uint32_t* keys = calloc(cap, sizeof(keys[0]));
+    GlyphAdvance* widths = malloc(cap * sizeof(widths[0]));
+    if(!keys || !widths){
+      free(keys);
+      free(widths);
+      return false;
+    }
+    for(size_t i = 0; i < cache->astral_cap; ++i){
+      if(0 == cache->astral_keys[i])
+	continue;
+      size_t at = (cache->astral_keys[i] * 0x9E3779B1u) & (cap - 1);
+      while(keys[at])
+	at = (at + 1) & (cap - 1);
+      keys[at] = cache->astral_keys[i];
+      widths[at] = cache->astral_widths[i];
+    }
+    free(cache->astral_keys);
+    free(cache->astral_widths);
+    cache->astral_keys = keys;
+    cache->astral_widths = widths;
+    cache->astral_cap = cap;
+  }
+  size_t at = ((uint32_t)codepoint * 0x9E3779B1u) & (cache->astral_cap - 1);
+  while(cache->astral_keys[at] && (cache->astral_keys[at] != (uint32_t)codepoint))
+    at = (at + 1) & (cache->astral_cap - 1);
+  if(0 == cache->astral_keys[at]){
+    cache->astral_keys[at] = codepoint;
+    cache->astral_widths[at] = advance_of(codepoint, fontsize);
+    cache->astral_count++;
+  }
+  *advance = cache->astral_widths[at];
+  return true;
 }
 
-void move_cursor_left(TextLocation *loc){
-  snap_cursor_left(loc);
-  if(loc->offset == 0)
+//Monospace
+//The bundled fonts give every glyph the same advance. When the loaded one
+//does, a line wraps every so many bytes and a click lands on a column found
+//by dividing, with nothing measured. Anything else goes the measured way.
+//Only ASCII is looked at, lines with anything else are measured.
+//Advance in font units every ASCII glyph shares, 0 for a proportional font
+int mono_units = 0;
+
+void detect_monospace(void){
+  mono_units = 0;
+  int units = 0;
+  for(int i = 0; i < default_font.glyphCount; ++i){
+    const RlGlyphInfo* glyph = default_font.glyphs + i;
+    if(glyph->value >= 0x80)
+      continue;
+    int u = glyph->advanceX ? glyph->advanceX :
+      (int)default_font.recs[i].width + glyph->offsetX;
+    if(units && (u != units))
+      return;
+    units = u;
+  }
+  mono_units = units;
+}
+
+//Width of every ASCII byte but line breaks, each shows as a glyph the font
+//has or as its '?'. 0 for a proportional font.
+int mono_cell(int fontsize){
+  GlyphAdvance advance;
+  if(!mono_units || !cached_advance(' ', fontsize, &advance))
+    return 0;
+  return advance.width;
+}
+
+//Bytes after the first of a UTF-8 sequence, drawn with it
+enum {
+  GLYPH_CONTINUES = -1
+};
+
+//-1 means newline, codepoint as glyph_at gives it
+int get_char_width(int codepoint, int fontsize){
+  if(('\n' == codepoint) ||
+     ('\r' == codepoint)){
+    return -1;
+  }
+  if(GLYPH_CONTINUES == codepoint)
+    return 0;
+  GlyphAdvance advance;
+  if(!cached_advance(codepoint, fontsize, &advance)){
+    char letter[5] = {0};
+    int len;
+    memcpy(letter, rl_codepoint_to_u_t_f_8(codepoint, &len), len);
+    return measure_text(letter, fontsize) +
+      measure_text("  ", fontsize) - 2 * measure_text(" ", fontsize);
+  }
+  return advance.width;
+}
+
+//Font atlases
+//Zooming rasterizes the font again at the new size instead of scaling the
+//atlas loaded at start. A worker thread rasterizes the glyphs and packs
+//them, the texture is made on the main thread that owns the GL context, and
+//until it arrives the atlas loaded at start is scaled. Sizes not drawn with
+//for the longest are dropped once the atlases go over font_atlas_budget.
+//The atlases start with ASCII. Codepoints the text uses beyond it join the
+//glyph set of the face that draws them as they are first drawn, all those
+//of a frame at once, and the atlas for the size in use is packed again with
+//the whole set. It is drawn with what it had until then. Fallback faces
+//start with no glyphs, and no face but the first has atlases made before
+//the text needs it. All faces share the one budget.
+size_t font_atlas_budget = 16 << 20;
+
+typedef struct FontAtlas FontAtlas;
+struct FontAtlas {
+  RlFont font;
+  int face;
+  //Glyph set it was made with
+  size_t glyph_set;
+  size_t serial;
+  //Texture and glyph tables
+  size_t bytes;
+  //Frame it was last drawn with
+  size_t used;
+};
+
+typedef struct AtlasJob AtlasJob;
+struct AtlasJob {
+  int face;
+  int size;
+  size_t glyph_set;
+  int* codepoints;
+  int count;
+  RlGlyphInfo* glyphs;
+  RlRectangle* recs;
+  RlImage image;
+};
+
+typedef struct AtlasFace AtlasFace;
+struct AtlasFace {
+  //Codepoints of the glyph set, sorted
+  int* codepoints;
+  size_t codepoint_count;
+  size_t glyph_set;
+  //Last asked of the worker, so it is asked once
+  int requested;
+  size_t requested_set;
+  //Serial of the atlas drawn with last frame
+  size_t drawn;
+  //Once text used it
+  bool needed;
+  //For the worker to fill, then back filled
+  AtlasJob* volatile wanted;
+  AtlasJob* volatile published;
+};
+
+typedef struct FontAtlases FontAtlases;
+struct FontAtlases {
+  //Loaded at start for the first face with glyph set 0, kept for scaling
+  RlFont base;
+  //Rasterized from the face chain
+  AtlasFace faces[FACE_MAX];
+  int face_count;
+  FontAtlas* atlases;
+  size_t count;
+  size_t bytes;
+  size_t frame;
+  size_t serials;
+  HANDLE thread;
+  HANDLE wake;
+  volatile LONG quit;
+};
+
+enum {
+  ATLAS_FIRST_GLYPH = 32,
+  ATLAS_GLYPHS = 95,
+  ATLAS_PADDING = 4
+};
+
+void atlas_job_free(AtlasJob* job){
+  if(nullptr == job)
     return;
-  loc->offset--;
+  if(job->glyphs)
+    rl_unload_font_data(job->glyphs, job->count);
+  rl_mem_free(job->recs);
+  rl_unload_image(job->image);
+  free(job->codepoints);
+  free(job);
+}
+
+DWORD WINAPI font_atlas_worker(LPVOID param){
+  FontAtlases* fa = param;
+  while(true){
+    WaitForSingleObject(fa->wake, INFINITE);
+    if(fa->quit)
+      break;
+    for(bool busy = true; busy;){
+      busy = false;
+      for(int f = 0; f < fa->face_count; ++f){
+	AtlasFace* face = fa->faces + f;
+	AtlasJob* job = InterlockedExchangePointer((void* volatile*)&face->wanted,
+						   nullptr);
+	if(nullptr == job)
+	  continue;
+	busy = true;
+	const FontFace* file = face_chain.faces + f;
+	job->glyphs = rl_load_font_data(file->data, file->size, job->size,
+					job->codepoints, job->count,
+					FONT_DEFAULT);
+	if(nullptr == job->glyphs){
+	  atlas_job_free(job);
+	  continue;
+	}
+	job->image = rl_gen_image_font_atlas(job->glyphs, &job->recs,
+					     job->count, job->size,
+					     ATLAS_PADDING, 0);
+	//Main thread did not take the last one, the size moved on since
+	atlas_job_free(InterlockedExchangePointer((void* volatile*)&face->published,
+						  job));
+	wake_frame();
+      }
+    }
+  }
+  return 0;
+}
+
+//Takes over base, rasterizing other sizes and glyphs needs face_chain.
+//False when there will only be the base atlas.
+bool start_font_atlases(FontAtlases* fa, RlFont base){
+  *fa = (FontAtlases){.base = base, .face_count = face_chain.count};
+  fa->faces[0].needed = true;
+  for(int f = 0; (f < fa->face_count) || (0 == f); ++f){
+    if(f && (f < face_chain.chain_count))
+      continue;
+    for(int i = 0; i < ATLAS_GLYPHS; ++i){
+      int cp = ATLAS_FIRST_GLYPH + i;
+      if(!push_obj(&fa->faces[f].codepoints, &fa->faces[f].codepoint_count, &cp))
+	return false;
+    }
+  }
+  if(0 == fa->face_count)
+    return false;
+  fa->wake = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+  if(nullptr == fa->wake)
+    return false;
+  fa->thread = CreateThread(nullptr, 0, font_atlas_worker, fa, 0, nullptr);
+  if(nullptr == fa->thread){
+    CloseHandle(fa->wake);
+    fa->wake = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void font_atlas_drop(FontAtlases* fa, size_t inx){
+  rl_unload_font(fa->atlases[inx].font);
+  fa->bytes -= fa->atlases[inx].bytes;
+  fa->atlases[inx] = fa->atlases[--fa->count];
+}
+
+void stop_font_atlases(FontAtlases* fa){
+  if(fa->thread){
+    InterlockedExchange(&fa->quit, 1);
+    SetEvent(fa->wake);
+    WaitForSingleObject(fa->thread, INFINITE);
+    CloseHandle(fa->thread);
+    CloseHandle(fa->wake);
+  }
+  for(int f = 0; f < FACE_MAX; ++f){
+    atlas_job_free(fa->faces[f].wanted);
+    atlas_job_free(fa->faces[f].published);
+    free(fa->faces[f].codepoints);
+  }
+  while(fa->count)
+    font_atlas_drop(fa, 0);
+  free(fa->atlases);
+  rl_unload_font(fa->base);
+  *fa = (FontAtlases){0};
+}
+
+//Adds the codepoints noted missing to the glyph sets of their faces
+void font_atlas_take_missing(FontAtlases* fa){
+  bool grew[FACE_MAX] = {0};
+  for(size_t i = 0; fa->thread && (i < missing_glyph_count); ++i){
+    int cp = missing_glyphs[i] & CODEPOINT_MASK;
+    int f = face_of(missing_glyphs[i]);
+    AtlasFace* face = fa->faces + f;
+    face->needed = true;
+    size_t lo = 0;
+    size_t hi = face->codepoint_count;
+    while(lo < hi){
+      size_t mid = lo + (hi - lo) / 2;
+      if(face->codepoints[mid] < cp)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+    if((lo < face->codepoint_count) && (face->codepoints[lo] == cp))
+      continue;
+    if(!push_obj(&face->codepoints, &face->codepoint_count, &cp))
+      break;
+    memmove(face->codepoints + lo + 1, face->codepoints + lo,
+	    (face->codepoint_count - 1 - lo) * sizeof(face->codepoints[0]));
+    face->codepoints[lo] = cp;
+    grew[f] = true;
+  }
+  for(int f = 0; f < FACE_MAX; ++f)
+    fa->faces[f].glyph_set += grew[f];
+  free(missing_glyphs);
+  missing_glyphs = nullptr;
+  missing_glyph_count = 0;
+}
+
+//Makes the atlas the worker packed for face, if it did
+void font_atlas_take_published(FontAtlases* fa, int f){
+  AtlasJob* job = InterlockedExchangePointer((void* volatile*)&fa->faces[f].published,
+					     nullptr);
+  //Asked for twice when zoomed away and back before it came, or replacing
+  //one with fewer glyphs
+  for(size_t i = 0; job && (i < fa->count); ++i){
+    if((fa->atlases[i].face != f) || (fa->atlases[i].font.baseSize != job->size))
+      continue;
+    if(fa->atlases[i].glyph_set >= job->glyph_set){
+      atlas_job_free(job);
+      job = nullptr;
+    }
+    else
+      font_atlas_drop(fa, i--);
+  }
+  if(nullptr == job)
+    return;
+  FontAtlas atlas = {
+    .font = {
+      .baseSize = job->size, .glyphCount = job->count,
+      .glyphPadding = ATLAS_PADDING, .recs = job->recs, .glyphs = job->glyphs,
+      .texture = rl_load_texture_from_image(job->image)
+    },
+    .face = f,
+    .glyph_set = job->glyph_set,
+    .serial = ++fa->serials,
+    .used = fa->frame
+  };
+  //Drawing only needs the atlas, the glyph bitmaps go
+  for(int i = 0; i < job->count; ++i){
+    rl_unload_image(job->glyphs[i].image);
+    job->glyphs[i].image = (RlImage){0};
+  }
+  atlas.bytes = 2 * (size_t)job->image.width * job->image.height +
+    job->count * (sizeof(RlGlyphInfo) + sizeof(RlRectangle));
+  rl_unload_image(job->image);
+  free(job->codepoints);
+  free(job);
+  if((0 == atlas.font.texture.id) ||
+     !push_obj(&fa->atlases, &fa->count, &atlas))
+    rl_unload_font(atlas.font);
+  else
+    fa->bytes += atlas.bytes;
+}
+
+//Atlas of face to draw at size, asking the worker for a better one when
+//there is none with every glyph of the set at that size
+RlFont font_atlas_pick(FontAtlases* fa, int f, int size, size_t* serial){
+  AtlasFace* face = fa->faces + f;
+  RlFont font = {0};
+  *serial = 0;
+  //-1 for none at the size
+  long long have = -1;
+  if(0 == f){
+    font = fa->base;
+    have = (size == fa->base.baseSize) ? 0 : -1;
+  }
+  //Another size scaled while waiting, the one drawn last
+  size_t recent = fa->count;
+  for(size_t i = 0; i < fa->count; ++i){
+    FontAtlas* atlas = fa->atlases + i;
+    if(atlas->face != f)
+      continue;
+    if((atlas->font.baseSize == size) && ((long long)atlas->glyph_set > have)){
+      font = atlas->font;
+      *serial = atlas->serial;
+      have = atlas->glyph_set;
+      recent = i;
+    }
+    else if(f && (have < 0) &&
+	    ((recent == fa->count) || (atlas->used > fa->atlases[recent].used))){
+      font = atlas->font;
+      *serial = atlas->serial;
+      recent = i;
+    }
+  }
+  if(recent < fa->count)
+    fa->atlases[recent].used = fa->frame;
+  if((have < (long long)face->glyph_set) && face->codepoint_count &&
+     face->needed && fa->thread &&
+     ((face->requested != size) || (face->requested_set != face->glyph_set))){
+    AtlasJob* job = calloc(1, sizeof(*job));
+    if(job)
+      job->codepoints = malloc(face->codepoint_count * sizeof(job->codepoints[0]));
+    if(job && job->codepoints){
+      memcpy(job->codepoints, face->codepoints,
+	     face->codepoint_count * sizeof(job->codepoints[0]));
+      job->count = face->codepoint_count;
+      job->face = f;
+      job->size = size;
+      job->glyph_set = face->glyph_set;
+      face->requested = size;
+      face->requested_set = face->glyph_set;
+      atlas_job_free(InterlockedExchangePointer((void* volatile*)&face->wanted,
+						job));
+      SetEvent(fa->wake);
+    }
+    else if(job)
+      free(job);
+  }
+  return font;
+}
+
+//Nothing for the main thread to take until the worker publishes, which
+//wakes it
+bool font_atlases_settled(const FontAtlases* fa){
+  for(int f = 0; f < fa->face_count; ++f)
+    if(fa->faces[f].published)
+      return false;
+  return 0 == missing_glyph_count;
+}
+
+//Puts the atlases to draw at size this frame in default_font and
+//face_fonts. True when any is another one than last frame.
+bool font_atlases_frame(FontAtlases* fa, int size){
+  fa->frame++;
+  font_atlas_take_missing(fa);
+  bool changed = false;
+  for(int f = 0; f < fa->face_count; ++f)
+    font_atlas_take_published(fa, f);
+  for(int f = 0; (f < fa->face_count) || (0 == f); ++f){
+    size_t serial;
+    RlFont font = font_atlas_pick(fa, f, size, &serial);
+    changed |= (serial != fa->faces[f].drawn);
+    fa->faces[f].drawn = serial;
+    if(f)
+      face_fonts[f] = font;
+    else
+      default_font = font;
+  }
+  //Least recently used first, the ones in use stay
+  while(fa->bytes > font_atlas_budget){
+    size_t oldest = fa->count;
+    for(size_t i = 0; i < fa->count; ++i)
+      if((fa->atlases[i].used != fa->frame) &&
+	 ((oldest == fa->count) || (fa->atlases[i].used < fa->atlases[oldest].used)))
+	oldest = i;
+    if(oldest == fa->count)
+      break;
+    font_atlas_drop(fa, oldest);
+  }
+  return changed;
+}
+
+//Text runs
+//Letters of one colour and face that follow each other on a line are drawn
+//with a single call. The editor rounds every cell to whole pixels where
+//raylib's pen does not, so a run's spacing is stretched by what its first
+//cell was rounded by. That keeps a monospace line in step, otherwise the run
+//is cut where the pen would drift half a pixel from the cells, so every
+//glyph still lands where it did when drawn one by one. Runs go into a batch
+//drawn a face at a time, so the atlas texture changes once per face rather
+//than wherever the style does. The marks under the letters go into the
+//batch too, drawn before any run, and the batch keeps where each row of the
+//screen starts in both.
+enum {
+  TEXT_RUN_MAX = 256
+};
+
+typedef struct BatchedRun BatchedRun;
+struct BatchedRun {
+  size_t first;
+  int count;
+  int face;
+  RlVector2 at;
+  int fontsize;
+  float spacing;
+  RlColor color;
+};
+
+typedef struct BatchedRect BatchedRect;
+struct BatchedRect {
+  int x;
+  int y;
+  int width;
+  int height;
+  RlColor color;
+  //Only the outline
+  bool lines;
+};
+
+typedef struct BatchedRow BatchedRow;
+struct BatchedRow {
+  //Band of the screen all it draws falls in
+  int y;
+  int height;
+  //Its runs and rects are from these up to the next row's
+  size_t first_run;
+  size_t first_rect;
+  //Filled in by the display list
+  uint64_t hash;
+  bool kept;
+};
+
+typedef struct TextBatch TextBatch;
+struct TextBatch {
+  BatchedRun* runs;
+  size_t run_count;
+  int* codepoints;
+  size_t codepoint_count;
+  BatchedRect* rects;
+  size_t rect_count;
+  BatchedRow* rows;
+  size_t row_count;
+};
+
+typedef struct TextRun TextRun;
+struct TextRun {
+  int codepoints[TEXT_RUN_MAX];
+  int count;
+  int x;
+  int y;
+  //Where the next letter goes, in editor cells and by raylib's pen
+  int cells;
+  float pen;
+  //Added to the spacing so the pen keeps up with the cells
+  float stretch;
+  RlColor color;
+  int fontsize;
+  enum TextStyle style;
+  int face;
+  //Drawn straight away when nullptr
+  TextBatch* batch;
+};
+
+void batched_rect_draw(const BatchedRect* rect){
+  if(rect->lines)
+    rl_draw_rectangle_lines(rect->x, rect->y, rect->width, rect->height,
+			    rect->color);
+  else
+    rl_draw_rectangle(rect->x, rect->y, rect->width, rect->height,
+		      rect->color);
+}
+
+//Draws every rect batched, then every run a face after the other
+void text_batch_draw(TextBatch* batch){
+  for(size_t i = 0; i < batch->rect_count; ++i)
+    batched_rect_draw(batch->rects + i);
+  for(int face = 0; face < FACE_MAX; ++face){
+    for(size_t i = 0; i < batch->run_count; ++i){
+      const BatchedRun* run = batch->runs + i;
+      if(run->face != face)
+	continue;
+      text_draw_calls++;
+      rl_draw_text_codepoints(font_of_face(face),
+			      batch->codepoints + run->first, run->count,
+			      run->at, run->fontsize, run->spacing, run->color);
+    }
+  }
+  batch->run_count = 0;
+  batch->codepoint_count = 0;
+  batch->rect_count = 0;
+  batch->row_count = 0;
+}
+
+void text_batch_free(TextBatch* batch){
+  free(batch->runs);
+  free(batch->codepoints);
+  free(batch->rects);
+  free(batch->rows);
+  *batch = (TextBatch){0};
+}
+
+//Drawn straight away when the batch cannot take it
+void text_batch_rect(TextBatch* batch, int x, int y, int width, int height,
+		     RlColor color, bool lines){
+  BatchedRect rect = {
+    .x = x, .y = y, .width = width, .height = height,
+    .color = color, .lines = lines
+  };
+  if(!push_obj(&batch->rects, &batch->rect_count, &rect))
+    batched_rect_draw(&rect);
+}
+
+void text_run_flush(TextRun* run){
+  if(0 == run->count)
+    return;
+  BatchedRun batched = {
+    .first = run->batch ? run->batch->codepoint_count : 0,
+    .count = run->count,
+    .face = run->face,
+    .at = {.x = run->x, .y = run->y},
+    .fontsize = run->fontsize,
+    .spacing = default_spacing_factor * run->fontsize + run->stretch,
+    .color = run->color
+  };
+  if(run->batch &&
+     push_objs(&run->batch->codepoints, &run->batch->codepoint_count,
+	       run->count, run->codepoints)){
+    if(push_obj(&run->batch->runs, &run->batch->run_count, &batched)){
+      run->count = 0;
+      return;
+    }
+    run->batch->codepoint_count -= run->count;
+  }
+  text_draw_calls++;
+  rl_draw_text_codepoints(font_of_face(run->face), run->codepoints, run->count,
+			  batched.at, batched.fontsize, batched.spacing,
+			  batched.color);
+  run->count = 0;
+}
+
+//What is pushed from here on is drawn in the band of height from y
+void text_batch_row(TextBatch* batch, TextRun* run, int y, int height){
+  text_run_flush(run);
+  BatchedRow row = {
+    .y = y, .height = height,
+    .first_run = batch->run_count, .first_rect = batch->rect_count
+  };
+  push_obj(&batch->rows, &batch->row_count, &row);
+}
+
+//Draws the codepoint as glyph_at gives it in a cell wid wide at x, y
+void text_run_push(TextRun* run, int codepoint, enum TextStyle style, int x,
+		   int y, int wid, int fontsize, RlColor color){
+  //Nothing to draw, the same as draw_text of it
+  if(('\n' == codepoint) || ('\0' == codepoint) ||
+     (GLYPH_CONTINUES == codepoint))
+    return;
+  //Blanks take any colour and style
+  bool blank = (' ' == codepoint) || ('\t' == codepoint);
+  if(blank && run->count)
+    style = run->style;
+  GlyphAdvance advance;
+  if(!cached_advance(codepoint | (style << STYLE_SHIFT), fontsize, &advance)){
+    text_run_flush(run);
+    *run = (TextRun){
+      .codepoints = {codepoint}, .count = 1, .x = x, .y = y,
+      .color = color, .fontsize = fontsize, .batch = run->batch
+    };
+    text_run_flush(run);
+    return;
+  }
+  bool joins = run->count && (run->count < TEXT_RUN_MAX) &&
+    (run->y == y) && (run->fontsize == fontsize) &&
+    (run->face == advance.face) && (run->x + run->cells == x) &&
+    (run->x + run->pen - x < 0.45f) && (x - run->x - run->pen < 0.45f) &&
+    (blank || ((run->color.r == color.r) && (run->color.g == color.g) &&
+	       (run->color.b == color.b) && (run->color.a == color.a)));
+  if(!joins){
+    text_run_flush(run);
+    run->x = x;
+    run->y = y;
+    run->cells = 0;
+    run->pen = 0.0f;
+    run->stretch = wid - advance.pen;
+    run->color = color;
+    run->fontsize = fontsize;
+    run->style = style;
+    run->face = advance.face;
+  }
+  run->codepoints[run->count++] = codepoint;
+  run->cells += wid;
+  run->pen += advance.pen + run->stretch;
+}
+
+
+typedef struct KeyRecorder KeyRecorder;
+struct KeyRecorder{
+  struct KeyTime{
+    int key;
+    double last_time;
+  } *times ;
+  size_t count ;
+};
+bool key_time_eq_fn(const void* key, const void* data){
+  const int* ikey = key;
+  const struct KeyTime* kdata = data;
+  return *ikey == kdata->key;
+}
+int get_key_count(KeyRecorder* recorder, int keycode){   
+    int count_press = 0;
+    const double first_time = 0.5;
+    const double not_first_time = 0.01;
+    struct KeyTime* item = get_obj((recorder->times),
+				   (recorder->count),
+				   &keycode,
+				   key_time_eq_fn);
+    
+    if(rl_is_key_pressed(keycode)){
+      if(item == nullptr){
+	struct KeyTime dat = {.key = keycode};
+	if(!push_obj(&(recorder->times), &(recorder->count), &dat))
+	  return 0;
+	item = get_obj((recorder->times),
+				   (recorder->count),
+				   &keycode,
+				   key_time_eq_fn);
+      }
+      
+      item->last_time = rl_get_time() + first_time;
+      count_press = 1;
+    }
+    if(!count_press &&
+       rl_is_key_down(keycode) &&
+       ((rl_get_time() - item->last_time ) > not_first_time)){
+      if(!item)
+	return 0;
+      double diff = rl_get_time() - item->last_time;
+      while(diff > 0.0){
+	diff -= not_first_time;
+	count_press++;
+      }
+      item->last_time = rl_get_time();
+    }
+    return count_press;
+}
+
+
+void snap_cursor_left(TextLocation *loc){
+
+  while((loc->node->prev) && 
+	((0 == loc->node->str.len) ||
+	 (0 == loc->offset))){
+    loc->node = loc->node->prev;
+    loc->offset = loc->node->str.len;
+  }
+}
+
+void snap_cursor_right(TextLocation *loc){
+  while((loc->node->next) &&
+	((0 == loc->node->str.len) ||
+	 (loc->offset == loc->node->str.len))){
+    loc->node = loc->node->next;
+    loc->offset = 0;
+  }
+}
+
+bool location_eq(TextLocation a, TextLocation b){
+  snap_cursor_right(&a);
+  snap_cursor_right(&b);
+  return (a.node == b.node) && (a.offset == b.offset);
+}
+
+void move_cursor_left(TextLocation *loc){
+  snap_cursor_left(loc);
+  if(loc->offset == 0)
+    return;
+  loc->offset--;
+}
+
+void move_cursor_right(TextLocation *loc){
+  snap_cursor_right(loc);
+  if(loc->offset == loc->node->str.len)
+    return;
+  loc->offset++;
+}  
+
+//UTF-8
+//The text stays bytes. A well formed sequence is drawn as one glyph in the
+//place of its first byte, the bytes after it take no room. Any other byte
+//above ASCII is drawn as '?' on its own.
+//Sequence starting at at, false when there is none
+bool utf8_sequence_at(TextLocation at, int* codepoint, int* len){
+  snap_cursor_right(&at);
+  if(at.offset >= at.node->str.len)
+    return false;
+  unsigned char lead = at.node->str.base[at.offset];
+  int n = (lead >= 0xF0) ? 4 : (lead >= 0xE0) ? 3 : (lead >= 0xC0) ? 2 : 0;
+  if(!n || (lead >= 0xF8))
+    return false;
+  int cp = lead & (0x7F >> n);
+  for(int i = 1; i < n; ++i){
+    move_cursor_right(&at);
+    snap_cursor_right(&at);
+    if(at.offset >= at.node->str.len)
+      return false;
+    unsigned char b = at.node->str.base[at.offset];
+    if((b & 0xC0) != 0x80)
+      return false;
+    cp = (cp << 6) | (b & 0x3F);
+  }
+  //Overlong forms, surrogates and past the last plane
+  static const int least[] = {0, 0, 0x80, 0x800, 0x10000};
+  if((cp < least[n]) || ((cp >= 0xD800) && (cp < 0xE000)) || (cp > 0x10FFFF))
+    return false;
+  *codepoint = cp;
+  *len = n;
+  return true;
+}
+
+//Codepoint drawn for the byte at at, GLYPH_CONTINUES for the bytes after
+//the first of a sequence
+int glyph_at(TextLocation at){
+  snap_cursor_right(&at);
+  if(at.offset >= at.node->str.len)
+    return 0;
+  unsigned char b = at.node->str.base[at.offset];
+  if(b < 0x80)
+    return b;
+  int cp;
+  int len;
+  if(b >= 0xC0)
+    return utf8_sequence_at(at, &cp, &len) ? cp : '?';
+  //Back to the byte that may start it
+  for(int back = 1; back < 4; ++back){
+    snap_cursor_left(&at);
+    if(0 == at.offset)
+      break;
+    at.offset--;
+    unsigned char prev = at.node->str.base[at.offset];
+    if(prev < 0x80)
+      break;
+    if(prev >= 0xC0){
+      if(utf8_sequence_at(at, &cp, &len) && (len > back))
+	return GLYPH_CONTINUES;
+      break;
+    }
+  }
+  return '?';
+}
+
+//Whether the len bytes from at are all ASCII, each a glyph of its own
+bool ascii_run(TextLocation at, size_t len){
+  while(len){
+    snap_cursor_right(&at);
+    size_t run = at.node->str.len - at.offset;
+    if(0 == run)
+      break;
+    if(run > len)
+      run = len;
+    const unsigned char* p = (const unsigned char*)at.node->str.base + at.offset;
+    for(size_t i = 0; i < run; ++i)
+      if(p[i] >= 0x80)
+	return false;
+    len -= run;
+    at.offset += run;
+  }
+  return true;
+}
+
+void ins_char_left(TextLocation *loc, char ch){
+  snap_cursor_left(loc);
+  text_version++;
+  //Case filled
+  if(loc->node->capacity == loc->node->str.len){
+    //Create new node
+    LinkedNativeString* new = malloc(loc->node->capacity + sizeof(*new));
+    new->capacity = loc->node->capacity;
+    new->stamp = text_version;
+    new->index_slot = 0;
+    new->index_pos = 0;
+    new->prev = loc->node;
+    new->next = loc->node->next;
+    if(new->next)
+      new->next->prev = new;
+    loc->node->next = new;
+    
+    if(loc->offset <loc->node->capacity){
+      new->str.len = loc->node->str.len - loc->offset;
+      memcpy(new->str.base,
+	     loc->node->str.base + loc->offset,
+	     new->str.len);
+      loc->node->str.len = loc->offset;
+      mark_chunk_dirty(loc->node);
+    }
+    else{
+      new->str.len = 0;
+      loc->node = loc->node->next;
+      loc->offset = 0;
+    }
+  }
+  else{
+    memmove(loc->node->str.base + loc->offset + 1,
+	    loc->node->str.base + loc->offset,
+	    loc->node->str.len - loc->offset);
+  }
+  
+  loc->node->str.base[loc->offset++] = ch;
+  loc->node->str.len++;
+  mark_chunk_dirty(loc->node);
+}
+
+void del_char_left(TextLocation *loc){
+  snap_cursor_left(loc);
+  if(0 == loc->offset)
+    return;
+
+    text_version++;
+    memmove(loc->node->str.base + loc->offset - 1,
+	    loc->node->str.base + loc->offset,
+	    loc->node->str.len - loc->offset);
+    loc->node->str.len--;
+    loc->offset--;
+    mark_chunk_dirty(loc->node);
+}
+
+void del_char_right(TextLocation *loc){
+  snap_cursor_right(loc);
+  if(loc->offset == loc->node->str.len)
+    return;
+  
+  text_version++;
+  memmove(loc->node->str.base + loc->offset,
+	  loc->node->str.base + loc->offset+1,
+	  loc->node->str.len - loc->offset-1);
+  loc->node->str.len--;
+  mark_chunk_dirty(loc->node);
+}
+
+//Will be start inclusive and end exclusive
+typedef struct TextRange TextRange;
+struct TextRange {
+  TextLocation start;
+  TextLocation end;
+};
+
+//Language packs
+//languages/*.lang are plain text, a directive per line, lines starting with
+//anything else (like #) are skipped:
+//  name C
+//  extensions c h
+//  keywords <r> <g> <b> word word ...
+//  line_comment //
+//  block_comment /* */
+//  string " \ (the quote, then its escape byte)
+//  comment_color <r> <g> <b>
+//  string_color <r> <g> <b>
+//  style <r> <g> <b> bold|italic (text in that colour is drawn in that face)
+//The pack claiming the file's extension is compiled into a keyword DFA over
+//byte classes plus delimiter tables. Compiled tables are cached in
+//languages/cache under the FNV-1a hash of the definition text, so opening
+//a known language again is one file read instead of building the automaton.
+enum LexRuleKind {
+  LEX_LINE_COMMENT,
+  LEX_BLOCK_COMMENT,
+  LEX_STRING
+};
+
+typedef struct LexRule LexRule;
+struct LexRule {
+  uint32_t kind;
+  uint32_t color;
+  char open[8];
+  char close[8];
+  uint32_t open_len;
+  uint32_t close_len;
+  //0 when the rule has no escape byte
+  char escape;
+};
+
+//Bits of Lexer.word_bytes
+enum {
+  LEX_WORD_START = 1,
+  LEX_WORD_PART = 2
+};
+
+typedef struct Lexer Lexer;
+struct Lexer {
+  char name[32];
+  unsigned char word_bytes[256];
+  unsigned char byte_class[256];
+  //Bit i set when rule i can open on this byte
+  unsigned char rule_start[256];
+  RlColor colors[16];
+  //TextStyle of each colour
+  unsigned char styles[16];
+  uint32_t color_count;
+  LexRule rules[8];
+  uint32_t rule_count;
+  uint32_t class_count;
+  uint32_t state_count;
+  //state * class_count + class, state 0 is dead and 1 is the start
+  uint16_t* next;
+  //Colour index + 1 of the keyword ending in a state, 0 for none
+  unsigned char* accept;
+};
+
+typedef struct HighlightSpan HighlightSpan;
+struct HighlightSpan {
+  size_t start;
+  size_t end;
+  RlColor color;
+  enum TextStyle style;
+};
+
+//Lexing state carried from one piece of text to the next, 0 is plain code
+//and r + 1 is inside rule r
+typedef int LexState;
+
+void lexer_free(Lexer* lx){
+  if(nullptr == lx)
+    return;
+  free(lx->next);
+  free(lx->accept);
+  free(lx);
+}
+
+//Carries on hashing from what fnv1a_64 gave for the bytes before
+uint64_t fnv1a_64_from(uint64_t hash, const void* data, size_t len){
+  const unsigned char* p = data;
+  for(size_t i = 0; i < len; ++i){
+    hash ^= p[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+uint64_t fnv1a_64(const void* data, size_t len){
+  return fnv1a_64_from(0xcbf29ce484222325ull, data, len);
+}
+
+//Keyword trie while the pack is read, flattened into the DFA afterwards
+typedef struct LexerBuilder LexerBuilder;
+struct LexerBuilder {
+  Lexer* lx;
+  uint16_t (*trie)[256];
+  unsigned char* accept;
+  size_t node_count;
+  size_t node_cap;
+  bool failed;
+};
+
+bool lexer_builder_init(LexerBuilder* b){
+  *b = (LexerBuilder){0};
+  b->lx = calloc(1, sizeof(*b->lx));
+  if(nullptr == b->lx)
+    return false;
+  for(int c = 0; c < 256; ++c)
+    if((('a' <= c) && (c <= 'z')) || (('A' <= c) && (c <= 'Z')) ||
+       (('0' <= c) && (c <= '9')) || ('_' == c))
+      b->lx->word_bytes[c] = LEX_WORD_START | LEX_WORD_PART;
+  //Dead and start states
+  b->node_count = 2;
+  b->node_cap = 64;
+  b->trie = calloc(b->node_cap, sizeof(b->trie[0]));
+  b->accept = calloc(b->node_cap, 1);
+  b->failed = !b->trie || !b->accept;
+  return !b->failed;
+}
+
+int lexer_add_color(LexerBuilder* b, RlColor color){
+  Lexer* lx = b->lx;
+  for(uint32_t i = 0; i < lx->color_count; ++i)
+    if(0 == memcmp(&lx->colors[i], &color, sizeof(color)))
+      return i;
+  if(lx->color_count == _countof(lx->colors)){
+    b->failed = true;
+    return 0;
+  }
+  lx->colors[lx->color_count] = color;
+  return lx->color_count++;
+}
+
+void lexer_add_keyword(LexerBuilder* b, StringView word, int color){
+  if(b->failed || (0 == word.len))
+    return;
+  size_t state = 1;
+  for(size_t i = 0; i < word.len; ++i){
+    unsigned char c = word.base[i];
+    b->lx->word_bytes[c] |= (0 == i) ? LEX_WORD_START : LEX_WORD_PART;
+    if(0 == b->trie[state][c]){
+      if(b->node_count == 0xffff){
+	b->failed = true;
+	return;
+      }
+      if(b->node_count == b->node_cap){
+	size_t new_cap = 2 * b->node_cap;
+	uint16_t (*trie)[256] = realloc(b->trie, new_cap * sizeof(trie[0]));
+	if(trie)
+	  b->trie = trie;
+	unsigned char* accept = realloc(b->accept, new_cap);
+	if(accept)
+	  b->accept = accept;
+	if(!trie || !accept){
+	  b->failed = true;
+	  return;
+	}
+	memset(b->trie + b->node_cap, 0, (new_cap - b->node_cap) * sizeof(trie[0]));
+	memset(b->accept + b->node_cap, 0, new_cap - b->node_cap);
+	b->node_cap = new_cap;
+      }
+      b->trie[state][c] = (uint16_t)b->node_count++;
+    }
+    state = b->trie[state][c];
+  }
+  b->accept[state] = (unsigned char)(color + 1);
+}
+
+void lexer_add_rule(LexerBuilder* b, enum LexRuleKind kind, StringView open,
+		    StringView close, char escape, int color){
+  Lexer* lx = b->lx;
+  if((lx->rule_count == _countof(lx->rules)) || (0 == open.len) ||
+     (open.len > sizeof(lx->rules[0].open)) ||
+     (close.len > sizeof(lx->rules[0].close))){
+    b->failed = true;
+    return;
+  }
+  LexRule* rule = lx->rules + lx->rule_count;
+  *rule = (LexRule){
+    .kind = kind,
+    .color = color,
+    .open_len = open.len,
+    .close_len = close.len,
+    .escape = escape
+  };
+  memcpy(rule->open, open.base, open.len);
+  if(close.len)
+    memcpy(rule->close, close.base, close.len);
+  lx->rule_start[(unsigned char)open.base[0]] |= 1 << lx->rule_count;
+  lx->rule_count++;
+}
+
+//Gives up the builder either way, nullptr if anything failed on the way
+Lexer* lexer_builder_finish(LexerBuilder* b){
+  Lexer* lx = b->lx;
+  if(!b->failed){
+    //Bytes no keyword uses share class 0, which always leads to the dead state
+    lx->class_count = 1;
+    for(int c = 0; c < 256; ++c){
+      bool used = false;
+      for(size_t s = 1; (s < b->node_count) && !used; ++s)
+	used = (0 != b->trie[s][c]);
+      lx->byte_class[c] = used ? lx->class_count++ : 0;
+    }
+    lx->state_count = b->node_count;
+    lx->next = calloc(lx->state_count * lx->class_count, sizeof(lx->next[0]));
+    lx->accept = malloc(lx->state_count);
+    if(lx->next && lx->accept){
+      for(size_t s = 0; s < b->node_count; ++s)
+	for(int c = 0; c < 256; ++c)
+	  lx->next[s * lx->class_count + lx->byte_class[c]] = b->trie[s][c];
+      memcpy(lx->accept, b->accept, lx->state_count);
+    }
+    else
+      b->failed = true;
+  }
+  free(b->trie);
+  free(b->accept);
+  if(b->failed){
+    lexer_free(lx);
+    lx = nullptr;
+  }
+  *b = (LexerBuilder){0};
+  return lx;
+}
+
+//Splits off the next space separated token of line
+StringView next_token(StringView* line){
+  size_t i = 0;
+  while((i < line->len) && ((' ' == line->base[i]) || ('\t' == line->base[i])))
+    i++;
+  size_t start = i;
+  while((i < line->len) && (' ' != line->base[i]) && ('\t' != line->base[i]))
+    i++;
+  StringView token = {.base = line->base + start, .len = i - start};
+  line->base += i;
+  line->len -= i;
+  return token;
+}
+
+bool token_is(StringView token, const char* word){
+  return (token.len == strlen(word)) && (0 == memcmp(token.base, word, token.len));
+}
+
+RlColor parse_color(StringView* line){
+  RlColor color = {.a = 255};
+  unsigned char* parts[3] = {&color.r, &color.g, &color.b};
+  for(int i = 0; i < 3; ++i){
+    StringView token = next_token(line);
+    int value = 0;
+    for(size_t k = 0; k < token.len; ++k)
+      if(('0' <= token.base[k]) && (token.base[k] <= '9'))
+	value = 10 * value + (token.base[k] - '0');
+    *parts[i] = (unsigned char)((value > 255) ? 255 : value);
+  }
+  return color;
+}
+
+//Next line of text without its line break, false at the end
+bool next_line(StringView* text, StringView* line){
+  if(0 == text->len)
+    return false;
+  size_t i = 0;
+  while((i < text->len) && ('\n' != text->base[i]))
+    i++;
+  *line = (StringView){.base = text->base, .len = i};
+  if(line->len && ('\r' == line->base[line->len - 1]))
+    line->len--;
+  if(i < text->len)
+    i++;
+  text->base += i;
+  text->len -= i;
+  return true;
+}
+
+//True when the pack lists ext among its extensions
+bool language_claims(StringView def, StringView ext){
+  StringView line;
+  while(next_line(&def, &line)){
+    if(!token_is(next_token(&line), "extensions"))
+      continue;
+    StringView token;
+    while((token = next_token(&line)).len){
+      if(token.len != ext.len)
+	continue;
+      size_t k = 0;
+      while((k < ext.len) &&
+	    ((token.base[k] | 0x20) == (ext.base[k] | 0x20)))
+	k++;
+      if(k == ext.len)
+	return true;
+    }
+  }
+  return false;
+}
+
+Lexer* compile_language(StringView def){
+  LexerBuilder b;
+  if(!lexer_builder_init(&b))
+    return lexer_builder_finish(&b);
+  RlColor comment_color = {0, 128, 0, 255};
+  RlColor string_color = {163, 21, 21, 255};
+  RlColor styled[16];
+  enum TextStyle styles[16];
+  size_t styled_count = 0;
+  StringView scan = def;
+  StringView line;
+  //Colours first so rules read before them still get them
+  while(next_line(&scan, &line)){
+    StringView directive = next_token(&line);
+    if(token_is(directive, "comment_color"))
+      comment_color = parse_color(&line);
+    else if(token_is(directive, "string_color"))
+      string_color = parse_color(&line);
+    else if(token_is(directive, "style") && (styled_count < _countof(styled))){
+      styled[styled_count] = parse_color(&line);
+      StringView face = next_token(&line);
+      styles[styled_count] = token_is(face, "bold") ? STYLE_BOLD :
+	token_is(face, "italic") ? STYLE_ITALIC : STYLE_REGULAR;
+      styled_count++;
+    }
+  }
+  while(next_line(&def, &line)){
+    StringView directive = next_token(&line);
+    if(token_is(directive, "name")){
+      StringView name = next_token(&line);
+      if(name.len >= sizeof(b.lx->name))
+	name.len = sizeof(b.lx->name) - 1;
+      memcpy(b.lx->name, name.base, name.len);
+    }
+    else if(token_is(directive, "keywords")){
+      int color = lexer_add_color(&b, parse_color(&line));
+      StringView word;
+      while((word = next_token(&line)).len)
+	lexer_add_keyword(&b, word, color);
+    }
+    else if(token_is(directive, "line_comment"))
+      lexer_add_rule(&b, LEX_LINE_COMMENT, next_token(&line), (StringView){0},
+		     0, lexer_add_color(&b, comment_color));
+    else if(token_is(directive, "block_comment")){
+      StringView open = next_token(&line);
+      StringView close = next_token(&line);
+      lexer_add_rule(&b, LEX_BLOCK_COMMENT, open, close, 0,
+		     lexer_add_color(&b, comment_color));
+    }
+    else if(token_is(directive, "string")){
+      StringView quote = next_token(&line);
+      StringView escape = next_token(&line);
+      lexer_add_rule(&b, LEX_STRING, quote, quote,
+		     escape.len ? escape.base[0] : 0,
+		     lexer_add_color(&b, string_color));
+    }
+  }
+  for(uint32_t i = 0; i < b.lx->color_count; ++i)
+    for(size_t k = 0; k < styled_count; ++k)
+      if(0 == memcmp(&b.lx->colors[i], &styled[k], sizeof(styled[k])))
+	b.lx->styles[i] = styles[k];
+  return lexer_builder_finish(&b);
+}
+
+//Cache file, the header then the tables as they sit in memory. Bump the
+//format whenever Lexer or LexRule change shape.
+typedef struct LexerCacheHeader LexerCacheHeader;
+struct LexerCacheHeader {
+  char magic[4];
+  uint32_t format;
+  uint64_t hash;
+  uint32_t state_count;
+  uint32_t class_count;
+};
+
+uint32_t lexer_cache_format = 2;
+
+bool save_lexer_cache(const char* path, const Lexer* lx, uint64_t hash){
+  FILE* file = fopen(path, "wb");
+  if(nullptr == file)
+    return false;
+  LexerCacheHeader header = {
+    .magic = {'L', 'X', 'C', '1'},
+    .format = lexer_cache_format,
+    .hash = hash,
+    .state_count = lx->state_count,
+    .class_count = lx->class_count
+  };
+  size_t cells = (size_t)lx->state_count * lx->class_count;
+  bool ok = (1 == fwrite(&header, sizeof(header), 1, file)) &&
+    (1 == fwrite(lx, sizeof(*lx), 1, file)) &&
+    (cells == fwrite(lx->next, sizeof(lx->next[0]), cells, file)) &&
+    (lx->state_count == fwrite(lx->accept, 1, lx->state_count, file));
+  ok = (0 == fclose(file)) && ok;
+  if(!ok)
+    remove(path);
+  return ok;
+}
+
+Lexer* load_lexer_cache(const char* path, uint64_t hash){
+  FILE* file = fopen(path, "rb");
+  if(nullptr == file)
+    return nullptr;
+  LexerCacheHeader header;
+  Lexer* lx = calloc(1, sizeof(*lx));
+  bool ok = lx && (1 == fread(&header, sizeof(header), 1, file)) &&
+    (0 == memcmp(header.magic, "LXC1", 4)) &&
+    (header.format == lexer_cache_format) && (header.hash == hash) &&
+    (1 == fread(lx, sizeof(*lx), 1, file));
+  if(lx){
+    //Whatever pointers were saved mean nothing now
+    lx->next = nullptr;
+    lx->accept = nullptr;
+  }
+  ok = ok && (header.state_count == lx->state_count) &&
+    (header.class_count == lx->class_count) &&
+    (lx->state_count >= 2) && (lx->class_count >= 1) &&
+    (lx->color_count <= _countof(lx->colors)) &&
+    (lx->rule_count <= _countof(lx->rules));
+  if(ok){
+    size_t cells = (size_t)lx->state_count * lx->class_count;
+    lx->next = malloc(cells * sizeof(lx->next[0]));
+    lx->accept = malloc(lx->state_count);
+    ok = lx->next && lx->accept &&
+      (cells == fread(lx->next, sizeof(lx->next[0]), cells, file)) &&
+      (lx->state_count == fread(lx->accept, 1, lx->state_count, file));
+    //A damaged file must not send the lexer out of its tables
+    for(size_t i = 0; ok && (i < cells); ++i)
+      ok = (lx->next[i] < lx->state_count);
+    for(size_t i = 0; ok && (i < lx->state_count); ++i)
+      ok = (lx->accept[i] <= lx->color_count);
+    for(size_t i = 0; ok && (i < 256); ++i)
+      ok = (lx->byte_class[i] < lx->class_count);
+    for(size_t i = 0; ok && (i < lx->color_count); ++i)
+      ok = (lx->styles[i] < STYLE_COUNT);
+    for(size_t i = 0; ok && (i < lx->rule_count); ++i)
+      ok = (lx->rules[i].color < lx->color_count) &&
+	(lx->rules[i].open_len >= 1) &&
+	(lx->rules[i].open_len <= sizeof(lx->rules[i].open)) &&
+	(lx->rules[i].close_len <= sizeof(lx->rules[i].close));
+  }
+  fclose(file);
+  if(!ok){
+    lexer_free(lx);
+    return nullptr;
+  }
+  return lx;
+}
+
+char* read_whole_file(const char* path, size_t* len){
+  FILE* file = fopen(path, "rb");
+  if(nullptr == file)
+    return nullptr;
+  size_t cap = 4096;
+  size_t used = 0;
+  char* data = malloc(cap);
+  while(data){
+    used += fread(data + used, 1, cap - used, file);
+    if(used < cap)
+      break;
+    cap *= 2;
+    char* grown = realloc(data, cap);
+    if(nullptr == grown){
+      free(data);
+      data = nullptr;
+    }
+    else
+      data = grown;
+  }
+  fclose(file);
+  *len = used;
+  return data;
+}
+
+//Compiled lexer for the pack in dir that claims file_name's extension,
+//nullptr if none does
+Lexer* load_language(const char* dir, const char* file_name){
+  const char* dot = strrchr(file_name, '.');
+  if((nullptr == dot) || strchr(dot, '/') || strchr(dot, '\\'))
+    return nullptr;
+  StringView ext = view_cstr((char*)dot + 1);
+
+  char path[1024];
+  snprintf(path, sizeof(path), "%s*.lang", dir);
+  WIN32_FIND_DATAA found;
+  HANDLE finder = FindFirstFileA(path, &found);
+  if(INVALID_HANDLE_VALUE == finder)
+    return nullptr;
+  Lexer* lx = nullptr;
+  do{
+    snprintf(path, sizeof(path), "%s%s", dir, found.cFileName);
+    size_t len;
+    char* def = read_whole_file(path, &len);
+    if(nullptr == def)
+      continue;
+    StringView def_view = {.base = def, .len = len};
+    if(language_claims(def_view, ext)){
+      uint64_t hash = fnv1a_64(def, len);
+      char cache_path[1024];
+      snprintf(cache_path, sizeof(cache_path), "%scache/%016llx.lxc", dir,
+	       (unsigned long long)hash);
+      lx = load_lexer_cache(cache_path, hash);
+      if(nullptr == lx){
+	lx = compile_language(def_view);
+	if(lx){
+	  snprintf(path, sizeof(path), "%scache", dir);
+	  CreateDirectoryA(path, nullptr);
+	  save_lexer_cache(cache_path, lx, hash);
+	}
+      }
+    }
+    free(def);
+  }while(!lx && FindNextFileA(finder, &found));
+  FindClose(finder);
+  return lx;
+}
+
+//Lexer for the keyword list compiled into the editor, used when no pack
+//claims the file
+Lexer* builtin_lexer(StringView* keywords, size_t key_count, RlColor color){
+  LexerBuilder b;
+  if(lexer_builder_init(&b)){
+    int inx = lexer_add_color(&b, color);
+    for(size_t i = 0; i < key_count; ++i)
+      lexer_add_keyword(&b, keywords[i], inx);
+  }
+  return lexer_builder_finish(&b);
+}
+
+//Where rule's closing delimiter ends in text[from, len), len if it is not
+//closed yet
+size_t lex_rule_end(const LexRule* rule, const char* text, size_t from,
+		    size_t len){
+  for(size_t i = from; i < len; ++i){
+    if(rule->escape && (text[i] == rule->escape)){
+      i++;
+      continue;
+    }
+    if(LEX_LINE_COMMENT == rule->kind){
+      if('\n' == text[i])
+	return i;
+      continue;
+    }
+    //An unterminated string stops at the end of its line
+    if((LEX_STRING == rule->kind) && ('\n' == text[i]))
+      return i;
+    if((text[i] == rule->close[0]) && (i + rule->close_len <= len) &&
+       (0 == memcmp(text + i, rule->close, rule->close_len)))
+      return i + rule->close_len;
+  }
+  return len;
+}
+
+//Lexes text as a continuation of state, pushing coloured spans offset by
+//base, and returns the state at the end of text
+LexState lex_run(const Lexer* lx, LexState state, const char* text,
+		 size_t len, size_t base, HighlightSpan** spans,
+		 size_t* span_count){
+  size_t i = 0;
+  while(i < len){
+    if(state > 0){
+      const LexRule* rule = lx->rules + (state - 1);
+      size_t end = lex_rule_end(rule, text, i, len);
+      HighlightSpan span = {
+	.start = base + i, .end = base + end, .color = lx->colors[rule->color],
+	.style = lx->styles[rule->color]
+      };
+      //Continue the span opened by the delimiter instead of starting another
+      if(*span_count && ((*spans)[*span_count - 1].end == span.start))
+	(*spans)[*span_count - 1].end = span.end;
+      else if(end > i)
+	push_obj(spans, span_count, &span);
+      //Still inside when the text ends
+      if(end == len)
+	return state;
+      i = end;
+      state = 0;
+      continue;
+    }
+    unsigned char c = text[i];
+    if(lx->rule_start[c]){
+      uint32_t r = 0;
+      for(; r < lx->rule_count; ++r)
+	if(((lx->rule_start[c] >> r) & 1) &&
+	   (i + lx->rules[r].open_len <= len) &&
+	   (0 == memcmp(text + i, lx->rules[r].open, lx->rules[r].open_len)))
+	  break;
+      if(r < lx->rule_count){
+	HighlightSpan span = {
+	  .start = base + i,
+	  .end = base + i + lx->rules[r].open_len,
+	  .color = lx->colors[lx->rules[r].color],
+	  .style = lx->styles[lx->rules[r].color]
+	};
+	push_obj(spans, span_count, &span);
+	i += lx->rules[r].open_len;
+	state = r + 1;
+	continue;
+      }
+    }
+    if((lx->word_bytes[c] & LEX_WORD_START) &&
+       ((0 == i) || !(lx->word_bytes[(unsigned char)text[i - 1]] & LEX_WORD_PART))){
+      size_t end = i;
+      size_t s = 1;
+      do{
+	s = lx->next[s * lx->class_count + lx->byte_class[(unsigned char)text[end]]];
+	end++;
+      }while((end < len) &&
+	     (lx->word_bytes[(unsigned char)text[end]] & LEX_WORD_PART));
+      //The DFA may die early, the word still runs to its end
+      if(s && lx->accept[s]){
+	HighlightSpan span = {
+	  .start = base + i, .end = base + end,
+	  .color = lx->colors[lx->accept[s] - 1],
+	  .style = lx->styles[lx->accept[s] - 1]
+	};
+	push_obj(spans, span_count, &span);
+      }
+      i = end;
+      continue;
+    }
+    i++;
+  }
+  return state;
+}
+
+//Background highlighting
+//The worker gets a flat copy of the buffer tagged with the text_version it
+//was taken at, and hands back colour spans as document byte offsets.
+//Both directions go through single pointer slots swapped with
+//InterlockedExchangePointer, whoever gets a stale pointer back frees it.
+typedef struct HighlightResult HighlightResult;
+struct HighlightResult {
+  size_t version;
+  size_t count;
+  HighlightSpan spans[];
+};
+
+typedef struct HighlightJob HighlightJob;
+struct HighlightJob {
+  size_t version;
+  LinkedNativeString* text;
+};
+
+typedef struct Highlighter Highlighter;
+struct Highlighter {
+  HANDLE thread;
+  HANDLE wake;
+  volatile LONG quit;
+  volatile LONG busy;
+  const Lexer* lexer;
+  HighlightJob* volatile pending;
+  HighlightResult* volatile published;
+  size_t submitted_version;
+};
+
+//Copies the whole chain into a single detached node
+LinkedNativeString* copy_text_flat(LinkedNativeString* head){
+  size_t total_len = 0;
+  for(LinkedNativeString* node = head; node; node = node->next)
+    total_len += node->str.len;
+
+  LinkedNativeString* flat = malloc(sizeof(*flat) + total_len + 1);
+  flat->prev = flat->next = nullptr;
+  flat->capacity = total_len + 1;
+  flat->stamp = text_version;
+  flat->index_slot = 0;
+  flat->index_pos = 0;
+  flat->str.len = 0;
+  for(LinkedNativeString* node = head; node; node = node->next){
+    memcpy(flat->str.base + flat->str.len, node->str.base, node->str.len);
+    flat->str.len += node->str.len;
+  }
+  return flat;
+}
+
+HighlightResult* highlight_text(const HighlightJob* job, const Lexer* lexer){
+  HighlightSpan* spans = nullptr;
+  size_t span_count = 0;
+  lex_run(lexer, 0, job->text->str.base, job->text->str.len, 0,
+	  &spans, &span_count);
+
+  HighlightResult* res = malloc(sizeof(*res) +
+				span_count * sizeof(res->spans[0]));
+  res->version = job->version;
+  res->count = span_count;
+  if(span_count)
+    memcpy(res->spans, spans, span_count * sizeof(spans[0]));
+  free(spans);
+  return res;
+}
+
+DWORD WINAPI highlight_worker(LPVOID param){
+  Highlighter* hl = param;
+  while(true){
+    WaitForSingleObject(hl->wake, INFINITE);
+    if(hl->quit)
+      break;
+    InterlockedExchange(&hl->busy, 1);
+    HighlightJob* job;
+    while((job = InterlockedExchangePointer((void* volatile*)&hl->pending,
+					    nullptr))){
+      HighlightResult* res = highlight_text(job, hl->lexer);
+      free(job->text);
+      free(job);
+      //Renderer did not pick up the previous one, it is stale now anyway
+      HighlightResult* old =
+	InterlockedExchangePointer((void* volatile*)&hl->published, res);
+      free(old);
+      wake_frame();
+    }
+    InterlockedExchange(&hl->busy, 0);
+  }
+  return 0;
+}
+
+bool start_highlighter(Highlighter* hl, const Lexer* lexer){
+  *hl = (Highlighter){.lexer = lexer};
+  if(nullptr == lexer)
+    return false;
+  hl->wake = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+  if(nullptr == hl->wake)
+    return false;
+  hl->thread = CreateThread(nullptr, 0, highlight_worker, hl, 0, nullptr);
+  if(nullptr == hl->thread){
+    CloseHandle(hl->wake);
+    hl->wake = nullptr;
+    return false;
+  }
+  return true;
+}
+
+//Only snapshots when the worker is idle, so a burst of typing on a big file
+//costs at most one copy per lexing pass
+void submit_highlight(Highlighter* hl, LinkedNativeString* head){
+  if(nullptr == hl->thread)
+    return;
+  if((hl->submitted_version == text_version) ||
+     hl->busy || hl->pending)
+    return;
+  HighlightJob* job = malloc(sizeof(*job));
+  job->version = text_version;
+  job->text = copy_text_flat(head);
+  hl->submitted_version = job->version;
+  HighlightJob* old = InterlockedExchangePointer((void* volatile*)&hl->pending,
+						 job);
+  if(old){
+    free(old->text);
+    free(old);
+  }
+  SetEvent(hl->wake);
+}
+
+//Nothing for the main thread to do until the worker publishes, which wakes
+//it
+bool highlighter_settled(const Highlighter* hl){
+  if(nullptr == hl->thread)
+    return true;
+  if(hl->published)
+    return false;
+  return hl->pending || hl->busy || (hl->submitted_version == text_version);
+}
+
+//Returns newly published spans or nullptr if nothing new arrived
+HighlightResult* take_highlight(Highlighter* hl){
+  return InterlockedExchangePointer((void* volatile*)&hl->published, nullptr);
+}
+
+void stop_highlighter(Highlighter* hl){
+  if(nullptr == hl->thread)
+    return;
+  InterlockedExchange(&hl->quit, 1);
+  SetEvent(hl->wake);
+  WaitForSingleObject(hl->thread, INFINITE);
+  CloseHandle(hl->thread);
+  CloseHandle(hl->wake);
+  HighlightJob* job = hl->pending;
+  if(job){
+    free(job->text);
+    free(job);
+  }
+  free(hl->published);
+  hl->thread = nullptr;
+}
+
+//Display list
+//The text area is drawn into a texture kept from frame to frame and put on
+//the screen whole. Each row of the batch hashes what it would draw, with
+//font_serial since the same codepoints look different once the atlases
+//change, and only rows whose band or hash differ from the last frame are
+//drawn into the texture again. Bands that held a row last frame and hold
+//none the same now are cleared first. A frame where only the cursor blinked
+//draws the one row it is on, scrolling or zooming draws them all.
+//Letters are alpha blended into the texture over the white of their band,
+//which leaves their edges less than opaque. Adding opaque black over the
+//redrawn bands afterwards puts the alpha back at full and leaves the colour
+//as it was, so the texture looks the same on the screen as drawing straight
+//to it did.
+typedef struct DisplayCache DisplayCache;
+struct DisplayCache {
+  RlRenderTexture2D target;
+  int width;
+  int height;
+  //Rows the texture holds, by their band and hash
+  BatchedRow* rows;
+  size_t row_count;
+  //Of the last frame
+  size_t redrawn;
+};
+
+uint64_t batched_row_hash(const TextBatch* batch, size_t inx){
+  const BatchedRow* row = batch->rows + inx;
+  bool last = (inx + 1 == batch->row_count);
+  size_t run_end = last ? batch->run_count : row[1].first_run;
+  size_t rect_end = last ? batch->rect_count : row[1].first_rect;
+  uint64_t hash = fnv1a_64_from(fnv1a_64(&font_serial, sizeof(font_serial)),
+				&row->height, sizeof(row->height));
+  for(size_t i = row->first_rect; i < rect_end; ++i){
+    const BatchedRect* rect = batch->rects + i;
+    int fields[] = {
+      rect->x, rect->y, rect->width, rect->height, rect->lines,
+      rect->color.r, rect->color.g, rect->color.b, rect->color.a
+    };
+    hash = fnv1a_64_from(hash, fields, sizeof(fields));
+  }
+  for(size_t i = row->first_run; i < run_end; ++i){
+    const BatchedRun* run = batch->runs + i;
+    float fields[] = {
+      run->count, run->face, run->at.x, run->at.y, run->fontsize,
+      run->spacing, run->color.r, run->color.g, run->color.b, run->color.a
+    };
+    hash = fnv1a_64_from(hash, fields, sizeof(fields));
+    hash = fnv1a_64_from(hash, batch->codepoints + run->first,
+			 run->count * sizeof(int));
+  }
+  return hash;
+}
+
+void display_cache_free(DisplayCache* cache){
+  if(cache->target.id)
+    rl_unload_render_texture(cache->target);
+  free(cache->rows);
+  *cache = (DisplayCache){0};
+}
+
+//Draws the rows of batch that changed into the texture, then the texture
+//at the top left. Without a texture the batch is drawn as it is, only
+//counting the rows that changed.
+void display_cache_draw(DisplayCache* cache, TextBatch* batch, int width,
+			int height){
+  if((cache->width != width) || (cache->height != height)){
+    display_cache_free(cache);
+    cache->target = rl_load_render_texture(width, height);
+    cache->width = width;
+    cache->height = height;
+    if(cache->target.id){
+      rl_begin_texture_mode(cache->target);
+      rl_clear_background(WHITE);
+      rl_end_texture_mode();
+    }
+  }
+  for(size_t i = 0; i < batch->row_count; ++i)
+    batch->rows[i].hash = batched_row_hash(batch, i);
+  //Both lists go down the screen. An old row is kept when a row takes over
+  //its band, which clears it itself unless it is kept too.
+  size_t next = 0;
+  for(size_t i = 0; i < cache->row_count; ++i){
+    BatchedRow* old = cache->rows + i;
+    while((next < batch->row_count) && (batch->rows[next].y < old->y))
+      next++;
+    old->kept = (next < batch->row_count) &&
+      (batch->rows[next].y == old->y) &&
+      (batch->rows[next].height == old->height);
+    if(old->kept)
+      batch->rows[next].kept = (batch->rows[next].hash == old->hash);
+  }
+  cache->redrawn = 0;
+  for(size_t i = 0; i < cache->row_count; ++i)
+    cache->redrawn += !cache->rows[i].kept;
+  for(size_t i = 0; i < batch->row_count; ++i)
+    cache->redrawn += !batch->rows[i].kept;
+
+  if(0 == cache->target.id){
+    size_t row_count = batch->row_count;
+    text_batch_draw(batch);
+    //Still compared with next frame's
+    batch->row_count = row_count;
+  }
+  else{
+    rl_begin_texture_mode(cache->target);
+    for(size_t i = 0; i < cache->row_count; ++i){
+      const BatchedRow* old = cache->rows + i;
+      if(!old->kept)
+	rl_draw_rectangle(0, old->y, width, old->height, WHITE);
+    }
+    for(size_t i = 0; i < batch->row_count; ++i){
+      const BatchedRow* row = batch->rows + i;
+      if(row->kept)
+	continue;
+      rl_draw_rectangle(0, row->y, width, row->height, WHITE);
+      size_t rect_end = (i + 1 < batch->row_count) ?
+	row[1].first_rect : batch->rect_count;
+      for(size_t k = row->first_rect; k < rect_end; ++k)
+	batched_rect_draw(batch->rects + k);
+    }
+    for(int face = 0; face < FACE_MAX; ++face){
+      for(size_t i = 0; i < batch->row_count; ++i){
+	const BatchedRow* row = batch->rows + i;
+	if(row->kept)
+	  continue;
+	size_t run_end = (i + 1 < batch->row_count) ?
+	  row[1].first_run : batch->run_count;
+	for(size_t k = row->first_run; k < run_end; ++k){
+	  const BatchedRun* run = batch->runs + k;
+	  if(run->face != face)
+	    continue;
+	  text_draw_calls++;
+	  rl_draw_text_codepoints(font_of_face(face),
+				  batch->codepoints + run->first, run->count,
+				  run->at, run->fontsize, run->spacing,
+				  run->color);
+	}
+      }
+    }
+    rl_begin_blend_mode(BLEND_ADD_COLORS);
+    for(size_t i = 0; i < batch->row_count; ++i){
+      const BatchedRow* row = batch->rows + i;
+      if(!row->kept)
+	rl_draw_rectangle(0, row->y, width, row->height, BLACK);
+    }
+    rl_end_blend_mode();
+    rl_end_texture_mode();
+    //Render textures are upside down
+    rl_draw_texture_rec(cache->target.texture,
+			(RlRectangle){0, 0, width, -height},
+			(RlVector2){0, 0}, WHITE);
+  }
+
+  cache->row_count = 0;
+  if(!push_objs(&cache->rows, &cache->row_count, batch->row_count,
+		batch->rows) && cache->target.id){
+    //Nothing is known to be kept next frame
+    rl_begin_texture_mode(cache->target);
+    rl_clear_background(WHITE);
+    rl_end_texture_mode();
+  }
+  batch->run_count = 0;
+  batch->codepoint_count = 0;
+  batch->rect_count = 0;
+  batch->row_count = 0;
+}
+
+//Trigram index
+//Optional posting lists from each trigram to the chunks that contain it.
+//Literal searches, and regexes through their literal prefix, then only scan
+//chunks holding every trigram of the needle. A chunk that is not indexed
+//yet, or was edited since, is scanned as usual, and the last needle.len - 1
+//starts of every chunk are always tried, so matches running across chunk
+//boundaries are never lost. Slots are not reused, a re-indexed chunk gets a
+//fresh one and its old entries simply go stale inside the lists.
+typedef struct IndexedChunk IndexedChunk;
+struct IndexedChunk {
+  LinkedNativeString* node;
+  size_t stamp;
+};
+
+//Slot ids only go up, so lists are varint deltas, mostly a byte per entry
+typedef struct TrigramPostings TrigramPostings;
+struct TrigramPostings {
+  //Trigram + 1, 0 marks an empty cell
+  uint32_t key;
+  uint32_t count;
+  uint32_t last;
+  size_t len;
+  size_t capacity;
+  unsigned char* deltas;
+};
+
+typedef struct TrigramIndex TrigramIndex;
+struct TrigramIndex {
+  //Slot 0 is never handed out, it means not indexed
+  IndexedChunk* chunks;
+  size_t chunk_count;
+  size_t chunk_cap;
+  size_t live;
+  TrigramPostings* table;
+  size_t table_size;
+  size_t table_used;
+  //Bumped whenever the lists change
+  size_t generation;
+  //Upkeep walk over the chain, every edit restarts it
+  LinkedNativeString* cursor;
+  size_t cursor_version;
+  bool complete;
+  //Slots that may hold the prepared query, a bit each
+  uint64_t* candidates;
+  uint64_t* scratch;
+  size_t candidate_words;
+  size_t candidate_bits;
+  bool filtering;
+  char query[256];
+  size_t query_len;
+  size_t query_generation;
+};
+
+//nullptr unless the buffer is big enough for it to pay off
+TrigramIndex* trigram_index = nullptr;
+size_t trigram_index_min_bytes = 64 << 20;
+
+uint32_t trigram_at(const char* p){
+  return ((uint32_t)(unsigned char)p[0] << 16) |
+    ((uint32_t)(unsigned char)p[1] << 8) | (uint32_t)(unsigned char)p[2];
+}
+
+size_t trigram_hash(uint32_t key){
+  return (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+TrigramPostings* trigram_lookup(TrigramIndex* index, uint32_t trigram){
+  if(0 == index->table_size)
+    return nullptr;
+  uint32_t key = trigram + 1;
+  size_t mask = index->table_size - 1;
+  for(size_t i = trigram_hash(key) & mask; ; i = (i + 1) & mask){
+    if(index->table[i].key == key)
+      return index->table + i;
+    if(0 == index->table[i].key)
+      return nullptr;
+  }
+}
+
+//ORs the slots of a list into bits
+void trigram_decode(const TrigramPostings* list, uint64_t* bits){
+  uint32_t slot = 0;
+  size_t i = 0;
+  while(i < list->len){
+    uint32_t delta = 0;
+    int shift = 0;
+    unsigned char b;
+    do{
+      b = list->deltas[i++];
+      delta |= (uint32_t)(b & 0x7f) << shift;
+      shift += 7;
+    }while(b & 0x80);
+    slot += delta;
+    bits[slot / 64] |= 1ull << (slot % 64);
+  }
+}
+
+//Works out which slots may hold needle. Runs on the calling thread before a
+//search, find_in_chunk only ever reads the result so pool tasks can share it.
+void trigram_prepare(StringView needle){
+  TrigramIndex* index = trigram_index;
+  if(nullptr == index)
+    return;
+  if(index->filtering && (index->query_generation == index->generation) &&
+     (needle.len == index->query_len) &&
+     (0 == memcmp(needle.base, index->query, needle.len)))
+    return;
+  index->filtering = false;
+  if((needle.len < 3) || (needle.len > sizeof(index->query)) ||
+     (0 == index->chunk_count))
+    return;
+
+  size_t words = (index->chunk_count + 63) / 64;
+  if(words > index->candidate_words){
+    uint64_t* candidates = realloc(index->candidates, words * sizeof(uint64_t));
+    if(nullptr == candidates)
+      return;
+    index->candidates = candidates;
+    uint64_t* scratch = realloc(index->scratch, words * sizeof(uint64_t));
+    if(nullptr == scratch)
+      return;
+    index->scratch = scratch;
+    index->candidate_words = words;
+  }
+
+  //The few rarest lists narrow it down about as well as all of them
+  TrigramPostings* lists[4];
+  size_t list_count = 0;
+  bool absent = false;
+  for(size_t i = 0; i + 3 <= needle.len; ++i){
+    TrigramPostings* list = trigram_lookup(index, trigram_at(needle.base + i));
+    if(nullptr == list){
+      absent = true;
+      break;
+    }
+    bool seen = false;
+    for(size_t k = 0; k < list_count; ++k)
+      seen |= (lists[k] == list);
+    if(seen)
+      continue;
+    size_t at = list_count;
+    while((at > 0) && (lists[at - 1]->count > list->count))
+      at--;
+    if(at >= _countof(lists))
+      continue;
+    if(list_count < _countof(lists))
+      list_count++;
+    memmove(lists + at + 1, lists + at,
+	    (list_count - 1 - at) * sizeof(lists[0]));
+    lists[at] = list;
+  }
+
+  memset(index->candidates, 0, words * sizeof(uint64_t));
+  if(!absent){
+    trigram_decode(lists[0], index->candidates);
+    for(size_t k = 1; k < list_count; ++k){
+      memset(index->scratch, 0, words * sizeof(uint64_t));
+      trigram_decode(lists[k], index->scratch);
+      for(size_t w = 0; w < words; ++w)
+	index->candidates[w] &= index->scratch[w];
+    }
+  }
+  index->candidate_bits = index->chunk_count;
+  memcpy(index->query, needle.base, needle.len);
+  index->query_len = needle.len;
+  index->query_generation = index->generation;
+  index->filtering = true;
+}
+
+//Where a match in node can first start, pushed up to the chunk's tail when
+//the index rules out every match lying wholly inside it
+size_t trigram_narrow(LinkedNativeString* node, size_t from, StringView needle){
+  TrigramIndex* index = trigram_index;
+  if((nullptr == index) || !index->filtering ||
+     (needle.len != index->query_len) ||
+     memcmp(needle.base, index->query, needle.len))
+    return from;
+  uint32_t slot = node->index_slot;
+  if((0 == slot) || (slot >= index->candidate_bits) ||
+     (index->chunks[slot].node != node) ||
+     (index->chunks[slot].stamp != node->stamp))
+    return from;
+  if((index->candidates[slot / 64] >> (slot % 64)) & 1)
+    return from;
+  size_t tail = (node->str.len >= needle.len) ?
+    (node->str.len - (needle.len - 1)) : 0;
+  return (from > tail) ? from : tail;
+}
+
+//Find engine
+//Candidates are filtered on the needle's first and last byte a vector at a
+//time inside each chunk, then confirmed with memcmp. Starts close enough to
+//the end of a chunk that the needle runs into the next one are confirmed by
+//walking the chain.
+
+//Returns first p in [from, to) with base[p] == first and base[p+last_inx] == last,
+//caller guarantees to + last_inx <= len
+typedef size_t (*pair_scan_fn)(const char* base, size_t from, size_t to,
+			       char first, char last, size_t last_inx);
+
+size_t pair_scan_scalar(const char* base, size_t from, size_t to,
+			char first, char last, size_t last_inx){
+  while(from < to){
+    const char* hit = memchr(base + from, first, to - from);
+    if(nullptr == hit)
+      return to;
+    from = hit - base;
+    if(base[from + last_inx] == last)
+      return from;
+    from++;
+  }
+  return to;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+size_t pair_scan_sse2(const char* base, size_t from, size_t to,
+		      char first, char last, size_t last_inx){
+  const __m128i vfirst = _mm_set1_epi8(first);
+  const __m128i vlast = _mm_set1_epi8(last);
+  while(from + 16 <= to){
+    __m128i a = _mm_loadu_si128((const __m128i*)(base + from));
+    __m128i b = _mm_loadu_si128((const __m128i*)(base + from + last_inx));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, vfirst),
+						    _mm_cmpeq_epi8(b, vlast)));
+    if(mask)
+      return from + __builtin_ctz(mask);
+    from += 16;
+  }
+  return pair_scan_scalar(base, from, to, first, last, last_inx);
+}
+
+__attribute__((target("avx2")))
+size_t pair_scan_avx2(const char* base, size_t from, size_t to,
+		      char first, char last, size_t last_inx){
+  const __m256i vfirst = _mm256_set1_epi8(first);
+  const __m256i vlast = _mm256_set1_epi8(last);
+  while(from + 32 <= to){
+    __m256i a = _mm256_loadu_si256((const __m256i*)(base + from));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(base + from + last_inx));
+    unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, vfirst),
+							  _mm256_cmpeq_epi8(b, vlast)));
+    if(mask)
+      return from + __builtin_ctz(mask);
+    from += 32;
+  }
+  return pair_scan_sse2(base, from, to, first, last, last_inx);
+}
+#endif
+
+pair_scan_fn pick_pair_scan(void){
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    return pair_scan_avx2;
+  return pair_scan_sse2;
+#else
+  return pair_scan_scalar;
+#endif
+}
+
+pair_scan_fn pair_scan = nullptr;
+
+//Moves count bytes forward, stopping at the end of text
+TextLocation advance_location(TextLocation loc, size_t count){
+  while(count > 0){
+    size_t avail = loc.node->str.len - loc.offset;
+    if(count <= avail){
+      loc.offset += count;
+      break;
+    }
+    if(nullptr == loc.node->next){
+      loc.offset = loc.node->str.len;
+      break;
+    }
+    count -= avail;
+    loc.node = loc.node->next;
+    loc.offset = 0;
+  }
+  return loc;
+}
+
+//Compares needle against text starting at loc, following the chain
+bool match_at(TextLocation loc, StringView needle){
+  size_t done = 0;
+  while(done < needle.len){
+    if(loc.offset >= loc.node->str.len){
+      if(nullptr == loc.node->next)
+	return false;
+      loc.node = loc.node->next;
+      loc.offset = 0;
+      continue;
+    }
+    size_t avail = loc.node->str.len - loc.offset;
+    if(avail > needle.len - done)
+      avail = needle.len - done;
+    if(memcmp(loc.node->str.base + loc.offset, needle.base + done, avail))
+      return false;
+    done += avail;
+    loc.offset += avail;
+  }
+  return true;
+}
+
+//First match starting in node's [from, to), returns to when there is none
+size_t find_in_chunk(LinkedNativeString* node, size_t from, size_t to,
+		     StringView needle){
+  if(nullptr == pair_scan)
+    pair_scan = pick_pair_scan();
+  from = trigram_narrow(node, from, needle);
+  const char* base = node->str.base;
+  size_t len = node->str.len;
+  size_t last_inx = needle.len - 1;
+  //Starts that keep the whole needle inside this chunk
+  size_t inside_to = (len >= needle.len) ? (len - last_inx) : 0;
+  if(inside_to > to)
+    inside_to = to;
+  while(from < inside_to){
+    from = pair_scan(base, from, inside_to, needle.base[0],
+		     needle.base[last_inx], last_inx);
+    if(from == inside_to)
+      break;
+    if(0 == memcmp(base + from + 1, needle.base + 1, needle.len - 1))
+      return from;
+    from++;
+  }
+  //Starts whose match would straddle into the following chunks
+  if(from < inside_to)
+    from = inside_to;
+  for(; from < to; ++from){
+    if(base[from] != needle.base[0])
+      continue;
+    if(memcmp(base + from, needle.base, len - from))
+      continue;
+    if(match_at((TextLocation){.node = node, .offset = from}, needle))
+      return from;
+  }
+  return to;
+}
+
+//Range end is exclusive, a nullptr end node means the end of text
+size_t range_limit_in(LinkedNativeString* node, TextRange range){
+  if(node == range.end.node)
+    return range.end.offset;
+  return node->str.len;
+}
+
+TextRange make_match(LinkedNativeString* node, size_t at, size_t len){
+  TextRange out = {
+    .start = {.node = node, .offset = at}
+  };
+  out.end = advance_location(out.start, len);
+  snap_cursor_right(&out.end);
+  return out;
+}
+
+//First match whose start lies in range, the match itself may run past range end
+bool find_next(TextRange range, StringView needle, TextRange* out){
+  if((0 == needle.len) || (nullptr == range.start.node))
+    return false;
+  trigram_prepare(needle);
+  size_t from = range.start.offset;
+  for(LinkedNativeString* node = range.start.node; node; node = node->next){
+    size_t to = range_limit_in(node, range);
+    if(from < to){
+      size_t at = find_in_chunk(node, from, to, needle);
+      if(at < to){
+	*out = make_match(node, at, needle.len);
+	return true;
+      }
+    }
+    if(node == range.end.node)
+      break;
+    from = 0;
+  }
+  return false;
+}
+
+//Last match whose start lies in range
+bool find_previous(TextRange range, StringView needle, TextRange* out){
+  if((0 == needle.len) || (nullptr == range.start.node))
+    return false;
+  trigram_prepare(needle);
+  LinkedNativeString* node = range.end.node;
+  if(nullptr == node){
+    node = range.start.node;
+    while(node->next)
+      node = node->next;
+  }
+  for(; node; node = node->prev){
+    size_t from = (node == range.start.node) ? range.start.offset : 0;
+    size_t to = range_limit_in(node, range);
+    size_t last = to;
+    while(from < to){
+      size_t at = find_in_chunk(node, from, to, needle);
+      if(at == to)
+	break;
+      last = at;
+      from = at + 1;
+    }
+    if(last < to){
+      *out = make_match(node, last, needle.len);
+      return true;
+    }
+    if(node == range.start.node)
+      break;
+  }
+  return false;
+}
+
+//Identifier trie
+//Every identifier the lexer sees in code, keywords left out, with how many
+//times it occurs. Chunks keep the ids of the identifiers they hold, so
+//lexing a chunk again takes its old ones out and puts the new ones in
+//without rescanning the document. Each node also keeps the highest count
+//under it, so completing a prefix walks down to it and then goes best
+//first, looking at little more than the k results.
+enum {
+  IDENT_MAX_LEN = 64
+};
+
+typedef struct IdentNode IdentNode;
+struct IdentNode {
+  //0 for none, the root at 0 is never anyone's child
+  uint32_t child;
+  uint32_t sibling;
+  uint32_t parent;
+  uint32_t count;
+  uint32_t best;
+  unsigned char byte;
+  unsigned char len;
+};
+
+typedef struct IdentTrie IdentTrie;
+struct IdentTrie {
+  IdentNode* nodes;
+  size_t count;
+  size_t cap;
+};
+
+void ident_trie_clear(IdentTrie* t){
+  free(t->nodes);
+  *t = (IdentTrie){0};
+}
+
+//Changes an identifier's count and the best counts on its way to the root
+void ident_trie_adjust(IdentTrie* t, uint32_t id, int delta){
+  t->nodes[id].count += delta;
+  for(uint32_t v = id; ; v = t->nodes[v].parent){
+    uint32_t best = t->nodes[v].count;
+    for(uint32_t c = t->nodes[v].child; c; c = t->nodes[c].sibling)
+      if(t->nodes[c].best > best)
+	best = t->nodes[c].best;
+    if((v != id) && (t->nodes[v].best == best))
+      break;
+    t->nodes[v].best = best;
+    if(0 == v)
+      break;
+  }
+}
+
+//Counts one more of word, returns its id or 0 when out of memory
+uint32_t ident_trie_insert(IdentTrie* t, const char* word, size_t len){
+  if((0 == t->count) || (t->count + len > t->cap)){
+    size_t cap = t->cap ? t->cap : 1024;
+    while(cap < t->count + len + 1)
+      cap *= 2;
+    IdentNode* nodes = realloc(t->nodes, cap * sizeof(nodes[0]));
+    if(nullptr == nodes)
+      return 0;
+    t->nodes = nodes;
+    t->cap = cap;
+    if(0 == t->count)
+      t->nodes[t->count++] = (IdentNode){0};
+  }
+  uint32_t v = 0;
+  for(size_t i = 0; i < len; ++i){
+    unsigned char b = word[i];
+    uint32_t c = t->nodes[v].child;
+    while(c && (t->nodes[c].byte != b))
+      c = t->nodes[c].sibling;
+    if(0 == c){
+      c = t->count++;
+      t->nodes[c] = (IdentNode){
+	.sibling = t->nodes[v].child, .parent = v, .byte = b, .len = i + 1
+      };
+      t->nodes[v].child = c;
+    }
+    v = c;
+  }
+  ident_trie_adjust(t, v, 1);
+  return v;
+}
+
+//Writes the identifier out, buf holds at least IDENT_MAX_LEN bytes
+size_t ident_spell(const IdentTrie* t, uint32_t id, char* buf){
+  size_t len = t->nodes[id].len;
+  for(uint32_t v = id; v; v = t->nodes[v].parent)
+    buf[t->nodes[v].len - 1] = t->nodes[v].byte;
+  return len;
+}
+
+//Id of word, 0 when it is not in the trie
+uint32_t ident_trie_find(const IdentTrie* t, const char* word, size_t len){
+  uint32_t v = 0;
+  for(size_t i = 0; (i < len) && t->count; ++i){
+    uint32_t c = t->nodes[v].child;
+    while(c && (t->nodes[c].byte != (unsigned char)word[i]))
+      c = t->nodes[c].sibling;
+    if(0 == c)
+      return 0;
+    v = c;
+  }
+  return (len && t->count && t->nodes[v].count) ? v : 0;
+}
+
+typedef struct IdentPick IdentPick;
+struct IdentPick {
+  uint32_t key;
+  uint32_t node;
+  //The identifier ending at node rather than everything under it
+  bool word;
+};
+
+void ident_heap_push(IdentPick** heap, size_t* count, IdentPick pick){
+  if(!push_obj(heap, count, &pick))
+    return;
+  IdentPick* h = *heap;
+  for(size_t i = *count - 1; i > 0; ){
+    size_t up = (i - 1) / 2;
+    if(h[up].key >= h[i].key)
+      break;
+    IdentPick tmp = h[up];
+    h[up] = h[i];
+    h[i] = tmp;
+    i = up;
+  }
+}
+
+IdentPick ident_heap_pop(IdentPick* h, size_t* count){
+  IdentPick top = h[0];
+  h[0] = h[--*count];
+  for(size_t i = 0; ; ){
+    size_t big = i;
+    if((2 * i + 1 < *count) && (h[2 * i + 1].key > h[big].key))
+      big = 2 * i + 1;
+    if((2 * i + 2 < *count) && (h[2 * i + 2].key > h[big].key))
+      big = 2 * i + 2;
+    if(big == i)
+      break;
+    IdentPick tmp = h[big];
+    h[big] = h[i];
+    h[i] = tmp;
+    i = big;
+  }
+  return top;
+}
+
+//Up to k identifiers longer than prefix that start with it, most frequent
+//first, ids in out. Returns how many were found.
+size_t ident_complete(const IdentTrie* t, StringView prefix, uint32_t* out,
+		      size_t k){
+  if(0 == t->count)
+    return 0;
+  uint32_t v = 0;
+  for(size_t i = 0; (i < prefix.len) && (v || !i); ++i){
+    uint32_t c = t->nodes[v].child;
+    while(c && (t->nodes[c].byte != (unsigned char)prefix.base[i]))
+      c = t->nodes[c].sibling;
+    v = c;
+  }
+  if((prefix.len && !v) || (0 == t->nodes[v].best))
+    return 0;
+  IdentPick* heap = nullptr;
+  size_t heap_count = 0;
+  size_t found = 0;
+  ident_heap_push(&heap, &heap_count,
+		  (IdentPick){.key = t->nodes[v].best, .node = v});
+  while(heap_count && (found < k)){
+    IdentPick pick = ident_heap_pop(heap, &heap_count);
+    if(pick.word){
+      out[found++] = pick.node;
+      continue;
+    }
+    IdentNode* n = t->nodes + pick.node;
+    if(n->count && (n->len > prefix.len))
+      ident_heap_push(&heap, &heap_count,
+		      (IdentPick){.key = n->count, .node = pick.node, .word = true});
+    for(uint32_t c = n->child; c; c = t->nodes[c].sibling)
+      if(t->nodes[c].best)
+	ident_heap_push(&heap, &heap_count,
+			(IdentPick){.key = t->nodes[c].best, .node = c});
+  }
+  free(heap);
+  return found;
+}
+
+bool lexer_is_keyword(const Lexer* lx, const char* word, size_t len){
+  uint32_t s = 1;
+  for(size_t i = 0; (i < len) && s; ++i)
+    s = lx->next[s * lx->class_count + lx->byte_class[(unsigned char)word[i]]];
+  return s && lx->accept[s];
+}
+
+//Chunk index
+//Every chunk keeps a summary, a segment tree over the chunks in document
+//order combines them. For each bracket kind the summary holds the net depth
+//change across the chunk and the lowest depth reached inside it, relative
+//to its start, counting only brackets the lexer sees as code. The lexer
+//state at each chunk's start is kept too, so an edit re-lexes only the
+//chunks whose text or entry state actually changed. Finding the partner of
+//a bracket is then a scan of the two chunks involved and one walk down the
+//tree for everything in between. Byte and newline counts ride along, so a
+//line number and its position map to each other in O(log n) as well.
+enum BracketKind {
+  BRACKET_ROUND,
+  BRACKET_SQUARE,
+  BRACKET_CURLY,
+  BRACKET_KINDS
+};
+
+typedef struct ChunkSummary ChunkSummary;
+struct ChunkSummary {
+  int net[BRACKET_KINDS];
+  //Never above 0, the depth before the chunk counts
+  int min[BRACKET_KINDS];
+  size_t bytes;
+  size_t newlines;
+  //Newest chunk stamp under this part of the tree
+  size_t stamp;
+};
+
+typedef struct IdentWord IdentWord;
+struct IdentWord {
+  uint32_t id;
+  uint32_t offset;
+};
+
+int ident_word_cmp(const void* a, const void* b){
+  const IdentWord* x = a;
+  const IdentWord* y = b;
+  if(x->id != y->id)
+    return (x->id < y->id) ? -1 : 1;
+  return (x->offset < y->offset) ? -1 : (x->offset > y->offset);
+}
+
+//Curly opener at the shallowest depth reached so far in its chunk. Once the
+//depth before the chunk is known the ones at the top level of the document
+//are declaration bodies, what they declare is worked out by the outline
+//when first needed.
+typedef struct TopOpener TopOpener;
+struct TopOpener {
+  uint32_t offset;
+  //Relative to the chunk start
+  int depth;
+  bool parsed;
+  //Everything the parse read was inside this chunk, so it holds until the
+  //chunk is lexed again
+  bool cached;
+  int kind;
+  uint32_t id;
+  uint32_t name_offset;
+};
+
+typedef struct ChunkLeaf ChunkLeaf;
+struct ChunkLeaf {
+  LinkedNativeString* node;
+  size_t stamp;
+  //A delimiter or word near the end may be read on into the chunks after,
+  //empty ones included: how many were read, the last one and their newest
+  //stamp
+  size_t peek_count;
+  LinkedNativeString* peek_node;
+  size_t peek_stamp;
+  //Lexer state at the start and end, skip counts bytes a delimiter or an
+  //escape from the chunk before already took
+  LexState lex_in;
+  size_t skip_in;
+  LexState lex_out;
+  size_t skip_out;
+  ChunkSummary sum;
+  //The chunk starts inside a word, which the chunk before owns
+  bool word_in;
+  //The last word runs up to the end of the chunk
+  bool word_out;
+  //A word starting here ran on past the next chunk
+  bool word_far;
+  //Identifiers starting in this chunk, one count each, sorted by id and
+  //then offset so the occurrences of one are a binary search away
+  IdentWord* words;
+  size_t word_count;
+  TopOpener* tops;
+  size_t top_count;
+};
+
+typedef struct ChunkIndex ChunkIndex;
+struct ChunkIndex {
+  const Lexer* lexer;
+  //Identifiers get counted in here when set
+  IdentTrie* idents;
+  ChunkLeaf* leaves;
+  size_t count;
+  size_t leaf_cap;
+  //Leaves are carried over by node into this one, then the two swap
+  ChunkLeaf* spare;
+  size_t spare_cap;
+  //tree_size leaves padded to a power of two, root at 1
+  ChunkSummary* tree;
+  size_t tree_size;
+  //text_version it was last brought up to date at, 0 for never
+  size_t version;
+};
+
+typedef struct BracketEvent BracketEvent;
+struct BracketEvent {
+  size_t offset;
+  int kind;
+  //+1 opens, -1 closes
+  int dir;
+};
+
+int bracket_kind(char c, int* dir){
+  switch(c){
+  case '(': *dir = 1; return BRACKET_ROUND;
+  case ')': *dir = -1; return BRACKET_ROUND;
+  case '[': *dir = 1; return BRACKET_SQUARE;
+  case ']': *dir = -1; return BRACKET_SQUARE;
+  case '{': *dir = 1; return BRACKET_CURLY;
+  case '}': *dir = -1; return BRACKET_CURLY;
+  }
+  return -1;
+}
+
+ChunkSummary combine_summary(ChunkSummary a, ChunkSummary b){
+  ChunkSummary out;
+  for(int k = 0; k < BRACKET_KINDS; ++k){
+    out.net[k] = a.net[k] + b.net[k];
+    int through = a.net[k] + b.min[k];
+    out.min[k] = (a.min[k] < through) ? a.min[k] : through;
+  }
+  out.bytes = a.bytes + b.bytes;
+  out.newlines = a.newlines + b.newlines;
+  out.stamp = (a.stamp > b.stamp) ? a.stamp : b.stamp;
+  return out;
+}
+
+//Word starting at loc, its first byte the one that started it, read on
+//through the chunks after it. Words longer than IDENT_MAX_LEN come back
+//with a length of 0.
+size_t read_word(const Lexer* lx, TextLocation loc, char* buf, bool* far){
+  size_t len = 1;
+  buf[0] = loc.node->str.base[loc.offset++];
+  LinkedNativeString* node = loc.node;
+  size_t i = loc.offset;
+  while(node){
+    if(i == node->str.len){
+      node = node->next;
+      i = 0;
+      if(node && (node != loc.node->next))
+	*far = true;
+      continue;
+    }
+    unsigned char c = node->str.base[i];
+    if(!(lx->word_bytes[c] & LEX_WORD_PART))
+      break;
+    if(len == IDENT_MAX_LEN)
+      return 0;
+    buf[len++] = c;
+    i++;
+  }
+  return len;
+}
+
+//Lexes one chunk from leaf's entry state, collecting the brackets that are
+//code when events is not nullptr, and fills in the leaf's exit state. With
+//idents it also counts the identifiers starting in the chunk into it and
+//lists them in the leaf.
+ChunkSummary lex_chunk_brackets(const Lexer* lx, ChunkLeaf* leaf,
+				BracketEvent** events, size_t* event_count,
+				IdentTrie* idents){
+  ChunkSummary sum = {0};
+  LinkedNativeString* node = leaf->node;
+  const char* base = node->str.base;
+  size_t len = node->str.len;
+  sum.bytes = len;
+  sum.stamp = node->stamp;
+  for(const char* nl = memchr(base, '\n', len); nl;
+      nl = memchr(nl + 1, '\n', len - (nl + 1 - base)))
+    sum.newlines++;
+  LexState state = leaf->lex_in;
+  size_t i = leaf->skip_in;
+  //Furthest end of a read, delimiters and words may run past len
+  size_t reach = len;
+  while(i < len){
+    char c = base[i];
+    if(state > 0){
+      const LexRule* rule = lx->rules + (state - 1);
+      if(rule->escape && (c == rule->escape)){
+	i += 2;
+	continue;
+      }
+      if((LEX_LINE_COMMENT == rule->kind) || (LEX_STRING == rule->kind)){
+	if('\n' == c){
+	  state = 0;
+	  i++;
+	  continue;
+	}
+	if(LEX_LINE_COMMENT == rule->kind){
+	  i++;
+	  continue;
+	}
+      }
+      if((c == rule->close[0]) && (i + rule->close_len > reach))
+	reach = i + rule->close_len;
+      if((c == rule->close[0]) &&
+	 match_at((TextLocation){.node = node, .offset = i},
+		  (StringView){.base = (char*)rule->close,
+			       .len = rule->close_len})){
+	i += rule->close_len;
+	state = 0;
+	continue;
+      }
+      i++;
+      continue;
+    }
+    unsigned char uc = c;
+    if(lx->rule_start[uc]){
+      uint32_t r = 0;
+      for(; r < lx->rule_count; ++r){
+	if(!((lx->rule_start[uc] >> r) & 1))
+	  continue;
+	if(i + lx->rules[r].open_len > reach)
+	  reach = i + lx->rules[r].open_len;
+	if(match_at((TextLocation){.node = node, .offset = i},
+		    (StringView){.base = (char*)lx->rules[r].open,
+				 .len = lx->rules[r].open_len}))
+	  break;
+      }
+      if(r < lx->rule_count){
+	i += lx->rules[r].open_len;
+	state = r + 1;
+	continue;
+      }
+    }
+    bool after_word = i ? (lx->word_bytes[(unsigned char)base[i - 1]] & LEX_WORD_PART) :
+      leaf->word_in;
+    if(idents && (lx->word_bytes[uc] & LEX_WORD_START) && !after_word){
+      char word[IDENT_MAX_LEN];
+      size_t word_len = read_word(lx, (TextLocation){.node = node, .offset = i},
+				  word, &leaf->word_far);
+      //Up to the byte that ended it, or the one that made it too long
+      size_t word_read = (word_len ? word_len : IDENT_MAX_LEN) + 1;
+      if(i + word_read > reach)
+	reach = i + word_read;
+      //Numbers start like words
+      bool number = ('0' <= word[0]) && (word[0] <= '9');
+      if(word_len && !number && !lexer_is_keyword(lx, word, word_len)){
+	IdentWord found = {
+	  .id = ident_trie_insert(idents, word, word_len), .offset = i
+	};
+	if(found.id)
+	  push_obj(&leaf->words, &leaf->word_count, &found);
+      }
+      i++;
+      while((i < len) && (lx->word_bytes[(unsigned char)base[i]] & LEX_WORD_PART))
+	i++;
+      leaf->word_out = (i >= len);
+      continue;
+    }
+    int dir;
+    int kind = bracket_kind(c, &dir);
+    if(idents && (BRACKET_CURLY == kind) && (dir > 0) &&
+       (sum.net[kind] == sum.min[kind])){
+      TopOpener top = {.offset = i, .depth = sum.net[kind]};
+      push_obj(&leaf->tops, &leaf->top_count, &top);
+    }
+    if(kind >= 0){
+      sum.net[kind] += dir;
+      if(sum.net[kind] < sum.min[kind])
+	sum.min[kind] = sum.net[kind];
+      if(events){
+	BracketEvent ev = {.offset = i, .kind = kind, .dir = dir};
+	push_obj(events, event_count, &ev);
+      }
+    }
+    i++;
+  }
+  if(leaf->word_count)
+    qsort(leaf->words, leaf->word_count, sizeof(leaf->words[0]), ident_word_cmp);
+  leaf->lex_out = state;
+  leaf->skip_out = i - len;
+  //At least the next chunk, then on until every byte read past len is
+  //covered, empty chunks on the way count too
+  leaf->peek_count = 0;
+  leaf->peek_node = nullptr;
+  leaf->peek_stamp = 0;
+  size_t covered = len;
+  for(LinkedNativeString* next = node->next;
+      next && ((0 == leaf->peek_count) || (covered < reach));
+      next = next->next){
+    leaf->peek_count++;
+    leaf->peek_node = next;
+    if(next->stamp > leaf->peek_stamp)
+      leaf->peek_stamp = next->stamp;
+    covered += next->str.len;
+  }
+  return sum;
+}
+
+void chunk_index_free(ChunkIndex* ci){
+  for(size_t i = 0; i < ci->count; ++i){
+    free(ci->leaves[i].words);
+    free(ci->leaves[i].tops);
+  }
+  free(ci->leaves);
+  free(ci->spare);
+  free(ci->tree);
+  if(ci->idents)
+    ident_trie_clear(ci->idents);
+  *ci = (ChunkIndex){.lexer = ci->lexer, .idents = ci->idents};
+}
+
+//Takes a leaf's identifiers back out of the trie and frees its lists
+void chunk_index_release_leaf(ChunkIndex* ci, ChunkLeaf* leaf){
+  if(ci->idents)
+    for(size_t w = 0; w < leaf->word_count; ++w)
+      ident_trie_adjust(ci->idents, leaf->words[w].id, -1);
+  free(leaf->words);
+  free(leaf->tops);
+  leaf->words = nullptr;
+  leaf->word_count = 0;
+  leaf->tops = nullptr;
+  leaf->top_count = 0;
+}
+
+void chunk_index_set_leaf(ChunkIndex* ci, size_t inx, ChunkSummary sum){
+  size_t v = ci->tree_size + inx;
+  ci->tree[v] = sum;
+  for(v /= 2; v >= 1; v /= 2)
+    ci->tree[v] = combine_summary(ci->tree[2 * v], ci->tree[2 * v + 1]);
+}
+
+//The chunks read past the end are still the same ones, in the same order,
+//and none was touched since. Edits bump text_version before stamping, so a
+//touched or newly split chunk has a stamp above any seen when lexing.
+bool chunk_index_leaf_current(const ChunkLeaf* leaf, LinkedNativeString* node,
+			      LexState state, size_t skip, bool word_in){
+  if(!((leaf->node == node) && (leaf->stamp == node->stamp) &&
+       (leaf->lex_in == state) && (leaf->skip_in == skip) &&
+       (leaf->word_in == word_in) && !leaf->word_far))
+    return false;
+  LinkedNativeString* next = node->next;
+  for(size_t k = 0; k < leaf->peek_count; ++k){
+    if((nullptr == next) || (next->stamp > leaf->peek_stamp))
+      return false;
+    if(k + 1 < leaf->peek_count)
+      next = next->next;
+  }
+  return (0 == leaf->peek_count) ? (nullptr == next) :
+    (next == leaf->peek_node);
+}
+
+//Brings the index up to date with the chain, once per frame. Walking the
+//chunk headers is cheap, only chunks that changed are lexed again. A leaf
+//is found again through its node's last position, so chunks split or
+//dropped in front of it do not make it stale.
+bool chunk_index_refresh(ChunkIndex* ci, LinkedNativeString* head){
+  if(ci->version == text_version)
+    return true;
+  if(nullptr == ci->lexer)
+    return false;
+  size_t count = 0;
+  for(LinkedNativeString* node = head; node; node = node->next)
+    count++;
+  if(count > ci->spare_cap){
+    ChunkLeaf* spare = realloc(ci->spare, count * sizeof(spare[0]));
+    if(nullptr == spare){
+      chunk_index_free(ci);
+      return false;
+    }
+    ci->spare = spare;
+    ci->spare_cap = count;
+  }
+  size_t tree_size = 1;
+  while(tree_size < count)
+    tree_size *= 2;
+  bool rebuild = (tree_size != ci->tree_size) || (count != ci->count);
+  if(tree_size != ci->tree_size){
+    ChunkSummary* tree = calloc(2 * tree_size, sizeof(tree[0]));
+    if(nullptr == tree){
+      chunk_index_free(ci);
+      return false;
+    }
+    free(ci->tree);
+    ci->tree = tree;
+    ci->tree_size = tree_size;
+  }
+
+  LexState state = 0;
+  size_t skip = 0;
+  bool word_in = false;
+  size_t i = 0;
+  for(LinkedNativeString* node = head; node; node = node->next, ++i){
+    ChunkLeaf* old = nullptr;
+    if((node->index_pos < ci->count) &&
+       (ci->leaves[node->index_pos].node == node))
+      old = ci->leaves + node->index_pos;
+    bool current = old &&
+      chunk_index_leaf_current(old, node, state, skip, word_in);
+    bool moved = (nullptr == old) || (node->index_pos != i);
+    ChunkLeaf* leaf = ci->spare + i;
+    if(current)
+      *leaf = *old;
+    else{
+      if(old)
+	chunk_index_release_leaf(ci, old);
+      *leaf = (ChunkLeaf){
+	.node = node, .stamp = node->stamp, .lex_in = state, .skip_in = skip,
+	.word_in = word_in
+      };
+      leaf->sum = lex_chunk_brackets(ci->lexer, leaf, nullptr, nullptr,
+				     ci->idents);
+    }
+    //Taken, whatever is left over afterwards belonged to dropped chunks
+    if(old)
+      old->node = nullptr;
+    node->index_pos = i;
+    if(rebuild)
+      ci->tree[tree_size + i] = leaf->sum;
+    else if(!current || moved)
+      chunk_index_set_leaf(ci, i, leaf->sum);
+    state = leaf->lex_out;
+    skip = leaf->skip_out;
+    //Same as lexing straight on: after a word byte, or where the word the
+    //chunk ends in would have gone on
+    LinkedNativeString* next = node->next;
+    if(node->str.len)
+      word_in = (ci->lexer->word_bytes[(unsigned char)node->str.base[node->str.len - 1]] &
+		 LEX_WORD_PART) ||
+	(leaf->word_out && next && next->str.len &&
+	 (ci->lexer->word_bytes[(unsigned char)next->str.base[0]] & LEX_WORD_PART));
+  }
+  for(size_t k = 0; k < ci->count; ++k)
+    if(ci->leaves[k].node)
+      chunk_index_release_leaf(ci, ci->leaves + k);
+  if(rebuild){
+    for(size_t k = count; k < tree_size; ++k)
+      ci->tree[tree_size + k] = (ChunkSummary){0};
+    for(size_t v = tree_size - 1; v >= 1; --v)
+      ci->tree[v] = combine_summary(ci->tree[2 * v], ci->tree[2 * v + 1]);
+  }
+  ChunkLeaf* leaves = ci->leaves;
+  size_t leaf_cap = ci->leaf_cap;
+  ci->leaves = ci->spare;
+  ci->leaf_cap = ci->spare_cap;
+  ci->spare = leaves;
+  ci->spare_cap = leaf_cap;
+  ci->count = count;
+  ci->version = text_version;
+  return true;
+}
+
+//Leaf of node while the index is current, count otherwise
+size_t chunk_index_leaf_of(const ChunkIndex* ci, const LinkedNativeString* node){
+  if((ci->version != text_version) || (node->index_pos >= ci->count) ||
+     (ci->leaves[node->index_pos].node != node))
+    return ci->count;
+  return node->index_pos;
+}
+
+//First leaf at or after from where depth, starting at *carry, dips below 0.
+//*carry comes back as the depth at that leaf's start.
+size_t chunk_index_first_below(const ChunkIndex* ci, int kind, size_t v,
+			       size_t lo, size_t hi, size_t from, int* carry){
+  if(hi <= from)
+    return ci->tree_size;
+  if((lo >= from) && (*carry + ci->tree[v].min[kind] >= 0)){
+    *carry += ci->tree[v].net[kind];
+    return ci->tree_size;
+  }
+  if(hi - lo == 1)
+    return lo;
+  size_t mid = lo + (hi - lo) / 2;
+  size_t found = chunk_index_first_below(ci, kind, 2 * v, lo, mid, from, carry);
+  if(found != ci->tree_size)
+    return found;
+  return chunk_index_first_below(ci, kind, 2 * v + 1, mid, hi, from, carry);
+}
+
+//Same walking backwards from the leaves before to, depth counted from the
+//right: a closer adds one, an opener takes one away
+size_t chunk_index_last_below(const ChunkIndex* ci, int kind, size_t v,
+			      size_t lo, size_t hi, size_t to, int* carry){
+  if(lo >= to)
+    return ci->tree_size;
+  int reverse_min = ci->tree[v].min[kind] - ci->tree[v].net[kind];
+  if((hi <= to) && (*carry + reverse_min >= 0)){
+    *carry -= ci->tree[v].net[kind];
+    return ci->tree_size;
+  }
+  if(hi - lo == 1)
+    return lo;
+  size_t mid = lo + (hi - lo) / 2;
+  size_t found = chunk_index_last_below(ci, kind, 2 * v + 1, mid, hi, to, carry);
+  if(found != ci->tree_size)
+    return found;
+  return chunk_index_last_below(ci, kind, 2 * v, lo, mid, to, carry);
+}
+
+//Brackets of one chunk that are code, caller frees
+BracketEvent* chunk_brackets(const ChunkIndex* ci, size_t leaf_inx,
+			     size_t* count){
+  BracketEvent* events = nullptr;
+  *count = 0;
+  ChunkLeaf leaf = ci->leaves[leaf_inx];
+  lex_chunk_brackets(ci->lexer, &leaf, &events, count, nullptr);
+  return events;
+}
+
+//Walks the brackets of kind from event at on, and on through the chunks
+//after, until depth dips below 0
+bool bracket_scan_forward(ChunkIndex* ci, size_t inx, BracketEvent* events,
+			  size_t event_count, size_t at, int kind, int depth,
+			  TextLocation* out){
+  for(size_t e = at; e < event_count; ++e){
+    if(events[e].kind != kind)
+      continue;
+    depth += events[e].dir;
+    if(depth < 0){
+      *out = (TextLocation){.node = ci->leaves[inx].node, .offset = events[e].offset};
+      return true;
+    }
+  }
+  size_t target = chunk_index_first_below(ci, kind, 1, 0, ci->tree_size,
+					  inx + 1, &depth);
+  if(target >= ci->count)
+    return false;
+  size_t target_count;
+  BracketEvent* target_events = chunk_brackets(ci, target, &target_count);
+  bool found = false;
+  for(size_t e = 0; (e < target_count) && !found; ++e){
+    if(target_events[e].kind != kind)
+      continue;
+    depth += target_events[e].dir;
+    if(depth < 0){
+      *out = (TextLocation){
+	.node = ci->leaves[target].node, .offset = target_events[e].offset
+      };
+      found = true;
+    }
+  }
+  free(target_events);
+  return found;
+}
+
+//Same walking back from the events before at, a closer adds one to depth
+bool bracket_scan_backward(ChunkIndex* ci, size_t inx, BracketEvent* events,
+			   size_t at, int kind, int depth, TextLocation* out){
+  for(size_t e = at; e > 0; --e){
+    if(events[e - 1].kind != kind)
+      continue;
+    depth -= events[e - 1].dir;
+    if(depth < 0){
+      *out = (TextLocation){
+	.node = ci->leaves[inx].node, .offset = events[e - 1].offset
+      };
+      return true;
+    }
+  }
+  size_t target = chunk_index_last_below(ci, kind, 1, 0, ci->tree_size,
+					 inx, &depth);
+  if(target >= ci->count)
+    return false;
+  size_t target_count;
+  BracketEvent* target_events = chunk_brackets(ci, target, &target_count);
+  bool found = false;
+  for(size_t e = target_count; (e > 0) && !found; --e){
+    if(target_events[e - 1].kind != kind)
+      continue;
+    depth -= target_events[e - 1].dir;
+    if(depth < 0){
+      *out = (TextLocation){
+	.node = ci->leaves[target].node, .offset = target_events[e - 1].offset
+      };
+      found = true;
+    }
+  }
+  free(target_events);
+  return found;
+}
+
+//Partner of the bracket right at loc, false when loc is not on a bracket
+//that is code or the partner is missing. Needs a current index.
+bool bracket_match(ChunkIndex* ci, TextLocation loc, TextLocation* out){
+  snap_cursor_right(&loc);
+  size_t inx = chunk_index_leaf_of(ci, loc.node);
+  if((inx == ci->count) || (loc.offset >= loc.node->str.len))
+    return false;
+  size_t event_count;
+  BracketEvent* events = chunk_brackets(ci, inx, &event_count);
+  size_t at = 0;
+  while((at < event_count) && (events[at].offset < (size_t)loc.offset))
+    at++;
+  bool found = false;
+  if((at < event_count) && (events[at].offset == (size_t)loc.offset)){
+    if(events[at].dir > 0)
+      found = bracket_scan_forward(ci, inx, events, event_count, at + 1,
+				   events[at].kind, 0, out);
+    else
+      found = bracket_scan_backward(ci, inx, events, at, events[at].kind,
+				    0, out);
+  }
+  free(events);
+  return found;
+}
+
+//Innermost bracket of kind still open at loc
+bool bracket_enclosing(ChunkIndex* ci, TextLocation loc, int kind,
+		       TextLocation* out){
+  snap_cursor_right(&loc);
+  size_t inx = chunk_index_leaf_of(ci, loc.node);
+  if(inx == ci->count)
+    return false;
+  size_t event_count;
+  BracketEvent* events = chunk_brackets(ci, inx, &event_count);
+  size_t at = 0;
+  while((at < event_count) && (events[at].offset < (size_t)loc.offset))
+    at++;
+  bool found = bracket_scan_backward(ci, inx, events, at, kind, 0, out);
+  free(events);
+  return found;
+}
+
+//Totals of every leaf before inx, the min fields are left at 0
+ChunkSummary chunk_index_prefix(const ChunkIndex* ci, size_t inx){
+  ChunkSummary sum = {0};
+  for(size_t v = ci->tree_size + inx; v > 1; v /= 2){
+    if(!(v & 1))
+      continue;
+    const ChunkSummary* left = ci->tree + (v - 1);
+    for(int k = 0; k < BRACKET_KINDS; ++k)
+      sum.net[k] += left->net[k];
+    sum.bytes += left->bytes;
+    sum.newlines += left->newlines;
+    if(left->stamp > sum.stamp)
+      sum.stamp = left->stamp;
+  }
+  return sum;
+}
+
+size_t chunk_index_line_count(const ChunkIndex* ci){
+  return ci->tree[1].newlines + 1;
+}
+
+//Line of loc, counted from 0. Needs a current index.
+size_t chunk_index_line_of(const ChunkIndex* ci, TextLocation loc){
+  size_t inx = chunk_index_leaf_of(ci, loc.node);
+  if(inx == ci->count)
+    return 0;
+  size_t line = chunk_index_prefix(ci, inx).newlines;
+  const char* base = loc.node->str.base;
+  for(int i = 0; i < loc.offset; ++i)
+    line += ('\n' == base[i]);
+  return line;
+}
+
+//Byte offset of loc in the document. Needs a current index.
+size_t chunk_index_offset_of(const ChunkIndex* ci, TextLocation loc){
+  size_t inx = chunk_index_leaf_of(ci, loc.node);
+  if(inx == ci->count)
+    return 0;
+  return chunk_index_prefix(ci, inx).bytes + loc.offset;
+}
+
+//Where a line starts, false past the last line
+bool chunk_index_line_start(const ChunkIndex* ci, size_t line, TextLocation* out){
+  if(0 == ci->count)
+    return false;
+  if(0 == line){
+    *out = (TextLocation){.node = ci->leaves[0].node};
+    return true;
+  }
+  if(line > ci->tree[1].newlines)
+    return false;
+  //Down to the leaf holding the line-th newline
+  size_t nth = line;
+  size_t v = 1;
+  while(v < ci->tree_size){
+    if(ci->tree[2 * v].newlines >= nth)
+      v = 2 * v;
+    else{
+      nth -= ci->tree[2 * v].newlines;
+      v = 2 * v + 1;
+    }
+  }
+  LinkedNativeString* node = ci->leaves[v - ci->tree_size].node;
+  for(size_t i = 0; i < node->str.len; ++i){
+    if(('\n' == node->str.base[i]) && (0 == --nth)){
+      *out = (TextLocation){.node = node, .offset = i + 1};
+      return true;
+    }
+  }
+  return false;
+}
+
+//First and last leaf edited after text version since, false when none
+bool chunk_index_changed_since(const ChunkIndex* ci, size_t since,
+			       size_t* first, size_t* last){
+  if((0 == ci->count) || (ci->tree[1].stamp <= since))
+    return false;
+  size_t v = 1;
+  while(v < ci->tree_size)
+    v = (ci->tree[2 * v].stamp > since) ? (2 * v) : (2 * v + 1);
+  *first = v - ci->tree_size;
+  v = 1;
+  while(v < ci->tree_size)
+    v = (ci->tree[2 * v + 1].stamp > since) ? (2 * v + 1) : (2 * v);
+  *last = v - ci->tree_size;
+  return true;
+}
+
+//Location of a document byte offset, false past the end
+bool chunk_index_location_at(const ChunkIndex* ci, size_t offset,
+			     TextLocation* out){
+  if((0 == ci->count) || (offset > ci->tree[1].bytes))
+    return false;
+  size_t v = 1;
+  while(v < ci->tree_size){
+    if(ci->tree[2 * v].bytes > offset)
+      v = 2 * v;
+    else{
+      offset -= ci->tree[2 * v].bytes;
+      v = 2 * v + 1;
+    }
+  }
+  size_t inx = v - ci->tree_size;
+  if(inx >= ci->count){
+    //Right at the end of text
+    inx = ci->count - 1;
+    offset = ci->leaves[inx].node->str.len;
+  }
+  *out = (TextLocation){.node = ci->leaves[inx].node, .offset = offset};
+  return true;
+}
+
+//Occurrences
+//The identifier under the cursor is found among the words of its chunk and
+//the one before, then each chunk drawn looks its occurrences up in its own
+//sorted word list and hands them on as spans, the same way keyword colours
+//are applied.
+
+//Identifier whose text the cursor is on, else the one it is right after.
+//Needs a current index counting identifiers.
+bool ident_at(const ChunkIndex* ci, TextLocation loc, uint32_t* id){
+  snap_cursor_right(&loc);
+  size_t inx = chunk_index_leaf_of(ci, loc.node);
+  if((inx == ci->count) || (nullptr == ci->idents))
+    return false;
+  //A word owned by a chunk before may run into this one
+  size_t pos = loc.offset;
+  bool ended = false;
+  for(size_t k = inx; ; --k){
+    const ChunkLeaf* leaf = ci->leaves + k;
+    if(k < inx)
+      pos += leaf->node->str.len;
+    for(size_t w = 0; w < leaf->word_count; ++w){
+      size_t start = leaf->words[w].offset;
+      size_t end = start + ci->idents->nodes[leaf->words[w].id].len;
+      if((start <= pos) && (pos < end)){
+	*id = leaf->words[w].id;
+	return true;
+      }
+      //One ending right at the cursor only counts when none goes over it
+      if((pos == end) && !ended){
+	*id = leaf->words[w].id;
+	ended = true;
+      }
+    }
+    //Right at the start of the chunk a word may end just before it
+    bool at_start = (k == inx) && (0 == loc.offset);
+    if((!leaf->word_in && !at_start) || (0 == k))
+      return ended;
+  }
+}
+
+//Spans over every occurrence of id in one leaf, document offsets counted
+//from base. Returns how many were pushed.
+size_t ident_occurrences(const ChunkIndex* ci, size_t inx, uint32_t id,
+			 size_t base, RlColor color, HighlightSpan** spans,
+			 size_t* span_count){
+  const ChunkLeaf* leaf = ci->leaves + inx;
+  size_t lo = 0;
+  size_t hi = leaf->word_count;
+  while(lo < hi){
+    size_t mid = lo + (hi - lo) / 2;
+    if(leaf->words[mid].id < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  size_t pushed = 0;
+  size_t len = ci->idents->nodes[id].len;
+  for(; (lo < leaf->word_count) && (leaf->words[lo].id == id); ++lo){
+    HighlightSpan span = {
+      .start = base + leaf->words[lo].offset,
+      .end = base + leaf->words[lo].offset + len,
+      .color = color
+    };
+    if(push_obj(spans, span_count, &span))
+      pushed++;
+  }
+  return pushed;
+}
+
+//Span covering offset, nullptr when none. Offsets only go up between calls,
+//*next keeps the place.
+const HighlightSpan* span_covering(const HighlightSpan* spans, size_t count,
+				   size_t* next, size_t offset){
+  while((*next < count) && (spans[*next].end <= offset))
+    (*next)++;
+  if((*next < count) && (spans[*next].start <= offset))
+    return spans + *next;
+  return nullptr;
+}
+
+//Outline
+//Functions and structs defined at the top level, for jumping to a
+//definition. The chunk index already lists the curly openers that can be at
+//the top level and knows the depth before every chunk, so finding the
+//bodies is a pass over the leaves. Only the declaration in front of a body
+//is parsed, backwards from the brace, and the result is kept in the leaf
+//until that chunk changes.
+enum OutlineKind {
+  OUTLINE_NONE,
+  OUTLINE_FUNCTION,
+  OUTLINE_STRUCT
+};
+
+typedef struct OutlineSymbol OutlineSymbol;
+struct OutlineSymbol {
+  uint32_t id;
+  int kind;
+  //Document offset of the name
+  size_t offset;
+};
+
+typedef struct Outline Outline;
+struct Outline {
+  //In document order
+  OutlineSymbol* symbols;
+  size_t count;
+  //The same sorted by id
+  OutlineSymbol* by_name;
+  //Chunk index version it was built from
+  size_t version;
+};
+
+bool is_blank(char c){
+  return (' ' == c) || ('\t' == c) || ('\n' == c) || ('\r' == c);
+}
+
+//Byte before loc, moving loc onto it. False at the start of text.
+bool step_back(TextLocation* loc, char* c){
+  snap_cursor_left(loc);
+  if(0 == loc->offset)
+    return false;
+  loc->offset--;
+  *c = loc->node->str.base[loc->offset];
+  return true;
+}
+
+//Last non blank byte before loc, loc left on it
+bool step_back_blank(TextLocation* loc, char* c){
+  while(step_back(loc, c))
+    if(!is_blank(*c))
+      return true;
+  return false;
+}
+
+//Word ending on the byte at loc, read backwards. loc is left on its first
+//byte, the word is written to the end of buf and its length returned.
+size_t word_back(const Lexer* lx, TextLocation* loc, char* buf){
+  size_t len = 0;
+  TextLocation at = *loc;
+  char c = at.node->str.base[at.offset];
+  while(lx->word_bytes[(unsigned char)c] & LEX_WORD_PART){
+    if(len == IDENT_MAX_LEN)
+      return 0;
+    buf[IDENT_MAX_LEN - 1 - len++] = c;
+    *loc = at;
+    if(!step_back(&at, &c))
+      break;
+  }
+  return len;
+}
+
+bool word_is(const char* word, size_t len, const char* text){
+  return (strlen(text) == len) && (0 == memcmp(word, text, len));
+}
+
+//Works out what the body opening at brace declares: a function when a
+//parameter list stands right in front of it, a struct, union or enum when
+//the tag does, or for an untagged one the name after the closing brace.
+//*local comes back false when anything read lay outside brace's chunk.
+int outline_parse(ChunkIndex* ci, TextLocation brace, uint32_t* id,
+		  TextLocation* name, bool* local){
+  const Lexer* lx = ci->lexer;
+  *local = true;
+  TextLocation at = brace;
+  char c;
+  if(!step_back_blank(&at, &c))
+    return OUTLINE_NONE;
+  int kind = OUTLINE_STRUCT;
+  if(')' == c){
+    TextLocation open;
+    if(!bracket_match(ci, at, &open))
+      return OUTLINE_NONE;
+    *local = *local && (open.node == brace.node);
+    at = open;
+    if(!step_back_blank(&at, &c))
+      return OUTLINE_NONE;
+    kind = OUTLINE_FUNCTION;
+  }
+  char buf[IDENT_MAX_LEN];
+  size_t len = word_back(lx, &at, buf);
+  *local = *local && (at.node == brace.node);
+  if((0 == len) || (('0' <= buf[IDENT_MAX_LEN - len]) &&
+		    (buf[IDENT_MAX_LEN - len] <= '9')))
+    return OUTLINE_NONE;
+  const char* word = buf + IDENT_MAX_LEN - len;
+  if(OUTLINE_FUNCTION == kind){
+    if(lexer_is_keyword(lx, word, len))
+      return OUTLINE_NONE;
+    *name = at;
+  }
+  else if(word_is(word, len, "struct") || word_is(word, len, "union") ||
+	  word_is(word, len, "enum")){
+    //typedef struct { ... } Name;
+    TextLocation close;
+    if(!bracket_match(ci, brace, &close))
+      return OUTLINE_NONE;
+    *local = false;
+    move_cursor_right(&close);
+    snap_cursor_right(&close);
+    while((close.offset < close.node->str.len) &&
+	  is_blank(close.node->str.base[close.offset])){
+      move_cursor_right(&close);
+      snap_cursor_right(&close);
+    }
+    bool far = false;
+    if(close.offset >= close.node->str.len)
+      return OUTLINE_NONE;
+    len = read_word(lx, close, buf, &far);
+    if((0 == len) || !(lx->word_bytes[(unsigned char)buf[0]] & LEX_WORD_START))
+      return OUTLINE_NONE;
+    word = buf;
+    *name = close;
+  }
+  else{
+    //The tag has to follow struct, union or enum
+    TextLocation tag = at;
+    char before[IDENT_MAX_LEN];
+    if(!step_back_blank(&at, &c))
+      return OUTLINE_NONE;
+    size_t before_len = word_back(lx, &at, before);
+    *local = *local && (at.node == brace.node);
+    const char* keyword = before + IDENT_MAX_LEN - before_len;
+    if(!word_is(keyword, before_len, "struct") &&
+       !word_is(keyword, before_len, "union") &&
+       !word_is(keyword, before_len, "enum"))
+      return OUTLINE_NONE;
+    *name = tag;
+  }
+  *id = ident_trie_find(ci->idents, word, len);
+  return *id ? kind : OUTLINE_NONE;
+}
+
+void outline_free(Outline* o){
+  free(o->symbols);
+  free(o->by_name);
+  *o = (Outline){0};
+}
+
+int outline_symbol_cmp(const void* a, const void* b){
+  const OutlineSymbol* x = a;
+  const OutlineSymbol* y = b;
+  if(x->id != y->id)
+    return (x->id < y->id) ? -1 : 1;
+  return (x->offset < y->offset) ? -1 : (x->offset > y->offset);
+}
+
+//Rebuilds the symbol lists when the index moved on. Needs a current index
+//counting identifiers.
+void outline_refresh(Outline* o, ChunkIndex* ci){
+  if((o->version == ci->version) || (nullptr == ci->idents))
+    return;
+  o->count = 0;
+  size_t symbol_cap = 0;
+  int depth = 0;
+  size_t bytes = 0;
+  for(size_t k = 0; k < ci->count; ++k){
+    ChunkLeaf* leaf = ci->leaves + k;
+    for(size_t t = 0; t < leaf->top_count; ++t){
+      TopOpener* top = leaf->tops + t;
+      if(depth + top->depth != 0)
+	continue;
+      size_t offset = bytes + top->name_offset;
+      if(!top->parsed || !top->cached){
+	TextLocation name;
+	bool local;
+	top->kind = outline_parse(ci, (TextLocation){
+	    .node = leaf->node, .offset = top->offset
+	  }, &top->id, &name, &local);
+	top->parsed = true;
+	top->cached = local;
+	if(OUTLINE_NONE != top->kind){
+	  offset = chunk_index_offset_of(ci, name);
+	  top->name_offset = offset - bytes;
+	}
+      }
+      if(OUTLINE_NONE == top->kind)
+	continue;
+      if(o->count == symbol_cap){
+	symbol_cap = symbol_cap ? 2 * symbol_cap : 64;
+	OutlineSymbol* symbols = realloc(o->symbols, symbol_cap * sizeof(symbols[0]));
+	if(nullptr == symbols){
+	  outline_free(o);
+	  return;
+	}
+	o->symbols = symbols;
+      }
+      o->symbols[o->count++] = (OutlineSymbol){
+	.id = top->id, .kind = top->kind, .offset = offset
+      };
+    }
+    depth += leaf->sum.net[BRACKET_CURLY];
+    bytes += leaf->sum.bytes;
+  }
+  free(o->by_name);
+  o->by_name = malloc((o->count + 1) * sizeof(o->by_name[0]));
+  if(nullptr == o->by_name){
+    outline_free(o);
+    return;
+  }
+  if(o->count)
+    memcpy(o->by_name, o->symbols, o->count * sizeof(o->by_name[0]));
+  qsort(o->by_name, o->count, sizeof(o->by_name[0]), outline_symbol_cmp);
+  o->version = ci->version;
+}
+
+//First definition of id, nullptr when there is none
+const OutlineSymbol* outline_find(const Outline* o, uint32_t id){
+  size_t lo = 0;
+  size_t hi = o->count;
+  while(lo < hi){
+    size_t mid = lo + (hi - lo) / 2;
+    if(o->by_name[mid].id < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return ((lo < o->count) && (o->by_name[lo].id == id)) ? (o->by_name + lo) : nullptr;
+}
+
+//Folding
+//Fold regions come from the bracket structure: a line starts one when a
+//bracket opened on it is still open at its end and closes at least two
+//lines further down. Folding hides the lines in between. Folds are kept
+//sorted by start line and flattened into disjoint hidden intervals with a
+//running count of hidden lines, so document and visible lines map to each
+//other with a binary search and the renderer jumps over a fold through the
+//chunk index without touching the text inside.
+typedef struct FoldRegion FoldRegion;
+struct FoldRegion {
+  size_t start_line;
+  size_t end_line;
+};
+
+typedef struct FoldSet FoldSet;
+struct FoldSet {
+  //Every fold asked for, nested ones included
+  FoldRegion* folds;
+  size_t count;
+  //What is actually hidden, lines start_line + 1 to end_line - 1 of each
+  FoldRegion* outer;
+  size_t outer_count;
+  //Lines hidden by the outer folds before each one, outer_count + 1 long
+  size_t* hidden_before;
+  //text_version the lines were last brought up to date at
+  size_t version;
+  //Goes up whenever what is hidden may have changed
+  size_t changes;
+};
+
+void fold_set_free(FoldSet* fs){
+  free(fs->folds);
+  free(fs->outer);
+  free(fs->hidden_before);
+  *fs = (FoldSet){.version = fs->version, .changes = fs->changes + 1};
+}
+
+//Rebuilds the hidden intervals after folds changed
+bool fold_set_flatten(FoldSet* fs){
+  fs->changes++;
+  free(fs->outer);
+  free(fs->hidden_before);
+  fs->outer = nullptr;
+  fs->outer_count = 0;
+  fs->hidden_before = calloc(fs->count + 1, sizeof(fs->hidden_before[0]));
+  if(nullptr == fs->hidden_before){
+    fold_set_free(fs);
+    return false;
+  }
+  for(size_t i = 0; i < fs->count; ++i){
+    FoldRegion f = fs->folds[i];
+    FoldRegion* last = fs->outer_count ? (fs->outer + fs->outer_count - 1) : nullptr;
+    //Starting on a hidden line, it carries on what is hidden
+    if(last && (f.start_line < last->end_line)){
+      if(f.end_line > last->end_line)
+	last->end_line = f.end_line;
+      continue;
+    }
+    if(!push_obj(&fs->outer, &fs->outer_count, &f)){
+      fold_set_free(fs);
+      return false;
+    }
+  }
+  for(size_t i = 0; i < fs->outer_count; ++i)
+    fs->hidden_before[i + 1] = fs->hidden_before[i] +
+      (fs->outer[i].end_line - fs->outer[i].start_line - 1);
+  return true;
+}
+
+//First outer fold starting on or after line
+size_t fold_set_from(const FoldSet* fs, size_t line){
+  size_t lo = 0;
+  size_t hi = fs->outer_count;
+  while(lo < hi){
+    size_t mid = lo + (hi - lo) / 2;
+    if(fs->outer[mid].start_line < line)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+//Outer fold hiding line, outer_count when it is shown
+size_t fold_set_hiding(const FoldSet* fs, size_t line){
+  size_t lo = fold_set_from(fs, line);
+  if((lo > 0) && (line < fs->outer[lo - 1].end_line))
+    return lo - 1;
+  return fs->outer_count;
+}
+
+//Row a document line is shown on, a hidden line shows as its fold's start
+size_t fold_visible_line(const FoldSet* fs, size_t line){
+  if(0 == fs->outer_count)
+    return line;
+  size_t hiding = fold_set_hiding(fs, line);
+  if(hiding < fs->outer_count)
+    return fs->outer[hiding].start_line - fs->hidden_before[hiding];
+  return line - fs->hidden_before[fold_set_from(fs, line)];
+}
+
+//Document line shown on a row
+size_t fold_document_line(const FoldSet* fs, size_t visible){
+  if(0 == fs->outer_count)
+    return visible;
+  size_t lo = 0;
+  size_t hi = fs->outer_count;
+  while(lo < hi){
+    size_t mid = lo + (hi - lo) / 2;
+    if(fs->outer[mid].start_line - fs->hidden_before[mid] < visible)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return visible + fs->hidden_before[lo];
+}
+
+//Fold region starting on line, its end line in *end_line. Needs a current
+//index.
+bool fold_region_at_line(ChunkIndex* ci, size_t line, size_t* end_line){
+  TextLocation at;
+  if(!chunk_index_line_start(ci, line, &at))
+    return false;
+  //Openers not yet closed on the line, one stack per kind holding indices
+  //into opens
+  TextLocation* opens = nullptr;
+  size_t open_count = 0;
+  size_t* stacks[BRACKET_KINDS] = {0};
+  size_t depth[BRACKET_KINDS] = {0};
+  bool line_end = false;
+  bool ok = true;
+  LinkedNativeString* node = at.node;
+  size_t from = at.offset;
+  for(; node && !line_end && ok; node = node->next, from = 0){
+    size_t inx = chunk_index_leaf_of(ci, node);
+    if(inx == ci->count){
+      ok = false;
+      break;
+    }
+    const char* nl = memchr(node->str.base + from, '\n', node->str.len - from);
+    size_t until = nl ? (size_t)(nl - node->str.base) : node->str.len;
+    line_end = (nullptr != nl);
+    size_t event_count;
+    BracketEvent* events = chunk_brackets(ci, inx, &event_count);
+    for(size_t e = 0; (e < event_count) && ok; ++e){
+      BracketEvent ev = events[e];
+      if((ev.offset < from) || (ev.offset >= until))
+	continue;
+      if(ev.dir > 0){
+	TextLocation loc = {.node = node, .offset = ev.offset};
+	ok = push_obj(&opens, &open_count, &loc) &&
+	  push_obj(&stacks[ev.kind], &depth[ev.kind], &(size_t){open_count - 1});
+      }
+      else if(depth[ev.kind] > 0)
+	depth[ev.kind]--;
+    }
+    free(events);
+  }
+  size_t first = open_count;
+  for(int k = 0; k < BRACKET_KINDS; ++k)
+    if(depth[k] && (stacks[k][0] < first))
+      first = stacks[k][0];
+  bool found = false;
+  TextLocation close;
+  if(ok && (first < open_count) && bracket_match(ci, opens[first], &close)){
+    *end_line = chunk_index_line_of(ci, close);
+    found = (*end_line >= line + 2);
+  }
+  free(opens);
+  for(int k = 0; k < BRACKET_KINDS; ++k)
+    free(stacks[k]);
+  return found;
+}
+
+bool fold_set_add(FoldSet* fs, FoldRegion fold){
+  size_t at = 0;
+  while((at < fs->count) && (fs->folds[at].start_line < fold.start_line))
+    at++;
+  if((at < fs->count) && (fs->folds[at].start_line == fold.start_line))
+    fs->folds[at] = fold;
+  else{
+    if(!push_obj(&fs->folds, &fs->count, &fold))
+      return false;
+    memmove(fs->folds + at + 1, fs->folds + at,
+	    (fs->count - 1 - at) * sizeof(fs->folds[0]));
+    fs->folds[at] = fold;
+  }
+  return fold_set_flatten(fs);
+}
+
+//Unfolds everything from the start line to the end line of which line is
+//part of
+void fold_set_open(FoldSet* fs, size_t line){
+  size_t kept = 0;
+  for(size_t i = 0; i < fs->count; ++i){
+    FoldRegion f = fs->folds[i];
+    if((line < f.start_line) || (line > f.end_line))
+      fs->folds[kept++] = f;
+  }
+  fs->count = kept;
+  fold_set_flatten(fs);
+}
+
+//Folds the region starting on line, else the innermost curly block around
+//loc
+bool fold_at(FoldSet* fs, ChunkIndex* ci, TextLocation loc){
+  size_t line = chunk_index_line_of(ci, loc);
+  size_t end_line;
+  if(!fold_region_at_line(ci, line, &end_line)){
+    TextLocation open;
+    if(!bracket_enclosing(ci, loc, BRACKET_CURLY, &open))
+      return false;
+    line = chunk_index_line_of(ci, open);
+    if(!fold_region_at_line(ci, line, &end_line))
+      return false;
+  }
+  return fold_set_add(fs, (FoldRegion){.start_line = line, .end_line = end_line});
+}
+
+//Keeps folds on their text after an edit around line pivot that changed the
+//line count by delta: later folds move along, then every fold's region is
+//looked up again and the ones that no longer hold are dropped
+void fold_set_update(FoldSet* fs, ChunkIndex* ci, size_t pivot, long delta){
+  size_t kept = 0;
+  for(size_t i = 0; i < fs->count; ++i){
+    FoldRegion f = fs->folds[i];
+    if(f.start_line > pivot){
+      if((delta < 0) && (f.start_line <= pivot + (size_t)(-delta)))
+	continue;
+      f.start_line += delta;
+    }
+    if(!fold_region_at_line(ci, f.start_line, &f.end_line))
+      continue;
+    if(kept && (fs->folds[kept - 1].start_line >= f.start_line))
+      continue;
+    fs->folds[kept++] = f;
+  }
+  fs->count = kept;
+  fold_set_flatten(fs);
+  fs->version = text_version;
+}
+
+//Moves loc off hidden lines, forward to the line a fold ends on or back to
+//the end of the line it starts on
+void fold_skip(const FoldSet* fs, const ChunkIndex* ci, TextLocation* loc,
+	       bool forward){
+  if((0 == fs->outer_count) || (ci->version != text_version))
+    return;
+  size_t hiding = fold_set_hiding(fs, chunk_index_line_of(ci, *loc));
+  if(hiding == fs->outer_count)
+    return;
+  FoldRegion f = fs->outer[hiding];
+  if(forward)
+    chunk_index_line_start(ci, f.end_line, loc);
+  else if(chunk_index_line_start(ci, f.start_line + 1, loc))
+    move_cursor_left(loc);
+}
+
+//Soft wrap
+//Where each line wraps at the current width and font size, kept as the
+//offsets into the line its second, third... rows start at. A line is laid
+//out when first asked for and again only once an edit touches it, a resize
+//or a zoom drops everything. Chunks edited since carry a newer stamp, lines
+//before the first of them keep their layout and lines after the last keep
+//theirs under new numbers. A
+//Fenwick tree over the rows of shown lines gives the rows above a line, and
+//the line holding a row, by binary search. Lines not laid out yet count as
+//one row until wrap_layout_step gets to them.
+typedef struct LineLayout LineLayout;
+struct LineLayout {
+  //0 until laid out
+  uint32_t rows;
+  //Folded away, counts for no rows
+  bool hidden;
+  //Length it was laid out at, newline included
+  size_t bytes;
+  //Line relative offsets rows after the first start at, rows - 1 of them
+  uint32_t* breaks;
+};
+
+typedef struct WrapLayout WrapLayout;
+struct WrapLayout {
+  int x0;
+  int width;
+  int fontsize;
+  //Atlas it was measured with, sizes differ a little between atlases
+  size_t font_serial;
+  LineLayout* lines;
+  size_t count;
+  //Rows of shown lines, 1 based, count + 1 long
+  size_t* tree;
+  //Lines with rows still 0
+  size_t unknown;
+  //Where wrap_layout_step carries on
+  size_t step_line;
+  //text_version and fold changes it was brought up to
+  size_t version;
+  size_t fold_changes;
+};
+
+void wrap_layout_free(WrapLayout* wl){
+  for(size_t i = 0; i < wl->count; ++i)
+    free(wl->lines[i].breaks);
+  free(wl->lines);
+  free(wl->tree);
+  *wl = (WrapLayout){0};
+}
+
+size_t line_layout_value(const LineLayout* ll){
+  if(ll->hidden)
+    return 0;
+  return ll->rows ? ll->rows : 1;
+}
+
+void wrap_layout_add(WrapLayout* wl, size_t line, long delta){
+  for(size_t i = line + 1; i <= wl->count; i += i & (0 - i))
+    wl->tree[i] += delta;
+}
+
+//Rows of every shown line before line
+size_t wrap_layout_rows_before(const WrapLayout* wl, size_t line){
+  size_t sum = 0;
+  for(size_t i = line; i > 0; i -= i & (0 - i))
+    sum += wl->tree[i];
+  return sum;
+}
+
+//Shown line holding row, the last one when row is past the end
+size_t wrap_layout_line_at(const WrapLayout* wl, size_t row){
+  size_t total = wrap_layout_rows_before(wl, wl->count);
+  if(row >= total)
+    row = total ? (total - 1) : 0;
+  size_t step = 1;
+  while(2 * step <= wl->count)
+    step *= 2;
+  size_t pos = 0;
+  for(; step; step /= 2){
+    if((pos + step <= wl->count) && (wl->tree[pos + step] <= row)){
+      pos += step;
+      row -= wl->tree[pos];
+    }
+  }
+  return (pos < wl->count) ? pos : (wl->count - 1);
+}
+
+bool wrap_layout_rebuild(WrapLayout* wl, const FoldSet* fs){
+  free(wl->tree);
+  wl->tree = calloc(wl->count + 1, sizeof(wl->tree[0]));
+  if(nullptr == wl->tree)
+    return false;
+  for(size_t i = 0; i < wl->count; ++i)
+    wl->lines[i].hidden = false;
+  for(size_t f = 0; f < fs->outer_count; ++f)
+    for(size_t i = fs->outer[f].start_line + 1;
+	(i < fs->outer[f].end_line) && (i < wl->count); ++i)
+      wl->lines[i].hidden = true;
+  for(size_t i = 1; i <= wl->count; ++i){
+    wl->tree[i] += line_layout_value(wl->lines + i - 1);
+    size_t up = i + (i & (0 - i));
+    if(up <= wl->count)
+      wl->tree[up] += wl->tree[i];
+  }
+  wl->fold_changes = fs->changes;
+  return true;
+}
+
+//Drops the layout of lines [from, to)
+void wrap_layout_forget(WrapLayout* wl, size_t from, size_t to){
+  for(size_t i = from; i < to; ++i){
+    free(wl->lines[i].breaks);
+    wl->unknown += (0 != wl->lines[i].rows);
+    wl->lines[i] = (LineLayout){0};
+  }
+}
+
+//Brings the layout up to the text, the folds and the window. Needs a current
+//index. False when out of memory, the layout is then empty.
+bool wrap_layout_sync(WrapLayout* wl, const ChunkIndex* ci, const FoldSet* fs,
+		      int x0, int width, int fontsize){
+  if(0 == ci->count){
+    wrap_layout_free(wl);
+    return false;
+  }
+  size_t lines = chunk_index_line_count(ci);
+  bool fresh = !wl->lines || (wl->x0 != x0) || (wl->width != width) ||
+    (wl->fontsize != fontsize) || (wl->font_serial != font_serial);
+  //Lines [lo, hi) are new, the ones from hi on were the ones from old_hi on
+  size_t lo = 0;
+  size_t hi = 0;
+  size_t first;
+  size_t last;
+  if(!fresh && (wl->version != text_version)){
+    if(chunk_index_changed_since(ci, wl->version, &first, &last)){
+      lo = chunk_index_prefix(ci, first).newlines;
+      hi = chunk_index_prefix(ci, last).newlines +
+	ci->tree[ci->tree_size + last].newlines + 1;
+    }
+    //A chunk emptied and dropped leaves no stamp behind, only the count
+    //shows it
+    else if(lines != wl->count)
+      fresh = true;
+  }
+  if(hi > lines)
+    hi = lines;
+  size_t old_hi = hi + wl->count - lines;
+  if(!fresh && ((old_hi < lo) || (old_hi > wl->count)))
+    fresh = true;
+  if(fresh){
+    wrap_layout_free(wl);
+    wl->lines = calloc(lines, sizeof(wl->lines[0]));
+    if(nullptr == wl->lines)
+      return false;
+    wl->count = lines;
+    wl->unknown = lines;
+    wl->x0 = x0;
+    wl->width = width;
+    wl->fontsize = fontsize;
+    wl->font_serial = font_serial;
+  }
+  else if((wl->version != text_version) && (lines == wl->count) && wl->tree){
+    //Same lines under the same numbers, the row counts move in place
+    for(size_t i = lo; i < hi; ++i){
+      long before = line_layout_value(wl->lines + i);
+      bool hidden = wl->lines[i].hidden;
+      wrap_layout_forget(wl, i, i + 1);
+      wl->lines[i].hidden = hidden;
+      wrap_layout_add(wl, i, (long)line_layout_value(wl->lines + i) - before);
+    }
+    wl->version = text_version;
+  }
+  else if(wl->version != text_version){
+    wrap_layout_forget(wl, lo, old_hi);
+    size_t tail = wl->count - old_hi;
+    if(lines > wl->count){
+      LineLayout* grown = realloc(wl->lines, lines * sizeof(grown[0]));
+      if(nullptr == grown){
+	wrap_layout_free(wl);
+	return false;
+      }
+      wl->lines = grown;
+    }
+    memmove(wl->lines + hi, wl->lines + old_hi, tail * sizeof(wl->lines[0]));
+    for(size_t i = lo; i < hi; ++i)
+      wl->lines[i] = (LineLayout){0};
+    wl->unknown -= old_hi - lo;
+    wl->unknown += hi - lo;
+    wl->count = lines;
+  }
+  bool moved = fresh || (wl->version != text_version);
+  wl->version = text_version;
+  if((moved || (wl->fold_changes != fs->changes) || (nullptr == wl->tree)) &&
+     !wrap_layout_rebuild(wl, fs)){
+    wrap_layout_free(wl);
+    return false;
+  }
+  return true;
+}
+
+//Lays out line unless it already is at its current length. False when out
+//of memory.
+bool wrap_layout_line(WrapLayout* wl, const ChunkIndex* ci, size_t line){
+  TextLocation at;
+  if((line >= wl->count) || !chunk_index_line_start(ci, line, &at))
+    return false;
+  size_t start = chunk_index_offset_of(ci, at);
+  size_t end = ci->tree[1].bytes;
+  TextLocation next;
+  if(chunk_index_line_start(ci, line + 1, &next))
+    end = chunk_index_offset_of(ci, next);
+  LineLayout* ll = wl->lines + line;
+  if(ll->rows && (ll->bytes == end - start))
+    return true;
+  uint32_t* breaks = nullptr;
+  size_t break_count = 0;
+  int cx = wl->x0;
+  //Bytes that fit on a row in a monospace font, m of them fit while
+  //10 + m * cell < width
+  int cell = mono_cell(wl->fontsize);
+  long per_row = cell ? (wl->width - 11) / cell : 0;
+  size_t len = end - start - (line + 1 < wl->count);
+  //A byte is a column only in ASCII
+  if((per_row > 0) && ascii_run(at, len)){
+    //Bytes on the row so far
+    size_t col = 0;
+    for(size_t i = 0; i < len;){
+      snap_cursor_right(&at);
+      const char* base = at.node->str.base + at.offset;
+      size_t run = at.node->str.len - at.offset;
+      if(run > len - i)
+	run = len - i;
+      const char* cr = memchr(base, '\r', run);
+      size_t plain = cr ? (size_t)(cr - base) : run;
+      //The byte that finds the row full starts the next, then every per_row
+      size_t first = per_row - col;
+      size_t k = first;
+      for(; k < plain; k += per_row){
+	uint32_t b = i + k;
+	if(!push_obj(&breaks, &break_count, &b)){
+	  free(breaks);
+	  return false;
+	}
+      }
+      col = (first < plain) ? (plain - (k - per_row)) : (col + plain);
+      //A carriage return always starts a row, and takes no room
+      if(cr){
+	uint32_t b = i + plain;
+	if(!push_obj(&breaks, &break_count, &b)){
+	  free(breaks);
+	  return false;
+	}
+	col = 0;
+	plain++;
+      }
+      i += plain;
+      at.offset += plain;
+    }
+  }
+  else{
+    for(uint32_t i = 0; ; ++i){
+      snap_cursor_right(&at);
+      if((nullptr == at.node->next) && (at.offset >= at.node->str.len))
+	break;
+      char ch = at.node->str.base[at.offset];
+      if('\n' == ch)
+	break;
+      int wid = get_char_width(glyph_at(at), wl->fontsize);
+      if((0 > wid) || ((10 + cx + wid) >= (wl->width + wl->x0))){
+	if(!push_obj(&breaks, &break_count, &i)){
+	  free(breaks);
+	  return false;
+	}
+	cx = wl->x0;
+      }
+      if(0 < wid)
+	cx += wid;
+      move_cursor_right(&at);
+    }
+  }
+  long before = line_layout_value(ll);
+  wl->unknown -= (0 == ll->rows);
+  free(ll->breaks);
+  ll->breaks = breaks;
+  ll->rows = break_count + 1;
+  ll->bytes = end - start;
+  wrap_layout_add(wl, line, (long)line_layout_value(ll) - before);
+  return true;
+}
+
+//Layout of line, nullptr when it could not be made
+const LineLayout* wrap_layout_at(WrapLayout* wl, const ChunkIndex* ci, size_t line){
+  return wrap_layout_line(wl, ci, line) ? (wl->lines + line) : nullptr;
+}
+
+//Lays out a few lines not yet laid out each frame, so the row counts become
+//exact without one long stall after opening a file or zooming
+void wrap_layout_step(WrapLayout* wl, const ChunkIndex* ci, size_t budget){
+  for(size_t n = 0; wl->unknown && (n < budget); ++n){
+    if(wl->step_line >= wl->count)
+      wl->step_line = 0;
+    if((0 == wl->lines[wl->step_line].rows) &&
+       !wrap_layout_line(wl, ci, wl->step_line))
+      return;
+    wl->step_line++;
+  }
+}
+
+//Viewport
+//What is on screen is kept as the line drawn first and where its top is,
+//so the renderer seeks straight to that line through the chunk index and
+//stops at the bottom of the window. Scrolling moves the top, then the view
+//finds the row now at the top edge through the wrap layout's row counts and
+//settles on the line holding it.
+typedef struct Viewport Viewport;
+struct Viewport {
+  //Document line drawn first, never a hidden one
+  size_t line;
+  //Where its first row is drawn
+  int y;
+};
+
+enum {
+  CURSOR_WIDTH = 3
+};
+
+int wrap_layout_height(WrapLayout* wl, const ChunkIndex* ci, size_t line){
+  const LineLayout* ll = wrap_layout_at(wl, ci, line);
+  return (10 + wl->fontsize) * (ll ? (int)ll->rows : 1);
+}
+
+//Moves view->line to the line crossing the top of the window. Needs a
+//layout in sync with the text.
+void viewport_settle(Viewport* view, WrapLayout* wl, const ChunkIndex* ci,
+		     const FoldSet* fs){
+  if(0 == wl->count)
+    return;
+  int row = 10 + wl->fontsize;
+  if(view->line >= wl->count)
+    view->line = wl->count - 1;
+  size_t hiding = fold_set_hiding(fs, view->line);
+  if(hiding < fs->outer_count)
+    view->line = fs->outer[hiding].start_line;
+  //Far from the top edge, to the row there by the row counts
+  if((view->y > 0) ||
+     (view->y + wrap_layout_height(wl, ci, view->line) <= 0)){
+    long top = (long)wrap_layout_rows_before(wl, view->line) * row - view->y;
+    if(top < 0){
+      view->line = 0;
+      view->y = -top;
+    }
+    else{
+      view->line = wrap_layout_line_at(wl, top / row);
+      view->y = (long)wrap_layout_rows_before(wl, view->line) * row - top;
+    }
+  }
+  //Lines counted as one row before being laid out may have put it a little
+  //off, step the rest of the way
+  while(view->y > 0){
+    size_t visible = fold_visible_line(fs, view->line);
+    if(0 == visible)
+      break;
+    view->line = fold_document_line(fs, visible - 1);
+    view->y -= wrap_layout_height(wl, ci, view->line);
+  }
+  while(true){
+    int bottom = view->y + wrap_layout_height(wl, ci, view->line);
+    size_t next = fold_document_line(fs, fold_visible_line(fs, view->line) + 1);
+    if((bottom > 0) || (next >= wl->count))
+      break;
+    view->line = next;
+    view->y = bottom;
+  }
+}
+
+//Location drawn nearest x, y, for mouse clicks. Needs a layout in sync with
+//the text.
+bool viewport_hit(const Viewport* view, WrapLayout* wl, const ChunkIndex* ci,
+		  const FoldSet* fs, int x, int y, TextLocation* out){
+  if(0 == wl->count)
+    return false;
+  size_t line = view->line;
+  int top = view->y;
+  while(y >= top + wrap_layout_height(wl, ci, line)){
+    size_t next = fold_document_line(fs, fold_visible_line(fs, line) + 1);
+    if(next >= wl->count)
+      break;
+    top += wrap_layout_height(wl, ci, line);
+    line = next;
+  }
+  const LineLayout* ll = wrap_layout_at(wl, ci, line);
+  TextLocation at;
+  if((nullptr == ll) || !chunk_index_line_start(ci, line, &at))
+    return false;
+  size_t start = chunk_index_offset_of(ci, at);
+  size_t row = (y < top) ? 0 : (size_t)(y - top) / (10 + wl->fontsize);
+  if(row >= ll->rows)
+    row = ll->rows - 1;
+  size_t from = row ? ll->breaks[row - 1] : 0;
+  size_t to = (row + 1 < ll->rows) ? ll->breaks[row] :
+    (ll->bytes - (line + 1 < wl->count));
+  size_t col = 0;
+  int cell = mono_cell(wl->fontsize);
+  if(cell && chunk_index_location_at(ci, start + from, &at) &&
+     !ascii_run(at, to - from))
+    cell = 0;
+  if(cell){
+    //A carriage return can only start a row, and takes no room
+    if((from < to) && chunk_index_location_at(ci, start + from, &at)){
+      snap_cursor_right(&at);
+      from += ('\r' == at.node->str.base[at.offset]);
+    }
+    if(x > wl->x0)
+      col = (x - wl->x0 + cell / 2) / cell;
+    if(col > to - from)
+      col = to - from;
+  }
+  else if(chunk_index_location_at(ci, start + from, &at)){
+    int cx = wl->x0;
+    for(; from + col < to; ++col){
+      snap_cursor_right(&at);
+      int wid = get_char_width(glyph_at(at), wl->fontsize);
+      if(0 < wid){
+	if(x < cx + wid / 2)
+	  break;
+	cx += wid;
+      }
+      move_cursor_right(&at);
+    }
+  }
+  return chunk_index_location_at(ci, start + from + col, out);
+}
+
+//Work stealing pool
+//The calling thread joins in as worker 0. Each worker owns a range of task
+//indices packed into one 64 bit word, low half the next task and high half
+//the end. Owners take from the bottom, a worker that runs dry steals the
+//upper half of another's range, both sides go through a compare exchange.
+typedef void (*pool_task_fn)(void* ctx, size_t task);
+
+typedef struct ThreadPool ThreadPool;
+
+typedef struct PoolWorker PoolWorker;
+struct PoolWorker {
+  ThreadPool* pool;
+  size_t inx;
+  HANDLE thread;
+  HANDLE wake;
+};
+
+struct ThreadPool {
+  PoolWorker* workers;
+  size_t worker_count;
+  volatile LONG64* ranges;
+  pool_task_fn fn;
+  void* ctx;
+  volatile LONG active;
+  volatile LONG quit;
+  HANDLE done;
+};
+
+//Shared by everything that splits work across cores, nullptr runs serially
+ThreadPool* worker_pool = nullptr;
+
+LONG64 pool_range(size_t lo, size_t hi){
+  return (LONG64)(((unsigned long long)hi << 32) | (unsigned long long)lo);
+}
+
+bool pool_take(ThreadPool* pool, size_t me, size_t* task){
+  volatile LONG64* own = pool->ranges + me;
+  while(true){
+    LONG64 r = *own;
+    size_t lo = (unsigned long long)r & 0xffffffffull;
+    size_t hi = (unsigned long long)r >> 32;
+    if(lo >= hi)
+      break;
+    if(InterlockedCompareExchange64(own, pool_range(lo + 1, hi), r) == r){
+      *task = lo;
+      return true;
+    }
+  }
+  for(size_t k = 1; k < pool->worker_count; ++k){
+    volatile LONG64* victim = pool->ranges + (me + k) % pool->worker_count;
+    while(true){
+      LONG64 r = *victim;
+      size_t lo = (unsigned long long)r & 0xffffffffull;
+      size_t hi = (unsigned long long)r >> 32;
+      if(lo >= hi)
+	break;
+      size_t mid = lo + (hi - lo) / 2;
+      if(InterlockedCompareExchange64(victim, pool_range(lo, mid), r) == r){
+	//Nobody touches an empty range, so the loot can just be stored
+	InterlockedExchange64(own, pool_range(mid + 1, hi));
+	*task = mid;
+	return true;
+      }
+    }
+  }
+  return false;
+}
+
+void pool_work(ThreadPool* pool, size_t me){
+  size_t task;
+  while(pool_take(pool, me, &task))
+    pool->fn(pool->ctx, task);
+  if(0 == InterlockedDecrement(&pool->active))
+    SetEvent(pool->done);
+}
+
+DWORD WINAPI pool_worker_main(LPVOID param){
+  PoolWorker* worker = param;
+  while(true){
+    WaitForSingleObject(worker->wake, INFINITE);
+    if(worker->pool->quit)
+      break;
+    pool_work(worker->pool, worker->inx);
+  }
+  return 0;
+}
+
+void pool_stop(ThreadPool* pool){
+  if(nullptr == pool)
+    return;
+  InterlockedExchange(&pool->quit, 1);
+  for(size_t i = 1; i < pool->worker_count; ++i){
+    if(nullptr == pool->workers[i].thread)
+      continue;
+    SetEvent(pool->workers[i].wake);
+    WaitForSingleObject(pool->workers[i].thread, INFINITE);
+    CloseHandle(pool->workers[i].thread);
+  }
+  for(size_t i = 1; i < pool->worker_count; ++i)
+    if(pool->workers[i].wake)
+      CloseHandle(pool->workers[i].wake);
+  if(pool->done)
+    CloseHandle(pool->done);
+  free((void*)pool->ranges);
+  free(pool->workers);
+  free(pool);
+}
+
+//Zero means one worker per processor
+ThreadPool* pool_start(size_t worker_count){
+  if(0 == worker_count){
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    worker_count = info.dwNumberOfProcessors;
+  }
+  if(worker_count < 1)
+    worker_count = 1;
+  ThreadPool* pool = calloc(1, sizeof(*pool));
+  if(nullptr == pool)
+    return nullptr;
+  pool->worker_count = worker_count;
+  pool->workers = calloc(worker_count, sizeof(pool->workers[0]));
+  pool->ranges = calloc(worker_count, sizeof(pool->ranges[0]));
+  pool->done = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+  if(!pool->workers || !pool->ranges || !pool->done){
+    pool_stop(pool);
+    return nullptr;
+  }
+  for(size_t i = 1; i < worker_count; ++i){
+    PoolWorker* worker = pool->workers + i;
+    worker->pool = pool;
+    worker->inx = i;
+    worker->wake = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if(worker->wake)
+      worker->thread = CreateThread(nullptr, 0, pool_worker_main, worker,
+				    0, nullptr);
+    if(nullptr == worker->thread){
+      //Run with however many came up
+      if(worker->wake)
+	CloseHandle(worker->wake);
+      worker->wake = nullptr;
+      pool->worker_count = i;
+      break;
+    }
+  }
+  return pool;
+}
+
+//Runs fn for every task in [0, task_count) and returns once all are done
+void pool_run(ThreadPool* pool, size_t task_count, pool_task_fn fn, void* ctx){
+  if((nullptr == pool) || (pool->worker_count < 2) || (task_count < 2) ||
+     (task_count > 0xffffffffull)){
+    for(size_t i = 0; i < task_count; ++i)
+      fn(ctx, i);
+    return;
+  }
+  size_t n = pool->worker_count;
+  pool->fn = fn;
+  pool->ctx = ctx;
+  for(size_t i = 0; i < n; ++i)
+    pool->ranges[i] = pool_range(task_count * i / n, task_count * (i + 1) / n);
+  InterlockedExchange(&pool->active, (LONG)n);
+  for(size_t i = 1; i < n; ++i)
+    SetEvent(pool->workers[i].wake);
+  pool_work(pool, 0);
+  WaitForSingleObject(pool->done, INFINITE);
+}
+
+//Parallel find all
+//Chunks are grouped into tasks of about search_task_bytes. A task owns the
+//matches that start inside its chunks, the ones running into the next task
+//are confirmed by reading past its end, so nothing is found twice or lost.
+size_t search_task_bytes = 1 << 20;
+
+typedef struct SearchTask SearchTask;
+struct SearchTask {
+  size_t first_node;
+  size_t end_node;
+  size_t* starts;
+  size_t count;
+  size_t capacity;
+  size_t total;
+  bool overflow;
+};
+
+typedef struct ParallelSearch ParallelSearch;
+struct ParallelSearch {
+  LinkedNativeString** nodes;
+  size_t* node_offsets;
+  SearchTask* tasks;
+  StringView needle;
+  size_t limit;
+  volatile LONG64 stored;
+};
+
+void parallel_search_task(void* ctx, size_t inx){
+  ParallelSearch* search = ctx;
+  SearchTask* task = search->tasks + inx;
+  for(size_t i = task->first_node; i < task->end_node; ++i){
+    LinkedNativeString* node = search->nodes[i];
+    size_t from = 0;
+    while(from < node->str.len){
+      from = find_in_chunk(node, from, node->str.len, search->needle);
+      if(from == node->str.len)
+	break;
+      task->total++;
+      if(!task->overflow &&
+	 (InterlockedIncrement64(&search->stored) > (LONG64)search->limit))
+	task->overflow = true;
+      if(!task->overflow){
+	if(task->count == task->capacity){
+	  size_t new_cap = task->capacity ? 2 * task->capacity : 64;
+	  size_t* grown = realloc(task->starts, new_cap * sizeof(size_t));
+	  if(nullptr == grown)
+	    task->overflow = true;
+	  else{
+	    task->starts = grown;
+	    task->capacity = new_cap;
+	  }
+	}
+	if(!task->overflow)
+	  task->starts[task->count++] = search->node_offsets[i] + from;
+      }
+      from++;
+    }
+  }
+}
+
+//Every (overlapping) match start in document order, at most limit of them
+//are stored. Returns false if some did not fit, total still counts them all.
+bool find_all(LinkedNativeString* head, StringView needle, size_t limit,
+	      size_t** out, size_t* out_count, size_t* total){
+  *out = nullptr;
+  *out_count = 0;
+  *total = 0;
+  if(0 == needle.len)
+    return true;
+  if(nullptr == pair_scan)
+    pair_scan = pick_pair_scan();
+  trigram_prepare(needle);
+
+  ParallelSearch search = {.needle = needle, .limit = limit};
+  size_t node_count = 0;
+  for(LinkedNativeString* node = head; node; node = node->next)
+    node_count++;
+  search.nodes = malloc(node_count * sizeof(search.nodes[0]));
+  search.node_offsets = malloc(node_count * sizeof(search.node_offsets[0]));
+  //Worst case a task per node
+  search.tasks = calloc(node_count, sizeof(search.tasks[0]));
+  if(!search.nodes || !search.node_offsets || !search.tasks){
+    free(search.nodes);
+    free(search.node_offsets);
+    free(search.tasks);
+    return false;
+  }
+
+  size_t task_count = 0;
+  size_t offset = 0;
+  size_t task_bytes = 0;
+  size_t i = 0;
+  for(LinkedNativeString* node = head; node; node = node->next, ++i){
+    search.nodes[i] = node;
+    search.node_offsets[i] = offset;
+    offset += node->str.len;
+    if(0 == task_bytes)
+      search.tasks[task_count++].first_node = i;
+    task_bytes += node->str.len;
+    search.tasks[task_count - 1].end_node = i + 1;
+    if(task_bytes >= search_task_bytes)
+      task_bytes = 0;
+  }
+
+  pool_run(worker_pool, task_count, parallel_search_task, &search);
+
+  bool complete = true;
+  for(size_t t = 0; t < task_count; ++t){
+    *total += search.tasks[t].total;
+    if(search.tasks[t].overflow)
+      complete = false;
+  }
+  if(complete && (*total > 0)){
+    *out = malloc(*total * sizeof(size_t));
+    if(nullptr == *out)
+      complete = false;
+  }
+  for(size_t t = 0; t < task_count; ++t){
+    if(complete && search.tasks[t].count){
+      memcpy(*out + *out_count, search.tasks[t].starts,
+	     search.tasks[t].count * sizeof(size_t));
+      *out_count += search.tasks[t].count;
+    }
+    free(search.tasks[t].starts);
+  }
+  free(search.nodes);
+  free(search.node_offsets);
+  free(search.tasks);
+  return complete;
+}
+
+//Trigram index upkeep
+//Once a frame the walk picks up to trigram_slice_bytes of new or edited
+//chunks, the pool gathers their distinct trigrams and the lists are
+//appended on this thread, so searches never see them half updated.
+size_t trigram_slice_bytes = 256 << 10;
+size_t trigram_walk_nodes = 1 << 16;
+
+typedef struct TrigramChunkJob TrigramChunkJob;
+struct TrigramChunkJob {
+  LinkedNativeString* node;
+  uint32_t* keys;
+  size_t key_count;
+};
+
+void trigram_collect_task(void* ctx, size_t inx){
+  TrigramChunkJob* job = (TrigramChunkJob*)ctx + inx;
+  const char* base = job->node->str.base;
+  size_t len = job->node->str.len;
+  job->keys = nullptr;
+  job->key_count = 0;
+  if(len < 3)
+    return;
+  size_t set_size = 64;
+  while(set_size < 2 * len)
+    set_size *= 2;
+  size_t mask = set_size - 1;
+  //Open addressed set of trigram + 1, compacted into the result after
+  uint32_t* set = calloc(set_size, sizeof(uint32_t));
+  if(nullptr == set)
+    return;
+  for(size_t i = 0; i + 3 <= len; ++i){
+    uint32_t key = trigram_at(base + i) + 1;
+    size_t h = trigram_hash(key) & mask;
+    while(set[h] && (set[h] != key))
+      h = (h + 1) & mask;
+    set[h] = key;
+  }
+  for(size_t i = 0; i < set_size; ++i)
+    if(set[i])
+      set[job->key_count++] = set[i] - 1;
+  job->keys = set;
+}
+
+bool trigram_grow_table(TrigramIndex* index){
+  size_t new_size = index->table_size ? 2 * index->table_size : 4096;
+  TrigramPostings* table = calloc(new_size, sizeof(table[0]));
+  if(nullptr == table)
+    return false;
+  size_t mask = new_size - 1;
+  for(size_t i = 0; i < index->table_size; ++i){
+    if(0 == index->table[i].key)
+      continue;
+    size_t h = trigram_hash(index->table[i].key) & mask;
+    while(table[h].key)
+      h = (h + 1) & mask;
+    table[h] = index->table[i];
+  }
+  free(index->table);
+  index->table = table;
+  index->table_size = new_size;
+  return true;
+}
+
+TrigramPostings* trigram_insert(TrigramIndex* index, uint32_t trigram){
+  TrigramPostings* found = trigram_lookup(index, trigram);
+  if(found)
+    return found;
+  if((2 * (index->table_used + 1) > index->table_size) &&
+     !trigram_grow_table(index))
+    return nullptr;
+  uint32_t key = trigram + 1;
+  size_t mask = index->table_size - 1;
+  size_t h = trigram_hash(key) & mask;
+  while(index->table[h].key)
+    h = (h + 1) & mask;
+  index->table[h].key = key;
+  index->table_used++;
+  return index->table + h;
+}
+
+bool trigram_append(TrigramPostings* list, uint32_t slot){
+  if(list->len + 5 > list->capacity){
+    size_t new_cap = list->capacity ? 2 * list->capacity : 16;
+    unsigned char* grown = realloc(list->deltas, new_cap);
+    if(nullptr == grown)
+      return false;
+    list->deltas = grown;
+    list->capacity = new_cap;
+  }
+  uint32_t delta = slot - list->last;
+  while(delta >= 0x80){
+    list->deltas[list->len++] = (unsigned char)(delta | 0x80);
+    delta >>= 7;
+  }
+  list->deltas[list->len++] = (unsigned char)delta;
+  list->last = slot;
+  list->count++;
+  return true;
+}
+
+bool trigram_is_current(const TrigramIndex* index,
+			const LinkedNativeString* node){
+  uint32_t slot = node->index_slot;
+  return (0 != slot) && (slot < index->chunk_count) &&
+    (index->chunks[slot].node == node) &&
+    (index->chunks[slot].stamp == node->stamp);
+}
+
+//False leaves the chunk unindexed, it is scanned like any other then
+bool trigram_add_chunk(TrigramIndex* index, const TrigramChunkJob* job){
+  LinkedNativeString* node = job->node;
+  if((nullptr == job->keys) && (node->str.len >= 3))
+    return false;
+  if(index->chunk_count + 1 > index->chunk_cap){
+    size_t new_cap = index->chunk_cap ? 2 * index->chunk_cap : 1024;
+    IndexedChunk* grown = realloc(index->chunks, new_cap * sizeof(grown[0]));
+    if(nullptr == grown)
+      return false;
+    index->chunks = grown;
+    index->chunk_cap = new_cap;
+  }
+  if(0 == index->chunk_count)
+    index->chunks[index->chunk_count++] = (IndexedChunk){0};
+  if((uint32_t)index->chunk_count != index->chunk_count)
+    return false;
+
+  uint32_t old = node->index_slot;
+  if((0 != old) && (old < index->chunk_count) &&
+     (index->chunks[old].node == node)){
+    index->chunks[old].node = nullptr;
+    index->live--;
+  }
+  node->index_slot = 0;
+
+  uint32_t slot = (uint32_t)index->chunk_count++;
+  index->chunks[slot] = (IndexedChunk){.node = nullptr, .stamp = node->stamp};
+  for(size_t i = 0; i < job->key_count; ++i){
+    TrigramPostings* list = trigram_insert(index, job->keys[i]);
+    if((nullptr == list) || !trigram_append(list, slot))
+      return false;
+  }
+  index->chunks[slot].node = node;
+  node->index_slot = slot;
+  index->live++;
+  return true;
+}
+
+void trigram_index_clear(TrigramIndex* index){
+  for(size_t i = 0; i < index->table_size; ++i)
+    free(index->table[i].deltas);
+  free(index->table);
+  free(index->chunks);
+  free(index->candidates);
+  free(index->scratch);
+  *index = (TrigramIndex){0};
+}
+
+void trigram_index_free(TrigramIndex* index){
+  if(nullptr == index)
+    return;
+  trigram_index_clear(index);
+  free(index);
+}
+
+//Call once a frame, indexes a slice of whatever changed
+void trigram_index_step(TrigramIndex* index, LinkedNativeString* head){
+  if(nullptr == index)
+    return;
+  if(index->cursor_version != text_version){
+    index->cursor = head;
+    index->cursor_version = text_version;
+    index->complete = false;
+  }
+  if(index->complete)
+    return;
+  //Mostly stale slots by now, cheaper to start over
+  if(index->chunk_count > 2 * index->live + 4096){
+    trigram_index_clear(index);
+    index->cursor = head;
+    index->cursor_version = text_version;
+  }
+
+  TrigramChunkJob jobs[1024];
+  size_t job_count = 0;
+  size_t bytes = 0;
+  size_t visited = 0;
+  LinkedNativeString* node = index->cursor;
+  while(node && (visited < trigram_walk_nodes) &&
+	(bytes < trigram_slice_bytes) && (job_count < _countof(jobs))){
+    if(!trigram_is_current(index, node)){
+      jobs[job_count++] = (TrigramChunkJob){.node = node};
+      bytes += node->str.len;
+    }
+    node = node->next;
+    visited++;
+  }
+  index->cursor = node;
+  index->complete = (nullptr == node);
+
+  pool_run(worker_pool, job_count, trigram_collect_task, jobs);
+  for(size_t i = 0; i < job_count; ++i){
+    trigram_add_chunk(index, jobs + i);
+    free(jobs[i].keys);
+  }
+  if(job_count > 0)
+    index->generation++;
+}
+
+//Document byte offsets, both walk the chain
+size_t location_offset(LinkedNativeString* head, TextLocation loc){
+  size_t offset = 0;
+  for(LinkedNativeString* node = head; node && (node != loc.node);
+      node = node->next)
+    offset += node->str.len;
+  return offset + loc.offset;
+}
+
+TextLocation offset_location(LinkedNativeString* head, size_t offset){
+  return advance_location((TextLocation){.node = head}, offset);
+}
+
+//Incremental search
+//Keeps every (overlapping) match start of the find bar query. When the query
+//grows by one byte the new matches are exactly the old starts followed by
+//that byte, so the set is filtered in one pass instead of rescanning. Edits,
+//backspace or a set that hit search_set_limit fall back to a full scan.
+size_t search_set_limit = 1 << 22;
+
+typedef struct SearchSet SearchSet;
+struct SearchSet {
+  size_t* starts;
+  size_t count;
+  size_t capacity;
+  //Matches counted, also when there were too many to keep
+  size_t total;
+  char query[256];
+  size_t query_len;
+  size_t version;
+  bool valid;
+};
+
+void search_set_rescan(SearchSet* set, LinkedNativeString* head,
+		       StringView needle){
+  set->count = 0;
+  set->total = 0;
+  set->valid = false;
+  if((0 == needle.len) || (needle.len > sizeof(set->query)))
+    return;
+  memcpy(set->query, needle.base, needle.len);
+  set->query_len = needle.len;
+  set->version = text_version;
+
+  size_t* starts;
+  size_t count;
+  set->valid = find_all(head, needle, search_set_limit,
+			&starts, &count, &set->total);
+  free(set->starts);
+  set->starts = starts;
+  set->count = count;
+  set->capacity = count;
+}
+
+//needle has to be the current query plus one byte
+void search_set_extend(SearchSet* set, LinkedNativeString* head,
+		       StringView needle){
+  char added = needle.base[needle.len - 1];
+  size_t old_len = set->query_len;
+  size_t kept = 0;
+  LinkedNativeString* node = head;
+  size_t node_start = 0;
+  for(size_t i = 0; i < set->count; ++i){
+    size_t pos = set->starts[i] + old_len;
+    while(node && (node_start + node->str.len <= pos)){
+      node_start += node->str.len;
+      node = node->next;
+    }
+    if(nullptr == node)
+      break;
+    if(node->str.base[pos - node_start] == added)
+      set->starts[kept++] = set->starts[i];
+  }
+  set->count = kept;
+  set->total = kept;
+  set->query[set->query_len++] = added;
+}
+
+void search_set_update(SearchSet* set, LinkedNativeString* head,
+		       StringView needle){
+  bool current = set->valid && (set->version == text_version);
+  if(current && (needle.len == set->query_len) &&
+     (0 == memcmp(needle.base, set->query, needle.len)))
+    return;
+  if(current && (needle.len == set->query_len + 1) &&
+     (0 == memcmp(needle.base, set->query, set->query_len))){
+    search_set_extend(set, head, needle);
+    return;
+  }
+  search_set_rescan(set, head, needle);
+}
+
+//Index of the first start not before offset
+size_t search_set_lower_bound(const SearchSet* set, size_t offset){
+  size_t lo = 0;
+  size_t hi = set->count;
+  while(lo < hi){
+    size_t mid = lo + (hi - lo) / 2;
+    if(set->starts[mid] < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+bool search_set_usable(const SearchSet* set){
+  return set->valid && (set->version == text_version);
+}
+
+void search_set_free(SearchSet* set){
+  free(set->starts);
+  *set = (SearchSet){0};
+}
+
+//Regular expressions
+//Pattern -> AST -> Thompson NFA, compiled once forward and once reversed.
+//Searching runs lazily built DFAs straight over the chunk chain. An
+//unanchored forward pass finds where the earliest match ends (first), then
+//stops trying new starts and follows the threads in flight until they die,
+//noting the last end any of them reaches (last). The leftmost match ends in
+//[first, last], so a reversed pass from last that tries every end down to
+//first, and only carries on the threads it has after that, finds its start.
+//An anchored forward pass from that start extends it to the longest match.
+//Searching backwards is the same forward pass with new starts tried up to
+//the range end, then the reversed one walking back to the last start with
+//a non empty match. DFA states are made on first use and the whole cache
+//is dropped once it outgrows regex_cache_limit, so memory stays bounded
+//and every pass is linear.
+//Supported: literals . [] [^] * + ? | () ^ $ and \d \w \s \D \W \S \n \t \r
+
+size_t regex_cache_limit = 1 << 21;
+
+enum RegexNodeType {
+  RX_CLASS,
+  RX_CONCAT,
+  RX_ALT,
+  RX_STAR,
+  RX_PLUS,
+  RX_QUEST,
+  RX_BOL,
+  RX_EOL,
+  RX_EMPTY
+};
+
+typedef struct RegexNode RegexNode;
+struct RegexNode {
+  enum RegexNodeType type;
+  int left;
+  int right;
+  unsigned char bits[32];
+};
+
+typedef struct RegexParser RegexParser;
+struct RegexParser {
+  StringView src;
+  size_t pos;
+  RegexNode* nodes;
+  size_t count;
+  bool failed;
+};
+
+void bits_set(unsigned char bits[32], unsigned char c){
+  bits[c >> 3] |= (1 << (c & 7));
+}
+
+bool bits_has(const unsigned char bits[32], unsigned char c){
+  return bits[c >> 3] & (1 << (c & 7));
+}
+
+int rx_node(RegexParser* p, enum RegexNodeType type, int left, int right){
+  RegexNode node = {.type = type, .left = left, .right = right};
+  if(!push_obj(&p->nodes, &p->count, &node)){
+    p->failed = true;
+    return -1;
+  }
+  return (int)p->count - 1;
+}
+
+//Fills bits for \d \w \s and their negations, false for plain escapes
+bool rx_escape_class(char e, unsigned char bits[32]){
+  unsigned char tmp[32] = {0};
+  char lower = e | 0x20;
+  if('d' == lower){
+    for(int c = '0'; c <= '9'; ++c)
+      bits_set(tmp, c);
+  }
+  else if('w' == lower){
+    for(int c = 0; c < 256; ++c)
+      if(((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) ||
+	 ((c >= '0') && (c <= '9')) || (c == '_'))
+	bits_set(tmp, c);
+  }
+  else if('s' == lower){
+    const char* spaces = " \t\n\r\v\f";
+    for(; *spaces; ++spaces)
+      bits_set(tmp, *spaces);
+  }
+  else
+    return false;
+  bool negate = (e != lower);
+  for(int i = 0; i < 32; ++i)
+    bits[i] |= negate ? (unsigned char)~tmp[i] : tmp[i];
+  return true;
+}
+
+char rx_escape_char(char e){
+  if('n' == e)
+    return '\n';
+  if('t' == e)
+    return '\t';
+  if('r' == e)
+    return '\r';
+  return e;
+}
+
+bool rx_at_end(RegexParser* p){
+  return p->pos >= p->src.len;
+}
+
+int rx_parse_alt(RegexParser* p);
+
+int rx_parse_class(RegexParser* p){
+  int inx = rx_node(p, RX_CLASS, -1, -1);
+  if(inx < 0)
+    return -1;
+  unsigned char bits[32] = {0};
+  bool negate = false;
+  if(!rx_at_end(p) && ('^' == p->src.base[p->pos])){
+    negate = true;
+    p->pos++;
+  }
+  bool first = true;
+  while(true){
+    if(rx_at_end(p)){
+      p->failed = true;
+      return -1;
+    }
+    char c = p->src.base[p->pos++];
+    if((']' == c) && !first)
+      break;
+    first = false;
+    if('\\' == c){
+      if(rx_at_end(p)){
+	p->failed = true;
+	return -1;
+      }
+      c = p->src.base[p->pos++];
+      if(rx_escape_class(c, bits))
+	continue;
+      c = rx_escape_char(c);
+    }
+    unsigned char lo = c;
+    unsigned char hi = c;
+    if(((p->pos + 1) < p->src.len) && ('-' == p->src.base[p->pos]) &&
+       (']' != p->src.base[p->pos + 1])){
+      p->pos++;
+      hi = p->src.base[p->pos++];
+      if('\\' == hi){
+	if(rx_at_end(p)){
+	  p->failed = true;
+	  return -1;
+	}
+	hi = rx_escape_char(p->src.base[p->pos++]);
+      }
+      if(hi < lo){
+	p->failed = true;
+	return -1;
+      }
+    }
+    for(int ch = lo; ch <= hi; ++ch)
+      bits_set(bits, ch);
+  }
+  for(int i = 0; i < 32; ++i)
+    p->nodes[inx].bits[i] = negate ? (unsigned char)~bits[i] : bits[i];
+  return inx;
+}
+
+int rx_parse_atom(RegexParser* p){
+  char c = p->src.base[p->pos++];
+  if('(' == c){
+    int inner = rx_parse_alt(p);
+    if(rx_at_end(p) || (')' != p->src.base[p->pos])){
+      p->failed = true;
+      return -1;
+    }
+    p->pos++;
+    return inner;
+  }
+  if('[' == c)
+    return rx_parse_class(p);
+  if('^' == c)
+    return rx_node(p, RX_BOL, -1, -1);
+  if('$' == c)
+    return rx_node(p, RX_EOL, -1, -1);
+  if(('*' == c) || ('+' == c) || ('?' == c) || (')' == c)){
+    p->failed = true;
+    return -1;
+  }
+  int inx = rx_node(p, RX_CLASS, -1, -1);
+  if(inx < 0)
+    return -1;
+  if('.' == c){
+    memset(p->nodes[inx].bits, 0xff, 32);
+    p->nodes[inx].bits['\n' >> 3] &= ~(1 << ('\n' & 7));
+  }
+  else if('\\' == c){
+    if(rx_at_end(p)){
+      p->failed = true;
+      return -1;
+    }
+    c = p->src.base[p->pos++];
+    if(!rx_escape_class(c, p->nodes[inx].bits))
+      bits_set(p->nodes[inx].bits, rx_escape_char(c));
+  }
+  else
+    bits_set(p->nodes[inx].bits, c);
+  return inx;
+}
+
+int rx_parse_repeat(RegexParser* p){
+  int inx = rx_parse_atom(p);
+  while(!p->failed && !rx_at_end(p)){
+    char c = p->src.base[p->pos];
+    enum RegexNodeType type;
+    if('*' == c)
+      type = RX_STAR;
+    else if('+' == c)
+      type = RX_PLUS;
+    else if('?' == c)
+      type = RX_QUEST;
+    else
+      break;
+    p->pos++;
+    inx = rx_node(p, type, inx, -1);
+  }
+  return inx;
+}
+
+int rx_parse_concat(RegexParser* p){
+  int inx = -1;
+  while(!p->failed && !rx_at_end(p) &&
+	('|' != p->src.base[p->pos]) && (')' != p->src.base[p->pos])){
+    int next = rx_parse_repeat(p);
+    inx = (inx < 0) ? next : rx_node(p, RX_CONCAT, inx, next);
+  }
+  if(inx < 0)
+    inx = rx_node(p, RX_EMPTY, -1, -1);
+  return inx;
+}
+
+int rx_parse_alt(RegexParser* p){
+  int inx = rx_parse_concat(p);
+  while(!p->failed && !rx_at_end(p) && ('|' == p->src.base[p->pos])){
+    p->pos++;
+    int other = rx_parse_concat(p);
+    inx = rx_node(p, RX_ALT, inx, other);
+  }
+  return inx;
+}
+
+//Leading bytes every match has to begin with, returns true if the whole
+//node is such a literal so the caller may keep extending
+bool rx_literal_prefix(const RegexNode* nodes, int inx,
+		       char* buf, size_t cap, size_t* len){
+  const RegexNode* node = nodes + inx;
+  if(RX_CONCAT == node->type)
+    return rx_literal_prefix(nodes, node->left, buf, cap, len) &&
+      rx_literal_prefix(nodes, node->right, buf, cap, len);
+  if(RX_CLASS != node->type)
+    return false;
+  int single = -1;
+  for(int c = 0; c < 256; ++c){
+    if(bits_has(node->bits, c)){
+      if(single >= 0)
+	return false;
+      single = c;
+    }
+  }
+  if((single < 0) || (*len >= cap))
+    return false;
+  buf[(*len)++] = (char)single;
+  return true;
+}
+
+enum NfaType {
+  NFA_CLASS,
+  NFA_SPLIT,
+  NFA_BOL,
+  NFA_EOL,
+  NFA_MATCH
+};
+
+typedef struct NfaState NfaState;
+struct NfaState {
+  enum NfaType type;
+  int out;
+  int out1;
+  unsigned char bits[32];
+};
+
+typedef struct Nfa Nfa;
+struct Nfa {
+  NfaState* states;
+  size_t count;
+  int start;
+};
+
+int nfa_state(Nfa* nfa, enum NfaType type, int out, int out1){
+  NfaState st = {.type = type, .out = out, .out1 = out1};
+  if(!push_obj(&nfa->states, &nfa->count, &st))
+    return -1;
+  return (int)nfa->count - 1;
+}
+
+//Builds the fragment for node that continues into next, reversed swaps
+//concatenation order and the line anchors
+int nfa_compile(Nfa* nfa, const RegexNode* nodes, int inx, int next,
+		bool reversed){
+  const RegexNode* node = nodes + inx;
+  int s;
+  int body;
+  switch(node->type){
+  case RX_CLASS:
+    s = nfa_state(nfa, NFA_CLASS, next, -1);
+    if(s >= 0)
+      memcpy(nfa->states[s].bits, node->bits, 32);
+    return s;
+  case RX_CONCAT:
+    if(reversed)
+      return nfa_compile(nfa, nodes, node->right,
+			 nfa_compile(nfa, nodes, node->left, next, reversed),
+			 reversed);
+    return nfa_compile(nfa, nodes, node->left,
+		       nfa_compile(nfa, nodes, node->right, next, reversed),
+		       reversed);
+  case RX_ALT:
+    return nfa_state(nfa, NFA_SPLIT,
+		     nfa_compile(nfa, nodes, node->left, next, reversed),
+		     nfa_compile(nfa, nodes, node->right, next, reversed));
+  case RX_STAR:
+  case RX_PLUS:
+    //Loop state first, the body points back at it. Compiling may move
+    //nfa->states so the result goes through a local.
+    s = nfa_state(nfa, NFA_SPLIT, -1, next);
+    if(s < 0)
+      return -1;
+    body = nfa_compile(nfa, nodes, node->left, s, reversed);
+    nfa->states[s].out = body;
+    return (RX_STAR == node->type) ? s : body;
+  case RX_QUEST:
+    return nfa_state(nfa, NFA_SPLIT,
+		     nfa_compile(nfa, nodes, node->left, next, reversed), next);
+  case RX_BOL:
+    return nfa_state(nfa, reversed ? NFA_EOL : NFA_BOL, next, -1);
+  case RX_EOL:
+    return nfa_state(nfa, reversed ? NFA_BOL : NFA_EOL, next, -1);
+  case RX_EMPTY:
+    return next;
+  }
+  return -1;
+}
+
+typedef struct DfaState DfaState;
+struct DfaState {
+  size_t hash;
+  bool bol;
+  bool match;
+  bool match_eol;
+  int set_count;
+  int* set;
+  //Per byte class, nullptr until computed
+  DfaState* next[];
+};
+
+typedef struct Dfa Dfa;
+struct Dfa {
+  const Nfa* nfa;
+  const unsigned char* byte_class;
+  int class_count;
+  bool anchored;
+  DfaState** states;
+  size_t state_count;
+  int* table;
+  size_t table_size;
+  size_t memory;
+  size_t flushes;
+  DfaState* init[2];
+  int* stack;
+  int* seen;
+  int seen_gen;
+  int* work;
+  int* work2;
+};
+
+typedef struct Regex Regex;
+struct Regex {
+  Nfa forward_nfa;
+  Nfa reverse_nfa;
+  unsigned char byte_class[256];
+  Dfa forward;
+  Dfa anchored;
+  Dfa reverse;
+  Dfa reverse_any;
+  char prefix_buf[64];
+  StringView prefix;
+};
+
+bool dfa_init(Dfa* dfa, const Nfa* nfa, const unsigned char* byte_class,
+	      int class_count, bool anchored){
+  *dfa = (Dfa){
+    .nfa = nfa, .byte_class = byte_class, .class_count = class_count,
+    .anchored = anchored
+  };
+  //Closure pushes at most two successors per state on top of the seeds
+  size_t n = nfa->count;
+  dfa->stack = malloc((3 * n + 2 + n + (n + 1) + n) * sizeof(int));
+  if(nullptr == dfa->stack)
+    return false;
+  dfa->seen = dfa->stack + 3 * n + 2;
+  dfa->work = dfa->seen + n;
+  dfa->work2 = dfa->work + n + 1;
+  memset(dfa->seen, 0, nfa->count * sizeof(int));
+  return true;
+}
+
+void dfa_flush(Dfa* dfa){
+  for(size_t i = 0; i < dfa->state_count; ++i)
+    free(dfa->states[i]);
+  free(dfa->states);
+  free(dfa->table);
+  dfa->states = nullptr;
+  dfa->state_count = 0;
+  dfa->table = nullptr;
+  dfa->table_size = 0;
+  dfa->memory = 0;
+  dfa->init[0] = dfa->init[1] = nullptr;
+  dfa->flushes++;
+}
+
+void dfa_free(Dfa* dfa){
+  dfa_flush(dfa);
+  free(dfa->stack);
+  dfa->stack = nullptr;
+}
+
+int int_cmp(const void* a, const void* b){
+  return *(const int*)a - *(const int*)b;
+}
+
+//Expands set[0, count) in place with everything reachable without
+//consuming a byte. Assertions pass only when bol/eol allow them, EOL ones
+//that do not are kept in the set so a later newline can cross them.
+size_t dfa_closure(Dfa* dfa, int* set, size_t count, bool bol, bool eol){
+  const NfaState* states = dfa->nfa->states;
+  if(++dfa->seen_gen == 0){
+    memset(dfa->seen, 0, dfa->nfa->count * sizeof(int));
+    dfa->seen_gen = 1;
+  }
+  size_t top = 0;
+  for(size_t i = 0; i < count; ++i)
+    dfa->stack[top++] = set[i];
+  size_t out = 0;
+  while(top > 0){
+    int s = dfa->stack[--top];
+    if((s < 0) || (dfa->seen[s] == dfa->seen_gen))
+      continue;
+    dfa->seen[s] = dfa->seen_gen;
+    switch(states[s].type){
+    case NFA_SPLIT:
+      dfa->stack[top++] = states[s].out1;
+      dfa->stack[top++] = states[s].out;
+      break;
+    case NFA_BOL:
+      if(bol)
+	dfa->stack[top++] = states[s].out;
+      break;
+    case NFA_EOL:
+      if(eol)
+	dfa->stack[top++] = states[s].out;
+      else
+	set[out++] = s;
+      break;
+    default:
+      set[out++] = s;
+      break;
+    }
+  }
+  qsort(set, out, sizeof(int), int_cmp);
+  return out;
+}
+
+bool dfa_set_has_match(const Dfa* dfa, const int* set, size_t count){
+  for(size_t i = 0; i < count; ++i)
+    if(NFA_MATCH == dfa->nfa->states[set[i]].type)
+      return true;
+  return false;
+}
+
+size_t dfa_hash(const int* set, size_t count, bool bol){
+  size_t h = 1469598103934665603ull ^ bol;
+  for(size_t i = 0; i < count; ++i)
+    h = (h ^ (size_t)set[i]) * 1099511628211ull;
+  return h;
+}
+
+//Finds or makes the state for a closed set, may flush the whole cache
+DfaState* dfa_add_state(Dfa* dfa, const int* set, size_t count, bool bol){
+  size_t hash = dfa_hash(set, count, bol);
+  if(dfa->table_size){
+    size_t mask = dfa->table_size - 1;
+    for(size_t i = hash & mask; dfa->table[i] >= 0; i = (i + 1) & mask){
+      DfaState* st = dfa->states[dfa->table[i]];
+      if((st->hash == hash) && (st->bol == bol) &&
+	 (st->set_count == (int)count) &&
+	 (0 == memcmp(st->set, set, count * sizeof(int))))
+	return st;
+    }
+  }
+
+  size_t size = sizeof(DfaState) + dfa->class_count * sizeof(DfaState*) +
+    count * sizeof(int);
+  if((dfa->memory + size > regex_cache_limit) && (dfa->state_count > 0))
+    dfa_flush(dfa);
+
+  if(2 * (dfa->state_count + 1) > dfa->table_size){
+    size_t new_size = dfa->table_size ? 2 * dfa->table_size : 64;
+    int* table = malloc(new_size * sizeof(int));
+    if(nullptr == table)
+      return nullptr;
+    memset(table, 0xff, new_size * sizeof(int));
+    for(size_t i = 0; i < dfa->state_count; ++i){
+      size_t j = dfa->states[i]->hash & (new_size - 1);
+      while(table[j] >= 0)
+	j = (j + 1) & (new_size - 1);
+      table[j] = (int)i;
+    }
+    free(dfa->table);
+    dfa->table = table;
+    dfa->memory += (new_size - dfa->table_size) * sizeof(int);
+    dfa->table_size = new_size;
+  }
+
+  DfaState* st = malloc(size);
+  if(nullptr == st)
+    return nullptr;
+  st->hash = hash;
+  st->bol = bol;
+  st->set_count = (int)count;
+  st->set = (int*)(st->next + dfa->class_count);
+  memcpy(st->set, set, count * sizeof(int));
+  for(int i = 0; i < dfa->class_count; ++i)
+    st->next[i] = nullptr;
+  st->match = dfa_set_has_match(dfa, set, count);
+  //Would a newline or the end of text right here make it a match
+  memcpy(dfa->work2, set, count * sizeof(int));
+  size_t eol_count = dfa_closure(dfa, dfa->work2, count, bol, true);
+  st->match_eol = dfa_set_has_match(dfa, dfa->work2, eol_count);
+
+  int inx = (int)dfa->state_count;
+  if(!push_obj(&dfa->states, &dfa->state_count, &st)){
+    free(st);
+    return nullptr;
+  }
+  size_t j = hash & (dfa->table_size - 1);
+  while(dfa->table[j] >= 0)
+    j = (j + 1) & (dfa->table_size - 1);
+  dfa->table[j] = inx;
+  dfa->memory += size + sizeof(st);
+  return st;
+}
+
+DfaState* dfa_start(Dfa* dfa, bool bol){
+  if(dfa->init[bol])
+    return dfa->init[bol];
+  dfa->work[0] = dfa->nfa->start;
+  size_t count = dfa_closure(dfa, dfa->work, 1, bol, false);
+  dfa->init[bol] = dfa_add_state(dfa, dfa->work, count, bol);
+  return dfa->init[bol];
+}
+
+DfaState* dfa_step(Dfa* dfa, DfaState* st, unsigned char c){
+  int cls = dfa->byte_class[c];
+  if(st->next[cls])
+    return st->next[cls];
+
+  const NfaState* states = dfa->nfa->states;
+  size_t count = st->set_count;
+  memcpy(dfa->work2, st->set, count * sizeof(int));
+  if('\n' == c)
+    count = dfa_closure(dfa, dfa->work2, count, st->bol, true);
+  size_t seeds = 0;
+  for(size_t i = 0; i < count; ++i){
+    const NfaState* ns = states + dfa->work2[i];
+    if((NFA_CLASS == ns->type) && bits_has(ns->bits, c))
+      dfa->work[seeds++] = ns->out;
+  }
+  if(!dfa->anchored)
+    dfa->work[seeds++] = dfa->nfa->start;
+  count = dfa_closure(dfa, dfa->work, seeds, '\n' == c, false);
+
+  size_t flushes = dfa->flushes;
+  DfaState* to = dfa_add_state(dfa, dfa->work, count, '\n' == c);
+  //A flush freed st along with everything else
+  if(to && (flushes == dfa->flushes))
+    st->next[cls] = to;
+  return to;
+}
+
+bool dfa_matches_here(const DfaState* st, int next_byte){
+  return st->match ||
+    (st->match_eol && ((next_byte < 0) || ('\n' == next_byte)));
+}
+
+//Byte right after / before loc across chunk boundaries, -1 at the ends of text
+int byte_after(TextLocation loc){
+  snap_cursor_right(&loc);
+  if(loc.offset >= loc.node->str.len)
+    return -1;
+  return (unsigned char)loc.node->str.base[loc.offset];
+}
+
+int byte_before(TextLocation loc){
+  snap_cursor_left(&loc);
+  if(0 == loc.offset)
+    return -1;
+  return (unsigned char)loc.node->str.base[loc.offset - 1];
+}
+
+void regex_free(Regex* re){
+  if(nullptr == re)
+    return;
+  dfa_free(&re->forward);
+  dfa_free(&re->anchored);
+  dfa_free(&re->reverse);
+  dfa_free(&re->reverse_any);
+  free(re->forward_nfa.states);
+  free(re->reverse_nfa.states);
+  free(re);
+}
+
+//Returns nullptr if the pattern does not parse
+Regex* regex_compile(StringView pattern){
+  RegexParser p = {.src = pattern};
+  int root = rx_parse_alt(&p);
+  if(!rx_at_end(&p) || (root < 0))
+    p.failed = true;
+
+  Regex* re = nullptr;
+  if(!p.failed)
+    re = calloc(1, sizeof(*re));
+  if(nullptr == re){
+    free(p.nodes);
+    return nullptr;
+  }
+
+  int match = nfa_state(&re->forward_nfa, NFA_MATCH, -1, -1);
+  re->forward_nfa.start = nfa_compile(&re->forward_nfa, p.nodes, root,
+				      match, false);
+  match = nfa_state(&re->reverse_nfa, NFA_MATCH, -1, -1);
+  re->reverse_nfa.start = nfa_compile(&re->reverse_nfa, p.nodes, root,
+				      match, true);
+
+  //Bytes no class tells apart share a column in the transition tables,
+  //newline always gets its own since the anchors depend on it
+  int class_count = 2;
+  for(int c = 0; c < 256; ++c)
+    re->byte_class[c] = ('\n' == c);
+  for(size_t i = 0; i < re->forward_nfa.count; ++i){
+    const NfaState* ns = re->forward_nfa.states + i;
+    if(NFA_CLASS != ns->type)
+      continue;
+    int remap[512];
+    memset(remap, 0xff, sizeof(remap));
+    int new_count = 0;
+    for(int c = 0; c < 256; ++c){
+      int key = re->byte_class[c] * 2 + bits_has(ns->bits, c);
+      if(remap[key] < 0)
+	remap[key] = new_count++;
+      re->byte_class[c] = remap[key];
+    }
+    class_count = new_count;
+  }
+
+  rx_literal_prefix(p.nodes, root, re->prefix_buf, sizeof(re->prefix_buf),
+		    &re->prefix.len);
+  re->prefix.base = re->prefix_buf;
+  free(p.nodes);
+
+  if((re->forward_nfa.start < 0) || (re->reverse_nfa.start < 0) ||
+     !dfa_init(&re->forward, &re->forward_nfa, re->byte_class,
+	       class_count, false) ||
+     !dfa_init(&re->anchored, &re->forward_nfa, re->byte_class,
+	       class_count, true) ||
+     !dfa_init(&re->reverse, &re->reverse_nfa, re->byte_class,
+	       class_count, true) ||
+     !dfa_init(&re->reverse_any, &re->reverse_nfa, re->byte_class,
+	       class_count, false)){
+    regex_free(re);
+    return nullptr;
+  }
+  return re;
+}
+
+//Ends of the earliest ending match starting at or after from (first) and
+//of the last match of any thread alive there (last), the leftmost match
+//ends somewhere in between. Once stop is passed or a match is seen no new
+//starts are tried, the threads already running carry on in the anchored
+//DFA which shares the same NFA until they all die. With every_start new
+//starts are tried up to stop whatever is found, and last comes back no
+//earlier than stop, so every match starting before stop ends by it.
+bool regex_scan_end(Regex* re, TextLocation from, TextLocation stop,
+		    bool every_start, TextLocation* first, TextLocation* last){
+  Dfa* dfa = &re->forward;
+  int prev = byte_before(from);
+  bool bol = (prev < 0) || ('\n' == prev);
+  DfaState* state = dfa_start(dfa, bol);
+  bool jumped = false;
+  bool found = false;
+  TextLocation loc = from;
+  if(stop.node && location_eq(from, stop))
+    return false;
+  while(state){
+    //Nothing in flight, skip to where the literal prefix shows up next
+    if(re->prefix.len && !jumped && (dfa == &re->forward) &&
+       (state == dfa->init[bol])){
+      TextRange hit;
+      TextRange scan = {.start = loc, .end = stop};
+      if(!find_next(scan, re->prefix, &hit)){
+	if(found && every_start && stop.node)
+	  *last = stop;
+	return found;
+      }
+      loc = hit.start;
+      prev = byte_before(loc);
+      bol = (prev < 0) || ('\n' == prev);
+      state = dfa_start(dfa, bol);
+      jumped = true;
+      continue;
+    }
+    snap_cursor_right(&loc);
+
+    //Tight loop over cached transitions, anything unusual drops to the
+    //byte at a time path below
+    const unsigned char* base = (const unsigned char*)loc.node->str.base;
+    size_t fast_to = loc.node->str.len;
+    if((loc.node == stop.node) && (dfa == &re->forward))
+      fast_to = (stop.offset > 0) ? (stop.offset - 1) : 0;
+    bool watch_init = re->prefix.len && (dfa == &re->forward);
+    size_t i = loc.offset;
+    while(i < fast_to){
+      if(state->match || state->match_eol ||
+	 (dfa->anchored && (0 == state->set_count)))
+	break;
+      DfaState* next = state->next[dfa->byte_class[base[i]]];
+      if(nullptr == next)
+	break;
+      state = next;
+      bol = ('\n' == base[i++]);
+      if(watch_init && ((state == dfa->init[0]) || (state == dfa->init[1])))
+	break;
+    }
+    if(i != loc.offset){
+      loc.offset = i;
+      jumped = false;
+      continue;
+    }
+
+    int c = (loc.offset < loc.node->str.len) ?
+      (unsigned char)loc.node->str.base[loc.offset] : -1;
+    if(dfa_matches_here(state, c)){
+      if(!found)
+	*first = loc;
+      *last = loc;
+      found = true;
+    }
+    if((c < 0) || (dfa->anchored && (0 == state->set_count)))
+      return found;
+    loc.offset++;
+    if((dfa == &re->forward) && ((found && !every_start) ||
+				 (stop.node && location_eq(loc, stop)))){
+      if(every_start)
+	*last = loc;
+      //No match may start here, carry the running threads over
+      dfa = &re->anchored;
+      state = dfa_add_state(dfa, state->set, state->set_count, state->bol);
+      if(nullptr == state)
+	break;
+    }
+    state = dfa_step(dfa, state, c);
+    bol = ('\n' == c);
+    jumped = false;
+  }
+  return found;
+}
+
+//Leftmost start not before limit of a match ending in [first, last]. Ends
+//are tried going back from last until first, then the anchored reverse DFA
+//carries on with the threads already running.
+TextLocation regex_scan_start(Regex* re, TextLocation first, TextLocation last,
+			      TextLocation limit){
+  Dfa* dfa = &re->reverse_any;
+  int after = byte_after(last);
+  DfaState* state = dfa_start(dfa, (after < 0) || ('\n' == after));
+  TextLocation loc = last;
+  TextLocation start = last;
+  snap_cursor_left(&limit);
+  snap_cursor_left(&first);
+  while(state){
+    snap_cursor_left(&loc);
+    if((dfa == &re->reverse_any) &&
+       (loc.node == first.node) && (loc.offset == first.offset)){
+      dfa = &re->reverse;
+      state = dfa_add_state(dfa, state->set, state->set_count, state->bol);
+      if(nullptr == state)
+	break;
+    }
+    int c = (loc.offset > 0) ?
+      (unsigned char)loc.node->str.base[loc.offset - 1] : -1;
+    if(dfa_matches_here(state, c))
+      start = loc;
+    if((c < 0) || (dfa->anchored && (0 == state->set_count)) ||
+       ((loc.node == limit.node) && (loc.offset == limit.offset)))
+      break;
+    state = dfa_step(dfa, state, c);
+    loc.offset--;
+  }
+  return start;
+}
+
+//Furthest end of a match anchored at start, at least min_end
+TextLocation regex_scan_longest(Regex* re, TextLocation start,
+				TextLocation min_end){
+  Dfa* dfa = &re->anchored;
+  int prev = byte_before(start);
+  DfaState* state = dfa_start(dfa, (prev < 0) || ('\n' == prev));
+  TextLocation loc = start;
+  TextLocation end = min_end;
+  while(state){
+    snap_cursor_right(&loc);
+    int c = (loc.offset < loc.node->str.len) ?
+      (unsigned char)loc.node->str.base[loc.offset] : -1;
+    if(dfa_matches_here(state, c))
+      end = loc;
+    if((c < 0) || (0 == state->set_count))
+      break;
+    state = dfa_step(dfa, state, c);
+    loc.offset++;
+  }
+  return end;
+}
+
+//First non empty match whose start lies in range
+bool regex_find_next(Regex* re, TextRange range, TextRange* out){
+  if((nullptr == re) || (nullptr == range.start.node))
+    return false;
+  TextLocation from = range.start;
+  while(true){
+    TextLocation first;
+    TextLocation last;
+    if(!regex_scan_end(re, from, range.end, false, &first, &last))
+      return false;
+    TextLocation start = regex_scan_start(re, first, last, from);
+    TextLocation end = regex_scan_longest(re, start, start);
+    if(!location_eq(start, end)){
+      out->start = start;
+      out->end = end;
+      snap_cursor_right(&out->start);
+      snap_cursor_right(&out->end);
+      return true;
+    }
+    //Empty match, try again one byte further
+    if(byte_after(start) < 0)
+      return false;
+    from = start;
+    move_cursor_right(&from);
+    if(range.end.node && location_eq(from, range.end))
+      return false;
+  }
+}
+
+//Last non empty match whose start lies in range. One forward pass finds
+//how far the matches starting in range reach, then the unanchored reverse
+//DFA walks back from there trying every end. The first start before range
+//end it meets that has a non empty longest match is the one, both passes
+//are linear however much the matches overlap.
+bool regex_find_previous(Regex* re, TextRange range, TextRange* out){
+  if((nullptr == re) || (nullptr == range.start.node))
+    return false;
+  TextLocation first;
+  TextLocation last;
+  if(!regex_scan_end(re, range.start, range.end, true, &first, &last))
+    return false;
+  Dfa* dfa = &re->reverse_any;
+  int after = byte_after(last);
+  DfaState* state = dfa_start(dfa, (after < 0) || ('\n' == after));
+  TextLocation loc = last;
+  TextLocation limit = range.start;
+  TextLocation stop = range.end;
+  snap_cursor_left(&limit);
+  if(stop.node)
+    snap_cursor_left(&stop);
+  //Starts from stop on lie outside the range
+  bool in_range = (nullptr == stop.node);
+  while(state){
+    snap_cursor_left(&loc);
+    int c = (loc.offset > 0) ?
+      (unsigned char)loc.node->str.base[loc.offset - 1] : -1;
+    if(in_range && dfa_matches_here(state, c)){
+      TextLocation end = regex_scan_longest(re, loc, loc);
+      if(!location_eq(loc, end)){
+	out->start = loc;
+	out->end = end;
+	snap_cursor_right(&out->start);
+	snap_cursor_right(&out->end);
+	return true;
+      }
+    }
+    if((c < 0) || ((loc.node == limit.node) && (loc.offset == limit.offset)))
+      break;
+    if((loc.node == stop.node) && (loc.offset == stop.offset))
+      in_range = true;
+    state = dfa_step(dfa, state, c);
+    loc.offset--;
+  }
+  return false;
+}
+
+//Literal search when re is nullptr, regex search otherwise
+bool search_step(Regex* re, StringView needle, TextRange range,
+		 bool backwards, TextRange* out){
+  if(re)
+    return backwards ? regex_find_previous(re, range, out) :
+      regex_find_next(re, range, out);
+  return backwards ? find_previous(range, needle, out) :
+    find_next(range, needle, out);
+}
+
+//Replace all
+//Streams the text once into a fresh chunk list with every match swapped for
+//the replacement, instead of a delete and an insert per byte per match. The
+//old list is left untouched so the caller can keep it around for undo.
+typedef struct ChunkWriter ChunkWriter;
+struct ChunkWriter {
+  LinkedNativeString* head;
+  LinkedNativeString* tail;
+  size_t written;
+  bool failed;
+};
+
+bool chunk_writer_put(ChunkWriter* w, const char* bytes, size_t len){
+  //The head is made even for no bytes at all, text always has a chunk
+  while(!w->failed && ((nullptr == w->tail) || (len > 0))){
+    if(w->tail && (w->tail->str.len < w->tail->capacity)){
+      size_t room = w->tail->capacity - w->tail->str.len;
+      size_t n = (len < room) ? len : room;
+      memcpy(w->tail->str.base + w->tail->str.len, bytes, n);
+      w->tail->str.len += n;
+      w->written += n;
+      bytes += n;
+      len -= n;
+      continue;
+    }
+    LinkedNativeString* node = malloc(sizeof(*node) + chunk_capacity);
+    if(nullptr == node){
+      w->failed = true;
+      break;
+    }
+    node->prev = w->tail;
+    node->next = nullptr;
+    node->capacity = chunk_capacity;
+    node->stamp = text_version;
+    node->index_slot = 0;
+    node->index_pos = 0;
+    node->str.len = 0;
+    if(w->tail)
+      w->tail->next = node;
+    else
+      w->head = node;
+    w->tail = node;
+  }
+  return !w->failed;
+}
+
+//Bytes in [from, to), copied over unless w is nullptr
+size_t copy_range(ChunkWriter* w, TextLocation from, TextLocation to){
+  snap_cursor_right(&from);
+  if(to.node)
+    snap_cursor_right(&to);
+  size_t bytes = 0;
+  size_t offset = from.offset;
+  for(LinkedNativeString* node = from.node; node; node = node->next){
+    size_t end = (node == to.node) ? to.offset : node->str.len;
+    if(end > offset){
+      if(w)
+	chunk_writer_put(w, node->str.base + offset, end - offset);
+      bytes += end - offset;
+    }
+    if(node == to.node)
+      break;
+    offset = 0;
+  }
+  return bytes;
+}
+
+void free_chunk_list(LinkedNativeString* head){
+  while(head){
+    LinkedNativeString* next = head->next;
+    free(head);
+    head = next;
+  }
 }
 
-void move_cursor_right(TextLocation *loc){
-  snap_cursor_right(loc);
-  if(loc->offset == loc->node->str.len)
-    return;
-  loc->offset++;
-}  
+//New list with every non overlapping match replaced, nullptr when there was
+//no match (count is 0) or memory ran out. cursor is a byte offset and is
+//moved along with the text, into a match puts it before the replacement.
+LinkedNativeString* replace_all(LinkedNativeString* head, Regex* re,
+				StringView needle, StringView replacement,
+				size_t* cursor, size_t* count){
+  *count = 0;
+  TextLocation done = {.node = head};
+  TextRange match;
+  if(!search_step(re, needle, (TextRange){.start = done}, false, &match))
+    return nullptr;
 
-void ins_char_left(TextLocation *loc, char ch){
-  snap_cursor_left(loc);
-  //Case filled
-  if(loc->node->capacity == loc->node->str.len){
-    //Create new node
-    LinkedNativeString* new = malloc(loc->node->capacity + sizeof(*new));
-    new->capacity = loc->node->capacity;
-    new->prev = loc->node;
-    new->next = loc->node->next;
-    if(new->next)
-      new->next->prev = new;
-    loc->node->next = new;
-    
-    if(loc->offset <loc->node->capacity){
-      new->str.len = loc->node->str.len - loc->offset;
-      memcpy(new->str.base,
-	     loc->node->str.base + loc->offset,
-	     new->str.len);
-      loc->node->str.len = loc->offset;
+  //New chunks carry the new version, so nothing mistakes them for the old
+  text_version++;
+  ChunkWriter w = {0};
+  size_t consumed = 0;
+  size_t old_cursor = *cursor;
+  bool cursor_moved = false;
+  while(true){
+    consumed += copy_range(&w, done, match.start);
+    if(!cursor_moved && (old_cursor <= consumed)){
+      *cursor = w.written - (consumed - old_cursor);
+      cursor_moved = true;
     }
-    else{
-      new->str.len = 0;
-      loc->node = loc->node->next;
-      loc->offset = 0;
+    size_t dropped = copy_range(nullptr, match.start, match.end);
+    if(!cursor_moved && (old_cursor < consumed + dropped)){
+      *cursor = w.written;
+      cursor_moved = true;
     }
+    consumed += dropped;
+    chunk_writer_put(&w, replacement.base, replacement.len);
+    (*count)++;
+    done = match.end;
+    if(w.failed ||
+       !search_step(re, needle, (TextRange){.start = done}, false, &match))
+      break;
   }
-  else{
-    memmove(loc->node->str.base + loc->offset + 1,
-	    loc->node->str.base + loc->offset,
-	    loc->node->str.len - loc->offset);
+  consumed += copy_range(&w, done, (TextLocation){0});
+  if(!cursor_moved)
+    *cursor = w.written - ((old_cursor < consumed) ? (consumed - old_cursor) : 0);
+  if(w.failed){
+    free_chunk_list(w.head);
+    return nullptr;
   }
-  
-  loc->node->str.base[loc->offset++] = ch;
-  loc->node->str.len++;
+  return w.head;
 }
 
-void del_char_left(TextLocation *loc){
-  snap_cursor_left(loc);
-  if(0 == loc->offset)
-    return;
+//Search benchmarks
+//-bench-find <MB> runs the search engine over a chunk list of that many
+//megabytes of random lowercase lines, with no window, and prints how fast
+//it went. The needle sits at the far end from where each search starts, so
+//the whole text is scanned. find_all then goes over the same text on pools
+//of 1, 2, 4 and as many workers as there are cores, for its speedup.
+LinkedNativeString* bench_text(size_t bytes){
+  LinkedNativeString* head = nullptr;
+  LinkedNativeString* tail = nullptr;
+  uint64_t seed = 0x9e3779b97f4a7c15ull;
+  size_t column = 0;
+  for(size_t done = 0; done < bytes;){
+    LinkedNativeString* node = malloc(sizeof(*node) + chunk_capacity);
+    if(nullptr == node){
+      free_chunk_list(head);
+      return nullptr;
+    }
+    *node = (LinkedNativeString){
+      .prev = tail, .capacity = chunk_capacity, .stamp = text_version
+    };
+    size_t len = (bytes - done < chunk_capacity) ? (bytes - done) : chunk_capacity;
+    for(size_t i = 0; i < len; ++i){
+      seed ^= seed << 13;
+      seed ^= seed >> 7;
+      seed ^= seed << 17;
+      node->str.base[i] = (79 == column) ? '\n' : (char)('a' + seed % 26);
+      column = (column + 1) % 80;
+    }
+    node->str.len = len;
+    if(tail)
+      tail->next = node;
+    else
+      head = node;
+    tail = node;
+    done += len;
+  }
+  return head;
+}
 
-    memmove(loc->node->str.base + loc->offset - 1,
-	    loc->node->str.base + loc->offset,
-	    loc->node->str.len - loc->offset);
-    loc->node->str.len--;
-    loc->offset--;
+//Puts text at offset from the start of node and from the end of the last
+void bench_plant(LinkedNativeString* head, const char* text, size_t offset){
+  LinkedNativeString* tail = head;
+  while(tail->next)
+    tail = tail->next;
+  size_t len = strlen(text);
+  memcpy(head->str.base + offset, text, len);
+  memcpy(tail->str.base + tail->str.len - offset - len, text, len);
 }
 
-void del_char_right(TextLocation *loc){
-  snap_cursor_right(loc);
-  if(loc->offset == loc->node->str.len)
-    return;
-  
-  memmove(loc->node->str.base + loc->offset,
-	  loc->node->str.base + loc->offset+1,
-	  loc->node->str.len - loc->offset-1);
-  loc->node->str.len--;
+double bench_seconds(LARGE_INTEGER since){
+  LARGE_INTEGER now;
+  LARGE_INTEGER frequency;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&frequency);
+  return (double)(now.QuadPart - since.QuadPart) / frequency.QuadPart;
 }
 
-//Will be start inclusive and end exclusive
-typedef struct TextRange TextRange;
-struct TextRange {
-  TextLocation start;
-  TextLocation end;
-};
+bool bench_find(size_t megabytes){
+  size_t bytes = megabytes << 20;
+  LinkedNativeString* head = (bytes >= chunk_capacity) ?
+    bench_text(bytes) : nullptr;
+  if(nullptr == head){
+    printf("Could not make %zu MB of text\n", megabytes);
+    return false;
+  }
+  const char* text = "needle_xyz";
+  StringView needle = view_cstr((char*)text);
+  bench_plant(head, text, 64);
+  LinkedNativeString* tail = head;
+  while(tail->next)
+    tail = tail->next;
+  //Each skips the copy at the end it starts from
+  TextLocation after_first = {.node = head, .offset = 65};
+  TextLocation before_last = {
+    .node = tail, .offset = tail->str.len - 64 - needle.len
+  };
 
-void collect_occurances(TextRange to_search,
-			StringView* keywords, size_t key_count,
-			TextRange** out_arr, size_t* out_count){
+  TextRange match;
+  LARGE_INTEGER start;
+  QueryPerformanceCounter(&start);
+  bool found_next = find_next((TextRange){.start = after_first}, needle,
+			      &match) && (match.start.node == tail);
+  double next_seconds = bench_seconds(start);
+  QueryPerformanceCounter(&start);
+  bool found_previous =
+    find_previous((TextRange){.start = {.node = head}, .end = before_last},
+		  needle, &match) && (match.start.node == head);
+  double previous_seconds = bench_seconds(start);
 
-  snap_cursor_right(&to_search.start);
-  if(to_search.end.node)
-    snap_cursor_right(&to_search.end);
+  printf("find_next:     %s in %.3f s, %.2f GB/s\n",
+	 found_next ? "found" : "MISSED", next_seconds,
+	 bytes / 1e9 / next_seconds);
+  printf("find_previous: %s in %.3f s, %.2f GB/s\n",
+	 found_previous ? "found" : "MISSED", previous_seconds,
+	 bytes / 1e9 / previous_seconds);
 
-  //Allocate intermediate array
-  size_t total_len = 0;
-  for(int i = 0; i < key_count; ++i)
-    total_len += keywords[i].len;
-  size_t alloc_size = total_len * sizeof(TextLocation) +
-    key_count * sizeof(TextLocation*) +
-    key_count * (sizeof(size_t) + sizeof(TextRange));
+  bool found_all = true;
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  size_t worker_counts[] = {1, 2, 4, info.dwNumberOfProcessors};
+  double one_worker = 0;
+  for(size_t k = 0; k < _countof(worker_counts); ++k){
+    if((k + 1 == _countof(worker_counts)) && (worker_counts[k] <= 4) &&
+       (worker_counts[k] != 3))
+      break;
+    ThreadPool* pool = pool_start(worker_counts[k]);
+    if(nullptr == pool)
+      continue;
+    size_t workers = pool->worker_count;
+    worker_pool = pool;
+    size_t* starts;
+    size_t count;
+    size_t total;
+    QueryPerformanceCounter(&start);
+    bool complete = find_all(head, needle, 1024, &starts, &count, &total);
+    double seconds = bench_seconds(start);
+    worker_pool = nullptr;
+    pool_stop(pool);
+    free(starts);
+    if(0 == k)
+      one_worker = seconds;
+    bool found = complete && (2 == total);
+    found_all = found_all && found;
+    printf("find_all:      %s with %zu workers in %.3f s, %.2f GB/s, "
+	   "%.2fx one worker\n", found ? "found" : "MISSED", workers, seconds,
+	   bytes / 1e9 / seconds, one_worker / seconds);
+  }
+  free_chunk_list(head);
+  return found_next && found_previous && found_all;
+}
 
-  
-  TextLocation** key_char_locs = malloc(alloc_size);
-  memset((void*)key_char_locs, 0, alloc_size);
-  TextLocation* temp_buff_ptr = (TextLocation*)(key_char_locs + key_count);
-  for(int i = 0; i < key_count; ++i){
-    key_char_locs[i] = temp_buff_ptr;
-    temp_buff_ptr += keywords[i].len;
-  }
-  //This pointer will be an array to intermediate results, which can be a max of
-  //key_count per loop
-  TextRange* interm_results = (TextRange*)temp_buff_ptr;
-  size_t* interm_key_inxs = (size_t*)(interm_results + key_count);
-  size_t interm_count = 0;
-  
-  while(!((to_search.start.node->next == nullptr) &&
-	 (to_search.start.offset == to_search.start.node->str.len)) &&
-	!((to_search.start.node == to_search.end.node) &&
-	 (to_search.start.offset == to_search.end.offset))){
-
-    char ch = to_search.start.node->str.base[to_search.start.offset];
-    //Initialize interm results to 0
-    interm_count = 0;
-    //Initialize first pointers
-    for(int i = 0; i < key_count; ++i){
-      key_char_locs[i][0] = to_search.start;
+//-bench-regex <MB> does the same for regex_find_next with a few patterns:
+//one the literal prefix lets skip ahead, two with small DFAs and one whose
+//DFA needs far more states than regex_cache_limit holds, so the cache gets
+//flushed over and over. Each prints the forward DFA cache as it ends up.
+const char* bench_patterns[] = {
+  "needle[0-9]+",
+  "[a-z]+[0-9]+",
+  "(ab|cd)+9",
+  "[a-e][a-z][a-z][a-z][a-z][a-z][a-z][a-z]"
+  "[a-z][a-z][a-z][a-z][a-z][a-z][a-z]9",
+};
+
+bool bench_regex(size_t megabytes){
+  size_t bytes = megabytes << 20;
+  LinkedNativeString* head = (bytes >= chunk_capacity) ?
+    bench_text(bytes) : nullptr;
+  if(nullptr == head){
+    printf("Could not make %zu MB of text\n", megabytes);
+    return false;
+  }
+  //Something for every pattern, the text itself has no digits
+  const char* text = "needle42 abcd9 abcdefghijklmno9";
+  bench_plant(head, text, 64);
+  TextLocation after_first = {.node = head, .offset = 64 + strlen(text)};
+
+  bool all_found = true;
+  size_t count = sizeof(bench_patterns) / sizeof(bench_patterns[0]);
+  for(size_t i = 0; i < count; ++i){
+    Regex* re = regex_compile(view_cstr((char*)bench_patterns[i]));
+    if(nullptr == re){
+      free_chunk_list(head);
+      return false;
     }
-    
-    //Now right shift each of them if they passed, but also special case for if that happens in end
-    for(int i = 0; i < key_count; ++i){
-      int len = keywords[i].len;
-      //If last case
-      int j = len - 1;
-      if(key_char_locs[i][j].node &&  (keywords[i].base[j] == ch)){
-	TextRange out = {
-	  .start = key_char_locs[i][j],
-	  .end = to_search.start
-	};
-	//Make it end exclusive range
-	move_cursor_right(&out.end);
-	snap_cursor_right(&out.end);
-	interm_results[interm_count++] = out;
-	interm_key_inxs[interm_count-1] = i;
-      }
-      key_char_locs[i][j].node = nullptr;
-      j--;
-      {    
-	for(; j >= 0; --j){
-	  if(key_char_locs[i][j].node && (keywords[i].base[j] == ch)){
-	    key_char_locs[i][j+1] = key_char_locs[i][j];
-	  }
-	  key_char_locs[i][j].node = nullptr;
-	}
-      }
+    TextRange match;
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    bool found = regex_find_next(re, (TextRange){.start = after_first},
+				 &match) && (nullptr == match.start.node->next);
+    double seconds = bench_seconds(start);
+    printf("%s\n  %s in %.3f s, %.2f GB/s, prefix \"%.*s\", "
+	   "cache %zu KB in %zu states, %zu flushes\n",
+	   bench_patterns[i], found ? "found" : "MISSED", seconds,
+	   bytes / 1e9 / seconds, (int)re->prefix.len, re->prefix.base,
+	   re->forward.memory >> 10, re->forward.state_count,
+	   re->forward.flushes);
+    all_found = all_found && found;
+    regex_free(re);
+  }
+  free_chunk_list(head);
+  return all_found;
+}
+
+//Regex checks
+//-check-regex runs each case over the text in one chunk and again split
+//into one byte chunks, so matches that straddle chunks get covered too,
+//prints the ones that come out wrong and exits nonzero if there were any.
+typedef struct RegexCase RegexCase;
+struct RegexCase {
+  const char* pattern;
+  const char* text;
+  //Expected match as byte offsets, -1 when there is none
+  int start;
+  int end;
+  //Search backwards with the range ending at stop, 0 for the end of text
+  bool previous;
+  int stop;
+};
+
+RegexCase regex_cases[] = {
+  //Leftmost wins over earliest ending
+  {"abcd|bc", "abcd", 0, 4},
+  {"a.*z|b", "abz", 0, 3},
+  {"bc|abcd", "xabcd", 1, 5},
+  {"b|a.*z", "xxabz", 2, 5},
+  //Longest from the leftmost start
+  {"ab|abcd", "abcd", 0, 4},
+  {"b+", "abbbc", 1, 4},
+  {"a*", "bab", 1, 2},
+  {"needle[0-9]+", "a needle needle42 x", 9, 17},
+  {"^b", "ab\nb", 3, 4},
+  {"a$", "ab\na", 3, 4},
+  {"x|yz", "abc", -1, -1},
+  //Last start with a non empty match, which may run past the range end
+  {"abcd|bc", "abcd", 1, 3, true},
+  {"a+x", "aaaax", 3, 5, true},
+  {"a+x", "aaaax", 1, 5, true, 2},
+  {"a*", "aab", 1, 2, true},
+  {"b+", "abbbc", 3, 4, true},
+  {"^b", "ab\nb", 3, 4, true},
+  {"b", "abab", 1, 2, true, 3},
+  {"x|yz", "abc", -1, -1, true},
+};
+
+LinkedNativeString* check_text(const char* text, size_t piece){
+  LinkedNativeString* head = nullptr;
+  LinkedNativeString* tail = nullptr;
+  size_t len = strlen(text);
+  size_t done = 0;
+  do{
+    size_t n = (len - done < piece) ? (len - done) : piece;
+    LinkedNativeString* node = malloc(sizeof(*node) + piece);
+    if(nullptr == node){
+      free_chunk_list(head);
+      return nullptr;
     }
+    *node = (LinkedNativeString){
+      .prev = tail, .capacity = piece, .stamp = text_version
+    };
+    memcpy(node->str.base, text + done, n);
+    node->str.len = n;
+    if(tail)
+      tail->next = node;
+    else
+      head = node;
+    tail = node;
+    done += n;
+  }while(done < len);
+  return head;
+}
 
-    //Now if some token is identified, choose it based on some merit
-    if(interm_count > 0){
-      //Let's choose key which is shortest
-      int shorty = 0;
+//Byte offset of loc counted from head
+int check_offset(LinkedNativeString* head, TextLocation loc){
+  int offset = 0;
+  for(LinkedNativeString* node = head; node != loc.node; node = node->next)
+    offset += node->str.len;
+  return offset + (int)loc.offset;
+}
 
-      for(int i = 1; i < interm_count; ++i){
-	int inx_sh = interm_key_inxs[shorty];
-	int inx_it = interm_key_inxs[i];
-	if(keywords[inx_it].len < keywords[inx_sh].len)
-	  shorty = i;
+bool regex_check(void){
+  int failed = 0;
+  for(size_t i = 0; i < sizeof(regex_cases) / sizeof(regex_cases[0]); ++i){
+    RegexCase* rc = regex_cases + i;
+    Regex* re = regex_compile(view_cstr((char*)rc->pattern));
+    size_t pieces[] = {chunk_capacity, 1};
+    for(size_t k = 0; re && (k < 2); ++k){
+      size_t piece = pieces[k];
+      LinkedNativeString* head = check_text(rc->text, piece);
+      if(nullptr == head)
+	break;
+      TextRange match;
+      int start = -1;
+      int end = -1;
+      TextRange range = {.start = {.node = head}};
+      if(rc->stop)
+	range.end = advance_location(range.start, rc->stop);
+      bool found = rc->previous ? regex_find_previous(re, range, &match) :
+	regex_find_next(re, range, &match);
+      if(found){
+	start = check_offset(head, match.start);
+	end = check_offset(head, match.end);
       }
-      //Keep shorty, discard others
-      push_obj(out_arr, out_count, &interm_results[shorty]);
-      for(int i = 0; i < key_count; ++i){
-	for(int j = 0; j < keywords[i].len; ++j){
-	  key_char_locs[i][j].node = nullptr;
-	}
+      if((start != rc->start) || (end != rc->end)){
+	printf("/%s/ %s in chunks of %zu: got [%d, %d) wanted [%d, %d)\n",
+	       rc->pattern, rc->previous ? "backwards" : "forwards", piece,
+	       start, end, rc->start, rc->end);
+	failed++;
       }
+      free_chunk_list(head);
     }
-    move_cursor_right(&to_search.start);
-    snap_cursor_right(&to_search.start);
+    if(nullptr == re){
+      printf("/%s/ does not compile\n", rc->pattern);
+      failed++;
+    }
+    regex_free(re);
+  }
+  printf("%d regex checks failed\n", failed);
+  return 0 == failed;
+}
+
+//Chunk index checks
+//-check-index lexes each case's chunks, swaps the text of its last chunk,
+//brings the index up to date and compares every leaf and identifier count
+//with an index built from scratch over the edited chunks. The empty chunks
+//in between are what the lexer reads on through.
+typedef struct IndexCase IndexCase;
+struct IndexCase {
+  const char* chunks[4];
+  const char* edited;
+};
+
+IndexCase index_cases[] = {
+  //The closer of a block comment shows up past an empty chunk
+  {{"/*((*", "", "}x"}, "/}*"},
+  {{"/*((*", "", "/}*"}, "}x"},
+  //A line comment opener that is split across one
+  {{" /", "", "/x1/"}, "x1/"},
+  {{" /", "", "x1/"}, "/x1/"},
+  //Strings and escapes
+  {{"\"a\\", "", "\" b"}, "x\" b"},
+  {{"'(", "", "", "'"}, ")"},
+};
+
+const char* check_language =
+  "line_comment //\n"
+  "block_comment /* */\n"
+  "string \" \\\n"
+  "string ' \\\n";
+
+//Same leaf as far as anyone reading the index can tell
+bool index_leaf_eq(const ChunkIndex* a, const ChunkIndex* b, size_t inx){
+  const ChunkLeaf* x = a->leaves + inx;
+  const ChunkLeaf* y = b->leaves + inx;
+  if((x->lex_in != y->lex_in) || (x->skip_in != y->skip_in) ||
+     (x->lex_out != y->lex_out) || (x->skip_out != y->skip_out) ||
+     memcmp(x->sum.net, y->sum.net, sizeof(x->sum.net)) ||
+     memcmp(x->sum.min, y->sum.min, sizeof(x->sum.min)) ||
+     (x->word_count != y->word_count))
+    return false;
+  for(size_t w = 0; w < y->word_count; ++w){
+    char word[IDENT_MAX_LEN];
+    size_t len = ident_spell(b->idents, y->words[w].id, word);
+    uint32_t id = ident_trie_find(a->idents, word, len);
+    if((0 == id) ||
+       (a->idents->nodes[id].count != b->idents->nodes[y->words[w].id].count))
+      return false;
   }
-  free(key_char_locs);
+  return true;
 }
-			
 
+bool chunk_index_check(void){
+  Lexer* lexer = compile_language(view_cstr((char*)check_language));
+  if(nullptr == lexer)
+    return false;
+  int failed = 0;
+  for(size_t i = 0; i < sizeof(index_cases) / sizeof(index_cases[0]); ++i){
+    IndexCase* ic = index_cases + i;
+    LinkedNativeString* head = nullptr;
+    LinkedNativeString* tail = nullptr;
+    for(size_t k = 0; (k < 4) && ic->chunks[k]; ++k){
+      LinkedNativeString* node = check_text(ic->chunks[k], chunk_capacity);
+      if(nullptr == node)
+	break;
+      node->prev = tail;
+      if(tail)
+	tail->next = node;
+      else
+	head = node;
+      tail = node;
+    }
+    if(nullptr == head)
+      break;
+    IdentTrie kept_idents = {0};
+    IdentTrie fresh_idents = {0};
+    ChunkIndex kept = {.lexer = lexer, .idents = &kept_idents};
+    ChunkIndex fresh = {.lexer = lexer, .idents = &fresh_idents};
+    chunk_index_refresh(&kept, head);
+    text_version++;
+    tail->str.len = strlen(ic->edited);
+    memcpy(tail->str.base, ic->edited, tail->str.len);
+    mark_chunk_dirty(tail);
+    chunk_index_refresh(&kept, head);
+    chunk_index_refresh(&fresh, head);
+    for(size_t k = 0; k < fresh.count; ++k){
+      if((k < kept.count) && index_leaf_eq(&kept, &fresh, k))
+	continue;
+      printf("index case %zu: leaf %zu differs from a fresh build\n", i, k);
+      failed++;
+    }
+    chunk_index_free(&kept);
+    chunk_index_free(&fresh);
+    free_chunk_list(head);
+  }
+  lexer_free(lexer);
+  printf("%d chunk index checks failed\n", failed);
+  return 0 == failed;
+}
 
 const char* skip_directories(size_t path_len, const char path[path_len]){
   bool slash_found = false;
@@ -480,6 +7222,32 @@ const char* skip_directories(size_t path_len, const char path[path_len]){
 }
 
 int main(int argc, char* argv[]){
+  //-check-regex and -check-index run those cases and exit
+  for(int i = 1; i < argc; ++i){
+    if(strcmp(argv[i], "-check-regex") == 0)
+      return regex_check() ? 0 : 1;
+    if(strcmp(argv[i], "-check-index") == 0)
+      return chunk_index_check() ? 0 : 1;
+  }
+  //-bench-find and -bench-regex <MB> time the search engine over that much
+  //text and exit
+  for(int i = 1; i + 1 < argc; ++i){
+    if(strcmp(argv[i], "-bench-find") == 0)
+      return bench_find(strtoull(argv[i + 1], nullptr, 10)) ? 0 : 1;
+    if(strcmp(argv[i], "-bench-regex") == 0)
+      return bench_regex(strtoull(argv[i + 1], nullptr, 10)) ? 0 : 1;
+  }
+  //-bench <frames> draws that many frames with the headless backend, prints
+  //what they took and leaves the file as it was
+  size_t bench_frames = 0;
+  for(int i = 1; i + 1 < argc; ++i){
+    if(strcmp(argv[i], "-bench") == 0){
+      bench_frames = strtoull(argv[i + 1], nullptr, 10);
+      memmove(argv + i, argv + i + 2, (argc - i - 1) * sizeof(*argv));
+      argc -= 2;
+      break;
+    }
+  }
   const char* file_name = "test.txt";
   if(argc == 2){
     if(strcmp(argv[1],"-a") != 0)
@@ -510,20 +7278,26 @@ int main(int argc, char* argv[]){
 
   const char* font_file = "JetBrainsMonoNL-Regular.ttf";
   const char* raylib_dll_file = "raylib.dll";
+  const char* language_dir = "languages/";
 
   char* adj_font_file = malloc(strlen(font_file) + strlen(argv[0]) + 1);
   char* adj_raylib_dll_file = malloc(strlen(raylib_dll_file) + strlen(argv[0]) + 1);
+  char* adj_language_dir = malloc(strlen(language_dir) + strlen(argv[0]) + 1);
 
   const char* upto_exe_dir = skip_directories(strlen(argv[0]), argv[0]);
   memcpy(adj_font_file, argv[0], upto_exe_dir-argv[0]);
   memcpy(adj_raylib_dll_file, argv[0], upto_exe_dir-argv[0]);
+  memcpy(adj_language_dir, argv[0], upto_exe_dir-argv[0]);
 
   strcpy(adj_font_file + (upto_exe_dir - argv[0]), font_file);
   strcpy(adj_raylib_dll_file + (upto_exe_dir - argv[0]), raylib_dll_file);
+  strcpy(adj_language_dir + (upto_exe_dir - argv[0]), language_dir);
   
   
   //rl_init_lib("raylib");
   rl_init_lib(adj_raylib_dll_file);
+  if(bench_frames)
+    use_headless_backend(bench_frames);
 
   rl_set_trace_log_level(LOG_WARNING);
   rl_set_config_flags(FLAG_WINDOW_RESIZABLE);
@@ -541,13 +7315,54 @@ int main(int argc, char* argv[]){
 
   
   if(!rl_is_font_ready(default_font)){
+    //The built in font lives on the GPU, headless has nothing to fall on
+    if(bench_frames){
+      printf("Could not load %s, -bench needs it\n", adj_font_file);
+      return 1;
+    }
     default_font = rl_get_font_default();
   }
+  detect_monospace();
+  //Faces codepoints the one above lacks fall back on, in order, then the
+  //styled faces
+  struct {
+    const char* file;
+    enum TextStyle style;
+  } face_files[] = {
+    {"CascadiaMono.ttf", STYLE_REGULAR},
+    {"Sanskr.ttf", STYLE_REGULAR},
+    {"JetBrainsMonoNL-Bold.ttf", STYLE_BOLD},
+    {"JetBrainsMonoNL-MediumItalic.ttf", STYLE_ITALIC}
+  };
+  int font_file_size;
+  if(face_chain_add(&face_chain, STYLE_REGULAR,
+		    rl_load_file_data(adj_font_file, &font_file_size),
+		    font_file_size)){
+    for(size_t i = 0; i < _countof(face_files); ++i){
+      char* path = malloc(strlen(face_files[i].file) + strlen(argv[0]) + 1);
+      if(nullptr == path)
+	continue;
+      memcpy(path, argv[0], upto_exe_dir - argv[0]);
+      strcpy(path + (upto_exe_dir - argv[0]), face_files[i].file);
+      int size;
+      face_chain_add(&face_chain, face_files[i].style,
+		     rl_load_file_data(path, &size), size);
+      free(path);
+    }
+  }
+  //Set by the workers, so an idle frame waits for them too
+  frame_wake = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+  //Without the file zooming scales the atlas it has
+  FontAtlases font_atlases;
+  start_font_atlases(&font_atlases, default_font);
 
   
-  LinkedNativeString *head_node = malloc(sizeof(*head_node) + 1);
+  LinkedNativeString *head_node = malloc(sizeof(*head_node) + chunk_capacity);
   head_node->prev = head_node->next = NULL;
-  head_node->capacity =  1;
+  head_node->capacity = chunk_capacity;
+  head_node->stamp = text_version;
+  head_node->index_slot = 0;
+  head_node->index_pos = 0;
   head_node->str.len = 0;
 
   TextLocation curr_pos = {.node = head_node};
@@ -579,17 +7394,107 @@ int main(int argc, char* argv[]){
     fclose(file);
   }
     
+  //Language pack for the file's extension, else the built in C keywords
+  Lexer* lexer = load_language(adj_language_dir, file_name);
+  if(nullptr == lexer)
+    lexer = builtin_lexer(keys_to_color, _countof(keys_to_color), BLUE);
+
+  //Bracket matching and pair colours, the index counts identifiers too
+  IdentTrie ident_trie = {0};
+  ChunkIndex chunk_index = {.lexer = lexer, .idents = &ident_trie};
+  RlColor bracket_colors[] = {
+    {0, 128, 128, 255}, {175, 0, 219, 255}, {205, 140, 0, 255},
+    {0, 110, 200, 255}, {200, 40, 90, 255}, {90, 140, 0, 255}
+  };
+  //Ctrl+Shift+[ folds the block at the cursor, Ctrl+Shift+] unfolds it
+  FoldSet fold_set = {0};
+  size_t fold_pivot = 0;
+  size_t fold_lines = 0;
+  WrapLayout wrap_layout = {0};
+  //Ctrl+Space lists identifiers starting with the word left of the cursor,
+  //Up/Down pick one, Tab puts in the rest of it and Esc closes the list
+  bool complete_mode = false;
+  char complete_words[8][IDENT_MAX_LEN];
+  size_t complete_lens[8];
+  size_t complete_count = 0;
+  size_t complete_pick = 0;
+  size_t complete_prefix = 0;
+  int cursor_x = x0;
+  int cursor_y = y0;
+  Viewport view = {.y = y0};
+  //F12 jumps to the definition of the identifier under the cursor, Ctrl+O
+  //shows the outline on the right where a click jumps to a symbol
+  Outline outline = {0};
+  bool outline_open = false;
+  //F3 shows how many text draw calls the last frame took and how many
+  //frames were drawn a minute
+  bool stats_open = false;
+  FrameCount frame_count = {.minute_start = rl_get_time()};
+  //Text runs of the frame, kept to reuse the memory
+  TextBatch text_batch = {0};
+  //The text area as it was drawn, rows are only drawn again when they change
+  DisplayCache display_cache = {0};
+
+  Highlighter highlighter;
+  if(!start_highlighter(&highlighter, lexer)){
+    printf("Could not start highlighter thread, text will not be colored\n");
+  }
+  HighlightResult* spans = nullptr;
+
+  //Without it searches just run on this thread
+  worker_pool = pool_start(0);
+
+  size_t text_bytes = 0;
+  for(LinkedNativeString* node = head_node; node; node = node->next)
+    text_bytes += node->str.len;
+  if(text_bytes >= trigram_index_min_bytes)
+    trigram_index = calloc(1, sizeof(*trigram_index));
+
   double last_save = rl_get_time();
 
   double prev_blink_time = rl_get_time();
   bool blink_now = true;
   KeyRecorder recorder = {0};
+
+  //Find bar, Ctrl+F opens, Enter/Shift+Enter go to next/previous, Esc closes
+  //Ctrl+R switches between literal and regex queries
+  bool search_mode = false;
+  bool search_regex = false;
+  Regex* search_re = nullptr;
+  bool search_re_stale = true;
+  char search_query[256] = {0};
+  size_t search_len = 0;
+  bool search_found = false;
+  bool search_missed = false;
+  TextRange search_match = {0};
+  size_t search_version = 0;
+  //Literal queries search as you type, starting from where the bar was opened
+  SearchSet search_set = {0};
+  size_t search_origin = 0;
+  bool search_typed = false;
+  //Ctrl+H shows a replace field, Tab moves between the two and Ctrl+Enter
+  //replaces every match
+  bool replace_mode = false;
+  bool replace_focus = false;
+  char replace_text[256] = {0};
+  size_t replace_len = 0;
+  size_t replaced_count = 0;
+  //One level of undo for replace all, Ctrl+Z swaps the old list back in and
+  //again swaps it out, until any other edit drops it
+  LinkedNativeString* undo_head = nullptr;
+  size_t undo_cursor = 0;
+  size_t undo_version = 0;
   
   int max_count = 0;
   while(!rl_window_should_close()){
     
     rl_begin_drawing();
     rl_clear_background(WHITE);
+    frame_count_tick(&frame_count, rl_get_time());
+    size_t frame_text_draws = text_draw_calls;
+    text_draw_calls = 0;
+    if(rl_is_key_pressed(KEY_F3))
+      stats_open = !stats_open;
 
     if((rl_get_time() - prev_blink_time) > 0.5){
       prev_blink_time = rl_get_time();
@@ -605,13 +7510,17 @@ int main(int argc, char* argv[]){
 	font_size = 10;
     }
     else{
-      y0 += m_zoom * font_size /2.0;
+      view.y += m_zoom * font_size /2.0;
+    }
+    if(font_atlases_frame(&font_atlases, font_size)){
+      font_serial++;
+      detect_monospace();
     }
     //Save file
     if(((rl_is_key_down(KEY_LEFT_CONTROL) ||
 	rl_is_key_down(KEY_RIGHT_CONTROL)) &&
 	rl_is_key_released('S')) ||
-       ((rl_get_time() - last_save) > autosave)){
+       (!bench_frames && ((rl_get_time() - last_save) > autosave))){
       file = fopen(file_name, "w");
       if(nullptr == file){
 	printf("Error in opening file %s for writing\n", file_name);
@@ -641,48 +7550,318 @@ int main(int argc, char* argv[]){
     press_count = get_key_count(&recorder, KEY_RIGHT);
     for(int i = 0 ; i<press_count; ++i){
       move_cursor_right(&curr_pos);
+      fold_skip(&fold_set, &chunk_index, &curr_pos, true);
       blink_now = true;
     }
 
     press_count = get_key_count(&recorder, KEY_LEFT);
     for(int i = 0; i < press_count; ++i){
       move_cursor_left(&curr_pos);
+      fold_skip(&fold_set, &chunk_index, &curr_pos, false);
       blink_now = true;
     }
-    //Text input section
-    int char_code ;
 
-    while((char_code = rl_get_char_pressed())){
-      ins_char_left(&curr_pos, char_code);
-      blink_now = true;
+    //Completion section
+    bool ctrl_down = rl_is_key_down(KEY_LEFT_CONTROL) ||
+      rl_is_key_down(KEY_RIGHT_CONTROL);
+    if(ctrl_down && rl_is_key_pressed(KEY_SPACE)){
+      complete_mode = true;
+      complete_pick = 0;
+      rl_set_exit_key(KEY_NULL);
+    }
+    if(complete_mode){
+      if(rl_is_key_pressed(KEY_DOWN) && (complete_pick + 1 < complete_count))
+	complete_pick++;
+      if(rl_is_key_pressed(KEY_UP) && (complete_pick > 0))
+	complete_pick--;
+      if(rl_is_key_pressed(KEY_ESCAPE) || rl_is_key_pressed(KEY_LEFT) ||
+	 rl_is_key_pressed(KEY_RIGHT) || rl_is_key_pressed(KEY_F) ||
+	 rl_is_key_pressed(KEY_H)){
+	complete_mode = false;
+	if(!search_mode)
+	  rl_set_exit_key(KEY_ESCAPE);
+      }
     }
 
-    //key pressed or (key down and time from last keypress > smthing)
-
-    press_count = get_key_count(&recorder, KEY_ENTER);
-    for(int i  = 0 ;i < press_count; ++i){
-      ins_char_left(&curr_pos,  '\n');
+    //Folding section
+    bool fold_keys = (rl_is_key_down(KEY_LEFT_CONTROL) ||
+		      rl_is_key_down(KEY_RIGHT_CONTROL)) &&
+      (rl_is_key_down(KEY_LEFT_SHIFT) || rl_is_key_down(KEY_RIGHT_SHIFT)) &&
+      (chunk_index.version == text_version);
+    if(fold_keys && rl_is_key_pressed(KEY_LEFT_BRACKET) &&
+       fold_at(&fold_set, &chunk_index, curr_pos)){
+      fold_set.version = text_version;
+      fold_skip(&fold_set, &chunk_index, &curr_pos, false);
       blink_now = true;
     }
+    if(fold_keys && rl_is_key_pressed(KEY_RIGHT_BRACKET))
+      fold_set_open(&fold_set, chunk_index_line_of(&chunk_index, curr_pos));
+    //Edits only happen at the cursor, remember its line to move folds after
+    if(fold_set.count && (chunk_index.version == text_version)){
+      fold_pivot = chunk_index_line_of(&chunk_index, curr_pos);
+      fold_lines = chunk_index_line_count(&chunk_index);
+    }
 
+    //Find bar section
+    bool open_find = rl_is_key_pressed(KEY_F);
+    bool open_replace = rl_is_key_pressed(KEY_H);
+    if((rl_is_key_down(KEY_LEFT_CONTROL) ||
+	rl_is_key_down(KEY_RIGHT_CONTROL)) &&
+       (open_find || open_replace)){
+      replace_mode = open_replace;
+      replace_focus = false;
+      replaced_count = 0;
+      search_mode = true;
+      search_missed = false;
+      search_origin = location_offset(head_node, curr_pos);
+      search_typed = (search_len > 0);
+      //Esc closes the bar instead of the window while it is open
+      rl_set_exit_key(KEY_NULL);
+    }
+    if(search_mode && rl_is_key_pressed(KEY_ESCAPE)){
+      search_mode = false;
+      search_found = false;
+      replace_mode = false;
+      rl_set_exit_key(KEY_ESCAPE);
+    }
+    //Node pointers in the last match may be gone after an edit
+    if(search_found && (search_version != text_version))
+      search_found = false;
 
-    press_count = get_key_count(&recorder, KEY_TAB);
-    for(int i = 0; i < 4 * press_count; ++i){
-      ins_char_left(&curr_pos, ' ');
-      blink_now = true;
+    if(search_mode){
+      if((rl_is_key_down(KEY_LEFT_CONTROL) ||
+	  rl_is_key_down(KEY_RIGHT_CONTROL)) &&
+	 rl_is_key_pressed(KEY_R)){
+	search_regex = !search_regex;
+	search_missed = false;
+	search_typed = true;
+      }
+      if(replace_mode && (get_key_count(&recorder, KEY_TAB) % 2))
+	replace_focus = !replace_focus;
+      int char_code;
+      while((char_code = rl_get_char_pressed())){
+	replaced_count = 0;
+	if(replace_focus){
+	  if(replace_len + 1 < sizeof(replace_text))
+	    replace_text[replace_len++] = (char)char_code;
+	  continue;
+	}
+	if(search_len + 1 < sizeof(search_query))
+	  search_query[search_len++] = (char)char_code;
+	search_missed = false;
+	search_re_stale = true;
+	search_typed = true;
+      }
+      press_count = get_key_count(&recorder, KEY_BACKSPACE);
+      for(int i = 0; i < press_count; ++i){
+	replaced_count = 0;
+	if(replace_focus){
+	  if(replace_len > 0)
+	    replace_len--;
+	  continue;
+	}
+	if(0 == search_len)
+	  break;
+	search_len--;
+	search_missed = false;
+	search_re_stale = true;
+	search_typed = true;
+      }
+
+      if(search_typed && !search_regex){
+	search_typed = false;
+	search_found = false;
+	StringView needle = {.base = search_query, .len = search_len};
+	if(search_len > 0){
+	  search_set_update(&search_set, head_node, needle);
+	  if(search_set_usable(&search_set)){
+	    if(search_set.count > 0){
+	      size_t inx = search_set_lower_bound(&search_set, search_origin);
+	      if(inx == search_set.count)
+		inx = 0;
+	      size_t start = search_set.starts[inx];
+	      search_match.start = offset_location(head_node, start);
+	      search_match.end = offset_location(head_node, start + search_len);
+	      search_found = true;
+	    }
+	  }
+	  else{
+	    //Too many matches to keep, look for the next one directly
+	    TextLocation origin = offset_location(head_node, search_origin);
+	    search_found =
+	      find_next((TextRange){.start = origin}, needle, &search_match) ||
+	      find_next((TextRange){.start = {.node = head_node}, .end = origin},
+			needle, &search_match);
+	  }
+	  search_missed = !search_found;
+	  if(search_found){
+	    snap_cursor_right(&search_match.start);
+	    snap_cursor_right(&search_match.end);
+	    curr_pos = search_match.start;
+	    search_version = text_version;
+	    blink_now = true;
+	  }
+	}
+      }
+
+      press_count = get_key_count(&recorder, KEY_ENTER);
+      bool replace_now = replace_mode && (press_count > 0) &&
+	(rl_is_key_down(KEY_LEFT_CONTROL) || rl_is_key_down(KEY_RIGHT_CONTROL));
+      if(replace_now && (search_len > 0)){
+	press_count = 0;
+	StringView needle = {.base = search_query, .len = search_len};
+	if(search_regex && search_re_stale){
+	  regex_free(search_re);
+	  search_re = regex_compile(needle);
+	  search_re_stale = false;
+	}
+	Regex* re = search_regex ? search_re : nullptr;
+	size_t cursor = location_offset(head_node, curr_pos);
+	size_t count = 0;
+	LinkedNativeString* replaced = nullptr;
+	if(re || !search_regex)
+	  replaced = replace_all(head_node, re, needle,
+				 (StringView){.base = replace_text,
+					      .len = replace_len},
+				 &cursor, &count);
+	if(replaced){
+	  free_chunk_list(undo_head);
+	  undo_head = head_node;
+	  undo_cursor = location_offset(head_node, curr_pos);
+	  undo_version = text_version;
+	  head_node = replaced;
+	  curr_pos = offset_location(head_node, cursor);
+	  fold_set_free(&fold_set);
+	  wrap_layout_free(&wrap_layout);
+	  blink_now = true;
+	}
+	else
+	  count = 0;
+	replaced_count = count;
+	search_found = false;
+	search_missed = (0 == count);
+      }
+      for(int i = 0; i < press_count; ++i){
+	StringView needle = {.base = search_query, .len = search_len};
+	if(search_regex && search_re_stale){
+	  regex_free(search_re);
+	  search_re = regex_compile(needle);
+	  search_re_stale = false;
+	}
+	Regex* re = search_regex ? search_re : nullptr;
+	if(search_regex && (nullptr == re)){
+	  search_found = false;
+	  search_missed = true;
+	  break;
+	}
+	bool backwards = rl_is_key_down(KEY_LEFT_SHIFT) ||
+	  rl_is_key_down(KEY_RIGHT_SHIFT);
+	TextLocation text_start = {.node = head_node};
+	TextLocation from = curr_pos;
+	bool found;
+	if(backwards){
+	  found = search_step(re, needle,
+			      (TextRange){.start = text_start, .end = from},
+			      true, &search_match) ||
+	    search_step(re, needle, (TextRange){.start = from},
+			true, &search_match);
+	}
+	else{
+	  //Step off the match we are sitting on
+	  if(search_found && location_eq(from, search_match.start))
+	    move_cursor_right(&from);
+	  found = search_step(re, needle, (TextRange){.start = from},
+			      false, &search_match) ||
+	    search_step(re, needle,
+			(TextRange){.start = text_start, .end = from},
+			false, &search_match);
+	}
+	search_found = found;
+	search_missed = !found;
+	if(found){
+	  curr_pos = search_match.start;
+	  search_version = text_version;
+	  blink_now = true;
+	}
+      }
     }
+    else{
+      //Text input section
+      int char_code ;
+
+      bool typed = false;
+      while((char_code = rl_get_char_pressed())){
+	//The space of Ctrl+Space
+	if(ctrl_down && (' ' == char_code))
+	  continue;
+	ins_char_left(&curr_pos, char_code);
+	typed = true;
+	blink_now = true;
+      }
+
+      //key pressed or (key down and time from last keypress > smthing)
+
+      press_count = get_key_count(&recorder, KEY_ENTER);
+      for(int i  = 0 ;i < press_count; ++i){
+	ins_char_left(&curr_pos,  '\n');
+	blink_now = true;
+      }
+
+
+      press_count = get_key_count(&recorder, KEY_TAB);
+      //The candidates are for the prefix as it was before anything typed now
+      if(complete_mode && press_count && !typed &&
+	 (complete_pick < complete_count)){
+	press_count = 0;
+	for(size_t i = complete_prefix; i < complete_lens[complete_pick]; ++i)
+	  ins_char_left(&curr_pos, complete_words[complete_pick][i]);
+	complete_mode = false;
+	rl_set_exit_key(KEY_ESCAPE);
+	blink_now = true;
+      }
+      for(int i = 0; i < 4 * press_count; ++i){
+	ins_char_left(&curr_pos, ' ');
+	blink_now = true;
+      }
     
-    press_count = get_key_count(&recorder, KEY_BACKSPACE);
-    for(int i = 0; i < press_count; ++i){
-      del_char_left(&curr_pos);
-      blink_now = true;
+      press_count = get_key_count(&recorder, KEY_BACKSPACE);
+      for(int i = 0; i < press_count; ++i){
+	del_char_left(&curr_pos);
+	blink_now = true;
+      }
+
+      press_count = get_key_count(&recorder, KEY_DELETE);
+      for(int i = 0; i < press_count; ++i){
+	del_char_right(&curr_pos);
+	blink_now = true;
+      }
     }
 
-    press_count = get_key_count(&recorder, KEY_DELETE);
-    for(int i = 0; i < press_count; ++i){
-      del_char_right(&curr_pos);
+    //Undo, or redo, of the last replace all
+    if((rl_is_key_down(KEY_LEFT_CONTROL) ||
+	rl_is_key_down(KEY_RIGHT_CONTROL)) &&
+       rl_is_key_pressed(KEY_Z) && undo_head &&
+       (undo_version == text_version)){
+      size_t cursor = location_offset(head_node, curr_pos);
+      LinkedNativeString* swapped = head_node;
+      head_node = undo_head;
+      undo_head = swapped;
+      //Stamps of the list coming back are from before, it counts as new text
+      text_version++;
+      for(LinkedNativeString* node = head_node; node; node = node->next)
+	mark_chunk_dirty(node);
+      curr_pos = offset_location(head_node, undo_cursor);
+      fold_set_free(&fold_set);
+      wrap_layout_free(&wrap_layout);
+      undo_cursor = cursor;
+      undo_version = text_version;
+      search_found = false;
       blink_now = true;
     }
+    if(undo_head && (undo_version != text_version)){
+      free_chunk_list(undo_head);
+      undo_head = nullptr;
+    }
 
     //Clean up empty nodes and move curr_pos if one of them
     {
@@ -696,6 +7875,8 @@ int main(int argc, char* argv[]){
 	  //This is head
 	  head_node = head_node->next;
 	  head_node->prev = nullptr;
+	  //Everything after a dropped chunk has shifted
+	  mark_chunk_dirty(head_node);
 	  if(curr_pos.node == node){
 	    curr_pos.node = head_node;
 	    curr_pos.offset = 0;
@@ -710,6 +7891,7 @@ int main(int argc, char* argv[]){
 	  tmp->prev->next = tmp->next;
 	  if(tmp->next)
 	    tmp->next->prev = tmp->prev;
+	  mark_chunk_dirty(tmp->next);
 	  if(curr_pos.node == tmp){
 	    curr_pos.node = tmp->prev;
 	    curr_pos.offset = tmp->prev->str.len;
@@ -721,98 +7903,512 @@ int main(int argc, char* argv[]){
       }
     }
 
-    //Setup keywords to highlight
-    //Grossly inefficient, doing this each frame
-    //more so when the whole string , in and out of screen is already being travesed
-    TextRange whole_text = {
-      .start = head_node
-    };
-    TextRange* captured_substrs = nullptr;
-    size_t substr_count = 0;
-    size_t curr_substr = 0;
-    collect_occurances(whole_text, keys_to_color, _countof(keys_to_color),
-		       &captured_substrs, &substr_count);
-    bool in_color_region = false;
+    trigram_index_step(trigram_index, head_node);
+    bool brackets_ready = chunk_index_refresh(&chunk_index, head_node);
+
+    if(!brackets_ready)
+      fold_set_free(&fold_set);
+    else if(fold_set.version != text_version){
+      size_t line = chunk_index_line_of(&chunk_index, curr_pos);
+      if(line < fold_pivot)
+	fold_pivot = line;
+      fold_set_update(&fold_set, &chunk_index, fold_pivot,
+		      (long)chunk_index_line_count(&chunk_index) - (long)fold_lines);
+    }
+    if(brackets_ready){
+      outline_refresh(&outline, &chunk_index);
+      if(ctrl_down && rl_is_key_pressed(KEY_O))
+	outline_open = !outline_open;
+      uint32_t id;
+      const OutlineSymbol* symbol;
+      if(rl_is_key_pressed(KEY_F12) && ident_at(&chunk_index, curr_pos, &id) &&
+	 (symbol = outline_find(&outline, id))){
+	chunk_index_location_at(&chunk_index, symbol->offset, &curr_pos);
+	blink_now = true;
+      }
+    }
+    //Whatever put the cursor on a hidden line, a search say, unfolds it
+    if(brackets_ready && fold_set.outer_count){
+      size_t line = chunk_index_line_of(&chunk_index, curr_pos);
+      if(fold_set_hiding(&fold_set, line) < fold_set.outer_count)
+	fold_set_open(&fold_set, line);
+    }
+
+    //Partner of the bracket under the cursor, or else just before it
+    TextLocation pair_a = curr_pos;
+    TextLocation pair_b;
+    bool pair_found = brackets_ready &&
+      bracket_match(&chunk_index, pair_a, &pair_b);
+    if(brackets_ready && !pair_found){
+      move_cursor_left(&pair_a);
+      pair_found = !location_eq(pair_a, curr_pos) &&
+	bracket_match(&chunk_index, pair_a, &pair_b);
+    }
+
+    //Candidates for the word left of the cursor
+    if(complete_mode){
+      complete_count = 0;
+      char prefix[IDENT_MAX_LEN];
+      size_t prefix_len = 0;
+      TextLocation at = curr_pos;
+      while(brackets_ready && (prefix_len < IDENT_MAX_LEN)){
+	snap_cursor_left(&at);
+	if(0 == at.offset)
+	  break;
+	unsigned char c = at.node->str.base[at.offset - 1];
+	if(!(lexer->word_bytes[c] & LEX_WORD_PART))
+	  break;
+	prefix[IDENT_MAX_LEN - 1 - prefix_len++] = c;
+	at.offset--;
+      }
+      if(prefix_len > 0){
+	uint32_t ids[_countof(complete_lens)];
+	complete_count = ident_complete(&ident_trie,
+					(StringView){
+					  .base = prefix + IDENT_MAX_LEN - prefix_len,
+					  .len = prefix_len
+					},
+					ids, _countof(ids));
+	for(size_t i = 0; i < complete_count; ++i)
+	  complete_lens[i] = ident_spell(&ident_trie, ids[i], complete_words[i]);
+      }
+      complete_prefix = prefix_len;
+      if(complete_pick >= complete_count)
+	complete_pick = complete_count ? (complete_count - 1) : 0;
+    }
+
+    if(brackets_ready &&
+       wrap_layout_sync(&wrap_layout, &chunk_index, &fold_set,
+			x0, rl_get_screen_width(), font_size)){
+      wrap_layout_step(&wrap_layout, &chunk_index, 2048);
+      viewport_settle(&view, &wrap_layout, &chunk_index, &fold_set);
+      //A click on the text puts the cursor there, the outline panel and the
+      //find bar take their own clicks
+      RlVector2 mouse = rl_get_mouse_position();
+      int screen_w = rl_get_screen_width();
+      bool on_panel = outline_open && outline.count &&
+	(mouse.x >= screen_w - screen_w / 4);
+      bool on_bar = search_mode &&
+	(mouse.y >= rl_get_screen_height() - (font_size + 10));
+      if(rl_is_mouse_button_pressed(MOUSE_BUTTON_LEFT) && !on_panel && !on_bar &&
+	 viewport_hit(&view, &wrap_layout, &chunk_index, &fold_set,
+		      mouse.x, mouse.y, &curr_pos))
+	blink_now = true;
+    }
+    else
+      wrap_layout_free(&wrap_layout);
+
+    //Hand the text to the highlighter and pick up whatever it finished
+    submit_highlight(&highlighter, head_node);
+    HighlightResult* fresh_spans = take_highlight(&highlighter);
+    if(fresh_spans){
+      free(spans);
+      spans = fresh_spans;
+    }
+    //Spans are valid up to the first chunk edited after they were computed,
+    //past that text is drawn plain until the worker catches up
+    bool spans_apply = (nullptr != spans);
+    size_t curr_span = 0;
+    size_t draw_offset = 0;
+    LinkedNativeString* last_drawn_node = nullptr;
+    bool in_match = false;
+    //Every other match of the query gets a lighter mark
+    bool mark_all = search_mode && !search_regex &&
+      search_set_usable(&search_set) && (search_set.query_len == search_len);
+    size_t next_hit = 0;
+    BracketEvent* chunk_events = nullptr;
+    size_t chunk_event_count = 0;
+    size_t next_event = 0;
+    int bracket_depth[BRACKET_KINDS];
+    size_t draw_line = 0;
+    size_t next_fold = 0;
+    //Rows of the line being drawn, the width decides when there is none
+    const LineLayout* row_layout = nullptr;
+    size_t next_break = 0;
+    size_t line_offset = 0;
+    //Occurrences of the identifier under the cursor in chunks on screen
+    uint32_t occ_id = 0;
+    bool occ_found = brackets_ready && ident_at(&chunk_index, curr_pos, &occ_id);
+    RlColor occ_color = {215, 228, 245, 255};
+    HighlightSpan* occ_spans = nullptr;
+    size_t occ_count = 0;
+    size_t next_occ = 0;
     int width = rl_get_screen_width();
     int height = rl_get_screen_height();    
+    TextRun text_run = {.batch = &text_batch};
     int cx = x0;
-    int cy = y0;
+    int cy = view.y;
+    //The cursor reaches 2 above its row, so a band starts there
+    text_batch_row(&text_batch, &text_run, cy - 2, font_size + 10);
 
     TextLocation draw_cursor = {
       .node = head_node, .offset = 0
     };
+    //Straight to the first line on screen, whatever keeps a running place
+    //is brought up to it
+    if(brackets_ready &&
+       chunk_index_line_start(&chunk_index, view.line, &draw_cursor)){
+      draw_offset = chunk_index_offset_of(&chunk_index, draw_cursor);
+      draw_line = view.line;
+      next_fold = fold_set_from(&fold_set, view.line);
+      size_t leaf = chunk_index_leaf_of(&chunk_index, draw_cursor.node);
+      if(spans_apply){
+	if(chunk_index_prefix(&chunk_index, leaf).stamp > spans->version)
+	  spans_apply = false;
+	size_t lo = 0;
+	size_t hi = spans->count;
+	while(lo < hi){
+	  size_t mid = lo + (hi - lo) / 2;
+	  if(spans->spans[mid].end <= draw_offset)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+	curr_span = lo;
+      }
+      if(mark_all){
+	size_t lo = 0;
+	size_t hi = search_set.count;
+	while(lo < hi){
+	  size_t mid = lo + (hi - lo) / 2;
+	  if(search_set.starts[mid] + search_len <= draw_offset)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+	next_hit = lo;
+      }
+      if(search_found){
+	size_t match_start = chunk_index_offset_of(&chunk_index, search_match.start);
+	size_t match_end = chunk_index_offset_of(&chunk_index, search_match.end);
+	in_match = (match_start < draw_offset) && (draw_offset < match_end);
+      }
+      line_offset = draw_offset;
+      row_layout = wrap_layout_at(&wrap_layout, &chunk_index, draw_line);
+    }
     snap_cursor_right(&curr_pos);
-    while(true){
+    while(cy < height){
       snap_cursor_right(&draw_cursor);
+      //The cursor sits in the gap before the letter and takes no room, so
+      //where lines wrap does not depend on it
       if((curr_pos.node == draw_cursor.node) &&
 	 (curr_pos.offset == draw_cursor.offset)){
-	int wid = 3;
-	if((10 + cx + wid) >= (width + x0)){
-	  cy += 10 + font_size;
-	  cx = x0;
-	}
 	if(blink_now)
-	  rl_draw_rectangle(cx,cy-2,wid,font_size+10,RED);
-	cx += wid;
+	  text_batch_rect(&text_batch, cx - 2, cy - 2, CURSOR_WIDTH,
+			  font_size + 10, RED, false);
+	cursor_x = cx;
+	cursor_y = cy;
       }
       if((nullptr == draw_cursor.node->next) &&
 	  (draw_cursor.offset >= draw_cursor.node->str.len))
 	break;
 
       //Coloring logic
-      if(substr_count > curr_substr){
-	if(in_color_region){
-	  if((captured_substrs[curr_substr].end.node == draw_cursor.node) &&
-	     (captured_substrs[curr_substr].end.offset == draw_cursor.offset)){
-	    in_color_region = false;
-	    curr_substr++;
-	  }
+      if(last_drawn_node != draw_cursor.node){
+	last_drawn_node = draw_cursor.node;
+	if(spans_apply && (last_drawn_node->stamp > spans->version))
+	  spans_apply = false;
+	//Depth at the chunk start comes from the tree, only chunks that
+	//start on screen are lexed for their brackets
+	free(chunk_events);
+	chunk_events = nullptr;
+	chunk_event_count = 0;
+	next_event = 0;
+	size_t leaf = brackets_ready ?
+	  chunk_index_leaf_of(&chunk_index, last_drawn_node) : chunk_index.count;
+	if((leaf < chunk_index.count) && (cy < height)){
+	  ChunkSummary before = chunk_index_prefix(&chunk_index, leaf);
+	  for(int k = 0; k < BRACKET_KINDS; ++k)
+	    bracket_depth[k] = before.net[k];
+	  chunk_events = chunk_brackets(&chunk_index, leaf, &chunk_event_count);
+	  if(occ_found)
+	    ident_occurrences(&chunk_index, leaf, occ_id,
+			      draw_offset - draw_cursor.offset, occ_color,
+			      &occ_spans, &occ_count);
 	}
-	//This for if another keyword also starts immediately after
-	if(!in_color_region){
-	  if((captured_substrs[curr_substr].start.node == draw_cursor.node) &&
-	     (captured_substrs[curr_substr].start.offset == draw_cursor.offset)){
-	    in_color_region = true;
-	  }
+      }
+      RlColor text_color = BLACK;
+      enum TextStyle text_style = STYLE_REGULAR;
+      if(spans_apply){
+	const HighlightSpan* span = span_covering(spans->spans, spans->count,
+						  &curr_span, draw_offset);
+	if(span){
+	  text_color = span->color;
+	  text_style = span->style;
 	}
       }
+      const HighlightSpan* occurrence = span_covering(occ_spans, occ_count,
+						      &next_occ, draw_offset);
+      //A fold may have jumped over some
+      while((next_event < chunk_event_count) &&
+	    (chunk_events[next_event].offset < (size_t)draw_cursor.offset)){
+	BracketEvent ev = chunk_events[next_event++];
+	bracket_depth[ev.kind] += ev.dir;
+      }
+      if((next_event < chunk_event_count) &&
+	 (chunk_events[next_event].offset == (size_t)draw_cursor.offset)){
+	BracketEvent ev = chunk_events[next_event++];
+	if(ev.dir < 0)
+	  bracket_depth[ev.kind]--;
+	int depth = bracket_depth[ev.kind];
+	if(depth >= 0)
+	  text_color = bracket_colors[depth % _countof(bracket_colors)];
+	else
+	  text_color = RED;
+	if(ev.dir > 0)
+	  bracket_depth[ev.kind]++;
+      }
 
       char ch = draw_cursor.node->str.base[draw_cursor.offset];
-      	
-      int wid = get_char_width(ch, font_size);
+      int glyph = ((unsigned char)ch < 0x80) ? ch : glyph_at(draw_cursor);
+      int wid = get_char_width(glyph, font_size);
+      bool fold_starts = ('\n' == ch) && (next_fold < fold_set.outer_count) &&
+	(fold_set.outer[next_fold].start_line == draw_line);
+      if(fold_starts){
+	int fold_x = cx;
+	for(const char* dots = " ..."; *dots; ++dots){
+	  int dot_wid = get_char_width(*dots, font_size);
+	  text_run_push(&text_run, *dots, STYLE_REGULAR, fold_x, cy, dot_wid,
+			font_size, GRAY);
+	  fold_x += dot_wid;
+	}
+      }
 
-      if((0 > wid) || ((10 + cx + wid) >= (width + x0))){
+      bool row_ends;
+      if(row_layout){
+	row_ends = ('\n' == ch) || ((next_break + 1 < row_layout->rows) &&
+				    (draw_offset - line_offset ==
+				     row_layout->breaks[next_break]));
+	if(row_ends && ('\n' != ch))
+	  next_break++;
+      }
+      else
+	row_ends = (0 > wid) || ((10 + cx + wid) >= (width + x0));
+      if(row_ends){
 	cy += 10 + font_size;
 	cx = x0;
+	text_batch_row(&text_batch, &text_run, cy - 2, font_size + 10);
+      }
+      if(search_found){
+	if(location_eq(draw_cursor, search_match.start))
+	  in_match = true;
+	if(location_eq(draw_cursor, search_match.end))
+	  in_match = false;
       }
-      char letter[2] = {ch};
-      draw_text(letter, cx, cy, font_size, (in_color_region?BLUE:BLACK));
-      cx += wid;
+      if(mark_all){
+	while((next_hit < search_set.count) &&
+	      (search_set.starts[next_hit] + search_len <= draw_offset))
+	  next_hit++;
+	if((next_hit < search_set.count) &&
+	   (search_set.starts[next_hit] <= draw_offset) && (wid > 0))
+	  text_batch_rect(&text_batch, cx, cy, wid, font_size,
+			  (RlColor){255, 245, 180, 255}, false);
+      }
+      if(occurrence && (wid > 0))
+	text_batch_rect(&text_batch, cx, cy, wid, font_size, occurrence->color,
+			false);
+      if(in_match && (wid > 0))
+	text_batch_rect(&text_batch, cx, cy, wid, font_size, YELLOW, false);
+      if(pair_found && (location_eq(draw_cursor, pair_a) ||
+			location_eq(draw_cursor, pair_b)))
+	text_batch_rect(&text_batch, cx, cy, wid, font_size, DARKGRAY, true);
+      text_run_push(&text_run, glyph, text_style, cx, cy, wid, font_size,
+		    text_color);
+      //A line break starts the next row at x0
+      if(0 < wid)
+	cx += wid;
+      draw_offset++;
       move_cursor_right(&draw_cursor);
+      if('\n' == ch)
+	draw_line++;
+      //Straight to the line the fold ends on, the chunks in between are
+      //never looked at
+      if(fold_starts){
+	FoldRegion fold = fold_set.outer[next_fold++];
+	TextLocation fold_end;
+	if(chunk_index_line_start(&chunk_index, fold.end_line, &fold_end)){
+	  draw_cursor = fold_end;
+	  draw_offset = chunk_index_offset_of(&chunk_index, fold_end);
+	  draw_line = fold.end_line;
+	  in_match = false;
+	  size_t leaf = chunk_index_leaf_of(&chunk_index, fold_end.node);
+	  if(spans_apply &&
+	     (chunk_index_prefix(&chunk_index, leaf).stamp > spans->version))
+	    spans_apply = false;
+	}
+      }
+      if('\n' == ch){
+	line_offset = draw_offset;
+	next_break = 0;
+	row_layout = brackets_ready ?
+	  wrap_layout_at(&wrap_layout, &chunk_index, draw_line) : nullptr;
+      }
+    }
+    text_run_flush(&text_run);
+    display_cache_draw(&display_cache, &text_batch, width, height);
+    free(chunk_events);
+    free(occ_spans);
+
+    if(outline_open && brackets_ready && outline.count){
+      int row = font_size + 4;
+      int panel_w = width / 4;
+      int panel_x = width - panel_w;
+      rl_draw_rectangle(panel_x, 0, panel_w, height, (RlColor){245, 245, 245, 255});
+      //The symbol the cursor is in or after, kept in the middle
+      size_t cursor_offset = chunk_index_offset_of(&chunk_index, curr_pos);
+      size_t lo = 0;
+      size_t hi = outline.count;
+      while(lo < hi){
+	size_t mid = lo + (hi - lo) / 2;
+	if(outline.symbols[mid].offset <= cursor_offset)
+	  lo = mid + 1;
+	else
+	  hi = mid;
+      }
+      size_t rows = height / row;
+      size_t first = (lo > rows / 2) ? (lo - rows / 2) : 0;
+      RlVector2 mouse = rl_get_mouse_position();
+      bool click = rl_is_mouse_button_pressed(MOUSE_BUTTON_LEFT) &&
+	(mouse.x >= panel_x);
+      for(size_t r = 0; (r < rows) && (first + r < outline.count); ++r){
+	const OutlineSymbol* symbol = outline.symbols + first + r;
+	int y = r * row;
+	if(first + r + 1 == lo)
+	  rl_draw_rectangle(panel_x, y, panel_w, row, (RlColor){200, 220, 255, 255});
+	char name[IDENT_MAX_LEN];
+	size_t len = ident_spell(&ident_trie, symbol->id, name);
+	draw_text(rl_text_format("%s%.*s%s",
+				 (OUTLINE_STRUCT == symbol->kind) ? "struct " : "",
+				 (int)len, name,
+				 (OUTLINE_FUNCTION == symbol->kind) ? "()" : ""),
+		  panel_x + 5, y + 2, font_size, BLACK);
+	if(click && (mouse.y >= y) && (mouse.y < y + row)){
+	  chunk_index_location_at(&chunk_index, symbol->offset, &curr_pos);
+	  blink_now = true;
+	}
+      }
+    }
+
+    if(complete_mode && complete_count){
+      int row = font_size + 4;
+      int box_w = 0;
+      for(size_t i = 0; i < complete_count; ++i){
+	int w = measure_text(rl_text_format("%.*s", (int)complete_lens[i],
+					    complete_words[i]), font_size);
+	if(w > box_w)
+	  box_w = w;
+      }
+      int box_y = cursor_y + font_size + 10;
+      rl_draw_rectangle(cursor_x, box_y, box_w + 10, row * complete_count,
+			(RlColor){240, 240, 240, 255});
+      for(size_t i = 0; i < complete_count; ++i){
+	if(i == complete_pick)
+	  rl_draw_rectangle(cursor_x, box_y + row * i, box_w + 10, row,
+			    (RlColor){200, 220, 255, 255});
+	draw_text(rl_text_format("%.*s", (int)complete_lens[i], complete_words[i]),
+		  cursor_x + 5, box_y + row * i + 2, font_size, BLACK);
+      }
+    }
+
+    if(search_mode){
+      int bar_height = font_size + 10;
+      rl_draw_rectangle(0, height - bar_height, width, bar_height, LIGHTGRAY);
+      const char* count_note = "";
+      if(!search_regex && search_len && (search_set.query_len == search_len))
+	count_note = (search_set.version == text_version) ?
+	  rl_text_format("  (%zu)", search_set.total) : "";
+      if(replaced_count > 0)
+	count_note = rl_text_format("  (%zu replaced)", replaced_count);
+      const char* replace_note = "";
+      if(replace_mode)
+	replace_note = rl_text_format("   %sReplace: %.*s",
+				      (replace_focus ? "> " : ""),
+				      (int)replace_len, replace_text);
+      draw_text(rl_text_format("%s%s: %.*s%s%s",
+			       ((replace_mode && !replace_focus) ? "> " : ""),
+			       (search_regex ? "Regex" : "Find"),
+			       (int)search_len, search_query, count_note,
+			       replace_note),
+		x0, height - bar_height + 5, font_size,
+		(search_missed ? RED : BLACK));
+    }
+
+    if(stats_open){
+      const char* stats = rl_text_format("frames/min: %zu (%zu so far)"
+					 "  text draws: %zu  rows drawn: %zu/%zu"
+					 "  atlases: %zu, %zu KB",
+					 frame_count.last_minute,
+					 frame_count.this_minute,
+					 frame_text_draws,
+					 display_cache.redrawn,
+					 display_cache.row_count,
+					 font_atlases.count,
+					 font_atlases.bytes >> 10);
+      draw_text(stats, width - measure_text(stats, font_size) - 10, 5,
+		font_size, DARKGRAY);
     }
-    if(substr_count > 0)
-      free(captured_substrs);
     
     rl_end_drawing();
+
+    //Nothing changes before input, a worker or the next deadline
+    bool idle = !bench_frames && (0 == display_cache.redrawn) &&
+      (0 == wrap_layout.unknown) &&
+      ((nullptr == trigram_index) || trigram_index->complete) &&
+      highlighter_settled(&highlighter) &&
+      font_atlases_settled(&font_atlases) && !input_waiting();
+    if(idle){
+      double deadline = prev_blink_time + 0.5;
+      if(last_save + autosave < deadline)
+	deadline = last_save + autosave;
+      wait_for_frame(deadline);
+    }
   }
   
-  file = fopen(file_name, "w");
-  if(nullptr == file){
-    printf("Error in opening file %s for writing\n", file_name);
+  if(bench_frames){
+    print_render_stats(&headless.total);
   }
   else{
-    LinkedNativeString* node_ptr = head_node;
-    while(node_ptr){
-      size_t i = 0;
-      for(; i < node_ptr->str.len; ++i){
-	fputc((int)node_ptr->str.base[i], file);
+    file = fopen(file_name, "w");
+    if(nullptr == file){
+      printf("Error in opening file %s for writing\n", file_name);
+    }
+    else{
+      LinkedNativeString* node_ptr = head_node;
+      while(node_ptr){
+	size_t i = 0;
+	for(; i < node_ptr->str.len; ++i){
+	  fputc((int)node_ptr->str.base[i], file);
+	}
+	node_ptr = node_ptr->next;
       }
-      node_ptr = node_ptr->next;
     }
   }
     
 
-  rl_unload_font(default_font);
+  stop_highlighter(&highlighter);
+  fold_set_free(&fold_set);
+  wrap_layout_free(&wrap_layout);
+  text_batch_free(&text_batch);
+  display_cache_free(&display_cache);
+  outline_free(&outline);
+  chunk_index_free(&chunk_index);
+  ident_trie_clear(&ident_trie);
+  lexer_free(lexer);
+  trigram_index_free(trigram_index);
+  trigram_index = nullptr;
+  pool_stop(worker_pool);
+  worker_pool = nullptr;
+  free(spans);
+  regex_free(search_re);
+  search_set_free(&search_set);
+  free_chunk_list(undo_head);
+
+  advance_cache_free(&advance_cache);
+  stop_font_atlases(&font_atlases);
+  face_chain_free(&face_chain);
+  if(frame_wake)
+    CloseHandle(frame_wake);
+  frame_wake = nullptr;
   rl_close_window();
   rl_free_lib();
   return 0;